@@ -1,5 +1,6 @@
 #include <fstream>
 #include <sstream>
+#include <getopt.h>
 #include <omp.h>
 #include "feature_min.h"
 #include "util.h"
@@ -23,57 +24,217 @@ using std::begin;
 using std::end;
 
 int classify_main(int argc, char *argv[]) {
-    int co, num_threads(1), emit_kraken(1), emit_fastq(0), emit_all(0), chunk_size(1 << 20), per_set(32);
-    bool canonicalize(true);
+    int co, num_threads(1), emit_kraken(1), emit_fastq(0), emit_all(0), chunk_size(0), load_flags(0), numa_mode(NUMA_NONE),
+        huge_pages(HUGE_PAGES_OFF), inflate_threads(0), window(0);
+    bool prefault(false), interleaved(false), emit_binary(false), compress(false), report_only(false);
+    size_t read_cache_bytes(0);
+    const char *report_path(nullptr), *names_path(nullptr);
+    double early_stop(0.), host_fraction(HostScreen::DEFAULT_FRACTION), read_fraction(1.);
+    u64 minimizer_sample(1);
+    const char *host_path(nullptr);
+    bool canonicalize(true), dedup_mates(true);
     std::ios_base::sync_with_stdio(false);
     std::FILE *ofp(stdout);
     if(argc < 4) {
         usage:
-        std::fprintf(stderr, "Usage:\n%s <dbpath> <tax_path> <inr1.fq> [Optional: <inr2.fq>]\n"
+        std::fprintf(stderr, "Usage:\n%s <dbpath>[,<dbpath>...] <tax_path> <inr1.fq> [Optional: <inr2.fq>]\n"
+                             "Either read file may be '-' for standard input; FIFOs and pipes are read as a stream.\n"
                              "Flags:\n-o:\tRedirect output to path instead of stdout.\n"
-                             "-c:\tSet chunk size. Default: %i\n"
                              "-a:\tEmit all records, not just classified.\n"
                              "-p:\tSet number of threads. [1] (Set -1 to use all threads.)\n"
                              "-k:\tEmit kraken-style output.\n"
                              "-K:\tDo not emit kraken-style output.\n"
                              "-f:\tEmit fastq-style output.\n"
                              "-K:\tDo not emit fastq-formatted output.\n"
+                             "-P:\tPrefault the whole database at load time (MAP_POPULATE).\n"
+                             "-W:\tStart asynchronous readahead of the whole database at load time.\n"
+                             "-R:\tAdvise the kernel that database access is random (disables readahead on faults).\n"
+                             "-L:\tCopy the database into private memory instead of using the file mapping.\n"
+                             "-Y:\tDo not check minimizers against the databases' Bloom prefilters (<dbpath>.bloom) before probing them.\n"
+                             "-D:\tReuse classifications of byte-identical reads (or pairs), caching up to <arg> MiB of results.\n"
+                             "-E:\tStop looking up a read's minimizers once its call is settled: the leading taxon is a leaf and its score exceeds\n"
+                             "   \tevery other's by more than <arg> (in (0, 1]) times the number left. With 1, calls are unchanged.\n"
+                             "-N:\tNUMA placement: 'interleave' spreads the database across nodes, 'replicate' copies it to each node.\n"
+                             "   \tEither way, threads are pinned to nodes in contiguous groups.\n"
+                             "-H:\tCopy the database into huge pages: 'thp' (transparent), '2m' or '1g' (explicit, from the hugetlb pool).\n"
+                             "-T:\tTouch every page of the database on all threads before classifying.\n"
+                             "-I:\tInput is interleaved paired-end: each read is followed by its mate in <inr1.fq>.\n"
+                             "--no-mate-dedup:\tLook up (and count) minimizers a pair's second mate shares with its first, as where mates overlap.\n"
+                             "-l:\tLong-read mode: classify windows of <arg> bases independently and call each read from its windows' calls,\n"
+                             "   \twhich are listed in place of the hit runs. Single-end input only.\n"
+                             "-b:\tEmit compact binary records instead of text; 'bonsai decode' converts them to kraken-style output.\n"
+                             "-z:\tCompress output (gzip, or zstd in zstd-enabled builds).\n"
+                             "-Z:\tNumber of threads inflating each BGZF or multi-frame zstd input file. [Default: a quarter of -p, at least 1.]\n"
+                             "-r/--report:\tWrite a Kraken-style clade report to <arg>, rewritten every minute while classifying.\n"
+                             "-n/--names:\tTake scientific names for the report from NCBI names.dmp <arg>. [Default: taxids only.]\n"
+                             "--report-only:\tWrite only the clade report, to -r's path or else the output, skipping per-read output.\n"
+                             "-X:\tDrop host reads before classification, screening them against host set <arg> (see bonsai hostset and bonsai screen).\n"
+                             "-x:\tFraction of a read's minimizers which must be in the host set for it to count as host. [0.3]\n"
+                             "--sample-reads:\tClassify only a fraction <arg> of reads (or pairs), chosen by a hash of their names so runs agree.\n"
+                             "   \tThe report then gives a 95%% confidence interval for each percentage.\n"
+                             "--sample-minimizers:\tLook up one in <arg> of each read's minimizers, chosen by hash.\n"
                              "\nIf -f and -k are set, full kraken output will be contained in the fastq comment field."
-                             "\n  Default: kraken-style only output.\n",
-                 *argv, 1 << 14);
+                             "\n  Default: kraken-style only output.\n"
+                             "\nSeveral comma-separated databases sharing k, window size and spacing are classified in one pass;\n"
+                             "each record then lists every database's taxon, comma-separated, and one block of counts and runs per database.\n",
+                 *argv);
         std::exit(EXIT_FAILURE);
     }
-    while((co = getopt(argc, argv, "Cc:p:o:S:afFkKh?")) >= 0) {
+    static const struct option long_options[] {
+        {"report",      required_argument, nullptr, 'r'},
+        {"names",       required_argument, nullptr, 'n'},
+        {"report-only", no_argument,       nullptr, 'O'},
+        {"no-mate-dedup", no_argument,     nullptr, 'U'},
+        {"sample-reads",  required_argument, nullptr, 'G'},
+        {"sample-minimizers", required_argument, nullptr, 'M'},
+        {nullptr, 0, nullptr, 0}
+    };
+    while((co = getopt_long(argc, argv, "Cc:D:E:H:l:N:n:p:o:r:S:X:x:Z:abfFIkKLPRTWYzh?", long_options, nullptr)) >= 0) {
         switch(co) {
             case 'h': case '?': goto usage;
             case 'C': canonicalize = false; break;
             case 'a': emit_all = 1; break;
-            case 'c': chunk_size = std::atoi(optarg); break;
+            case 'b': emit_binary = true; break;
+            case 'c': chunk_size = std::atoi(optarg);
+                      LOG_WARNING("-c is deprecated: it still overrides the batch size, which is otherwise chosen automatically from the number of threads.\n"); break;
+            case 'D': read_cache_bytes = std::strtoull(optarg, nullptr, 10) << 20; break;
+            case 'E': early_stop = std::atof(optarg);
+                      if(early_stop <= 0. || early_stop > 1.) LOG_EXIT("-E must be in (0, 1], not '%s'.\n", optarg);
+                      break;
             case 'F': emit_fastq  = 0; break;
+            case 'I': interleaved = true; break;
+            case 'l': window = std::atoi(optarg);
+                      if(window <= 0) LOG_EXIT("-l must be a positive number of bases, not '%s'.\n", optarg);
+                      break;
+            case 'H': if(std::strcmp(optarg, "thp") == 0)     huge_pages = HUGE_PAGES_THP;
+                      else if(std::strcmp(optarg, "2m") == 0) huge_pages = HUGE_PAGES_2M;
+                      else if(std::strcmp(optarg, "1g") == 0) huge_pages = HUGE_PAGES_1G;
+                      else LOG_EXIT("-H must be 'thp', '2m' or '1g', not '%s'.\n", optarg);
+                      break;
+            case 'N': if(std::strcmp(optarg, "interleave") == 0)     numa_mode = NUMA_INTERLEAVE;
+                      else if(std::strcmp(optarg, "replicate") == 0) numa_mode = NUMA_REPLICATE;
+                      else LOG_EXIT("-N must be 'interleave' or 'replicate', not '%s'.\n", optarg);
+                      break;
             case 'f': emit_fastq  = 1; break;
             case 'K': emit_kraken = 0; break;
             case 'k': emit_kraken = 1; break;
             case 'p': num_threads = std::atoi(optarg); break;
             case 'o': ofp = std::fopen(optarg, "w"); break;
-            case 'S': per_set = std::atoi(optarg); break;
+            case 'S': LOG_WARNING("-S is deprecated and ignored: work is split into tasks of balanced numbers of bases.\n"); break;
+            case 'L': load_flags |= DB_NO_MMAP;       break;
+            case 'P': load_flags |= DB_MMAP_POPULATE; break;
+            case 'R': load_flags |= DB_MMAP_RANDOM;   break;
+            case 'T': prefault = true;                break;
+            case 'W': load_flags |= DB_MMAP_WILLNEED; break;
+            case 'Y': load_flags |= DB_NO_PREFILTER;  break;
+            case 'z': compress = true;                break;
+            case 'Z': inflate_threads = std::atoi(optarg); break;
+            case 'r': report_path = optarg;           break;
+            case 'n': names_path = optarg;            break;
+            case 'O': report_only = true;             break;
+            case 'U': dedup_mates = false;            break;
+            case 'G': read_fraction = std::atof(optarg);
+                      if(read_fraction <= 0. || read_fraction > 1.) LOG_EXIT("--sample-reads must be in (0, 1], not '%s'.\n", optarg);
+                      break;
+            case 'M': minimizer_sample = std::strtoull(optarg, nullptr, 10);
+                      if(minimizer_sample == 0) LOG_EXIT("--sample-minimizers must be a positive integer, not '%s'.\n", optarg);
+                      break;
+            case 'X': host_path = optarg;             break;
+            case 'x': host_fraction = std::atof(optarg);
+                      if(host_fraction <= 0. || host_fraction > 1.) LOG_EXIT("-x must be in (0, 1], not '%s'.\n", optarg);
+                      break;
         }
     }
     LOG_ASSERT(ofp);
+    if(emit_binary && emit_fastq) LOG_EXIT("-b and -f are mutually exclusive.\n");
+    if(report_only && (emit_binary || emit_fastq || compress)) LOG_EXIT("--report-only excludes -b, -f and -z.\n");
     switch(argc - optind) {
         default: goto usage;
-        case 3:  LOG_DEBUG("Processing in single-end mode.\n"); break;
-        case 4:  LOG_DEBUG("Processing in paired-end mode.\n"); break;
-    }
-    Database<khash_t(c)> db(argv[optind]);
-    //reportDB<khash_t(c)>(&db, stderr);
-    //for(auto &i: db._s) --i; // subtract by one since we'll re-subtract during construction.
-    ClassifierGeneric<score::Lex> c(db.db_, db.s_, db.k_, db.k_, num_threads,
-                                   emit_all, emit_fastq, emit_kraken, canonicalize);
+        case 3:  LOG_DEBUG("Processing in %s mode.\n", interleaved ? "interleaved paired-end": "single-end"); break;
+        case 4:  if(interleaved) LOG_EXIT("-I takes a single, interleaved, input file.\n");
+                 LOG_DEBUG("Processing in paired-end mode.\n"); break;
+    }
+    const auto load_start(std::chrono::system_clock::now());
+    // Several comma-separated databases are classified in one pass over the reads.
+    std::vector<LoadedTable> loaded, replicas;
+    std::vector<std::string> db_paths;
+    for(std::string paths(argv[optind]); !paths.empty();) {
+        const size_t comma(std::min(paths.find(','), paths.size()));
+        db_paths.push_back(paths.substr(0, comma));
+        loaded.emplace_back(db_paths.back().data(), load_flags);
+        if(loaded.back().k() != loaded[0].k() || loaded.back().w() != loaded[0].w() || loaded.back().s() != loaded[0].s())
+            LOG_EXIT("Database %s was built with a different k, window size or spacing than the first database.\n", paths.substr(0, comma).data());
+        paths.erase(0, comma + 1);
+    }
+    std::unique_ptr<ClassifierGeneric<score::Lex>> cp;
+    if(loaded[0].st_) {
+        cp.reset(new ClassifierGeneric<score::Lex>(loaded[0].st_.get(), num_threads, emit_all, emit_fastq, emit_kraken, canonicalize));
+    } else {
+        const Database<khash_t(c)> &db(*loaded[0].db_);
+        //reportDB<khash_t(c)>(&db, stderr);
+        //for(auto &i: db._s) --i; // subtract by one since we'll re-subtract during construction.
+        cp.reset(new ClassifierGeneric<score::Lex>(db.db_, db.s_, db.k_, db.k_, num_threads,
+                                                   emit_all, emit_fastq, emit_kraken, canonicalize));
+    }
+    ClassifierGeneric<score::Lex> &c(*cp);
+    c.set_emit_binary(emit_binary);
+    c.set_report_only(report_only);
+    c.early_stop_ = early_stop;
+    c.window_     = window;
+    c.dedup_mates_ = dedup_mates;
+    c.set_read_fraction(read_fraction);
+    c.set_minimizer_sample(minimizer_sample);
+    std::unique_ptr<StaticTaxTable> host_set;
+    std::unique_ptr<HostScreen>     host_screen;
+    if(host_path) {
+        host_set.reset(new StaticTaxTable(host_path, load_flags));
+        host_screen.reset(new HostScreen(*host_set, host_fraction, canonicalize));
+        c.host_ = host_screen.get();
+        if(!host_screen->compatible(c.enc_.sp_))
+            LOG_INFO("Host set %s was built with a different k, window size or spacing than the database; reads are encoded for it separately.\n", host_path);
+    }
+    c.tables_[0][0] = loaded[0].table(); // With its prefilter, if any
+    for(size_t d(1); d < loaded.size(); ++d) c.add_database(loaded[d].table());
+    const std::vector<int> nodes(numa_mode ? numa::nodes(): std::vector<int>());
+    if(numa_mode && nodes.size() == 1) {
+        LOG_WARNING("Only one NUMA node is online, ignoring -N.\n");
+        numa_mode = NUMA_NONE;
+    }
+    PagePolicy policy;
+    policy.huge_ = huge_pages, policy.nthreads_ = c.nt_;
+    if(numa_mode == NUMA_REPLICATE) {
+        // The loaded tables become the first node's replicas.
+        c.numa_nodes_ = nodes;
+        policy.node_ = nodes[0];
+        for(size_t d(0); d < loaded.size(); ++d) loaded[d].place(policy), c.tables_[d].assign(1, loaded[d].table());
+        for(size_t i(1); i < nodes.size(); ++i) {
+            policy.node_ = nodes[i];
+            for(size_t d(0); d < loaded.size(); ++d)
+                replicas.push_back(loaded[d].replicate(policy)), c.tables_[d].push_back(replicas.back().table());
+        }
+    } else if(numa_mode == NUMA_INTERLEAVE || huge_pages) {
+        if(numa_mode) c.numa_nodes_ = nodes, policy.node_ = NODE_INTERLEAVE;
+        for(size_t d(0); d < loaded.size(); ++d) loaded[d].place(policy), c.tables_[d][0] = loaded[d].table();
+    }
+    if(numa_mode)
+        LOG_INFO("%s %zu database(s) across %zu NUMA nodes.\n", numa_mode == NUMA_INTERLEAVE ? "Interleaved": "Replicated", loaded.size(), nodes.size());
+    if(prefault)
+        for(const auto &table: loaded) table.prefault(c.nt_);
+    if(huge_pages || prefault) {
+        PageStats stats;
+        for(const auto &table: loaded) stats.add(table.page_stats());
+        log_page_stats(loaded.size() > 1 ? "Databases": "Database", stats,
+                       std::chrono::duration<double>(std::chrono::system_clock::now() - load_start).count());
+    }
     khash_t(p) *taxmap(build_parent_map(argv[optind + 1]));
+    std::unique_ptr<TaxonReport> report;
+    if(report_path || report_only) report.reset(new TaxonReport(argv[optind + 1], names_path, db_paths, report_path, ofp));
+    if(report) report->set_read_fraction(read_fraction);
     // We can use optind + 3 for both single-end and paired-end mode since the argument at
     // index argc is null when argc - optind == 3.
     process_dataset(c, taxmap, argv[optind + 2], argv[optind + 3],
-                    ofp, chunk_size, per_set);
+                    ofp, chunk_size, read_cache_bytes, interleaved, compress,
+                    inflate_threads > 0 ? inflate_threads: std::max(1, int(c.nt_) / 4), report.get());
     if(ofp != stdout) std::fclose(ofp);
     kh_destroy(p, taxmap);
     LOG_INFO("Successfully completed classify!\n");
@@ -84,9 +245,147 @@ bool endswith(const std::string &path, const std::string &suf) {
     return std::equal(std::crbegin(suf), std::crend(suf), std::crbegin(path));
 }
 
+// Bits per key for a Bloom prefilter: arg itself if at least 1, or else enough to reach arg as a false-positive rate.
+static double prefilter_bits(const char *arg) {
+    const double x(std::atof(arg));
+    if(x <= 0. || x > 64.) LOG_EXIT("Prefilter size must be a false-positive rate in (0, 1) or a number of bits per key up to 64, not '%s'.\n", arg);
+    return x < 1. ? BlockedBloom::bits_for_fpr(x): x;
+}
+
+// Builds a Bloom prefilter over the nkeys keys for_each_key passes to its argument, and writes it to <dbpath>.bloom.
+template<typename ForEachKey>
+static void write_prefilter(u64 nkeys, const ForEachKey &for_each_key, const std::string &dbpath, double bits_per_key) {
+    BlockedBloom bloom(nkeys, bits_per_key);
+    for_each_key([&](u64 key) {bloom.add(key);});
+    const std::string path(dbpath + ".bloom");
+    LOG_INFO("Writing Bloom prefilter %s: %zu bytes, %u bits set per key, expected false-positive rate %0.3g%%\n",
+             path.data(), bloom.bytes(), bloom.nhash(), 100. * bloom.expected_fpr());
+    bloom.write(path.data());
+}
+
+int prefilter_main(int argc, char *argv[]) {
+    int co;
+    double bits(BlockedBloom::DEFAULT_BITS_PER_KEY);
+    while((co = getopt(argc, argv, "b:h?")) >= 0) {
+        switch(co) {
+            case 'b': bits = prefilter_bits(optarg); break;
+            case 'h': case '?': goto usage;
+        }
+    }
+    if(optind == argc) {
+        usage:
+        std::fprintf(stderr, "Usage: %s <flags> <dbpath>...\nBuilds a Bloom prefilter over each database's keys, written to <dbpath>.bloom,\n"
+                             "which classify checks before probing the database.\n"
+                             "Flags:\n-b:\tBits of memory per key, or if below 1, the target false-positive rate. [12]\n",
+                     *argv);
+        std::exit(EXIT_FAILURE);
+    }
+    for(; optind < argc; ++optind) {
+        const LoadedTable table(argv[optind], DB_NO_PREFILTER);
+        write_prefilter(table.size(), [&](const auto &f) {table.for_each_key(f);}, argv[optind], bits);
+    }
+    return EXIT_SUCCESS;
+}
+
+int hostset_main(int argc, char *argv[]) {
+    int co, k(31), wsz(-1), num_threads(1), sample(8);
+    bool canon(true);
+    std::string spacing, paths_file;
+    while((co = getopt(argc, argv, "k:w:S:p:F:r:Ch?")) >= 0) {
+        switch(co) {
+            case 'k': k = std::atoi(optarg); break;
+            case 'w': wsz = std::atoi(optarg); break;
+            case 'S': spacing = optarg; break;
+            case 'p': num_threads = std::atoi(optarg); break;
+            case 'F': paths_file = optarg; break;
+            case 'r': if((sample = std::atoi(optarg)) < 1) LOG_EXIT("-r must be a positive integer, not '%s'.\n", optarg);
+                      break;
+            case 'C': canon = false; break;
+            case 'h': case '?': goto usage;
+        }
+    }
+    if(optind == argc || (paths_file.empty() && optind + 1 == argc)) {
+        usage:
+        std::fprintf(stderr, "Usage: %s <flags> <out.set> <genomes>\nBuilds a host set of the genomes' minimizers for bonsai screen and classify -X.\n"
+                             "Flags:\n-k:\tSet k. [31]\n"
+                             "-w:\tSet window size. [k] Larger windows keep fewer minimizers, for a smaller set;\n"
+                             "   \tclassify -X screens with its own minimizers only if the set's window is k.\n"
+                             "-S:\tSet spacing.\n"
+                             "-r:\tKeep one in <arg> minimizers, chosen by hash, for a set <arg> times smaller and faster to screen with. [8]\n"
+                             "   \tReads are then screened by the fraction of their sampled minimizers in the set; 1 keeps all.\n"
+                             "-p:\tNumber of threads. [1] (Set -1 to use all threads.)\n"
+                             "-F:\tLoad genome paths from file instead of the command line.\n"
+                             "-C:\tDo not canonicalize minimizers.\n",
+                     *argv);
+        std::exit(EXIT_FAILURE);
+    }
+    if(wsz < k) wsz = k;
+    const std::vector<std::string> inpaths(paths_file.size() ? get_paths(paths_file.data())
+                                                             : std::vector<std::string>(argv + optind + 1, argv + argc));
+    const Spacer sp(k, wsz, parse_spacing(spacing.data(), k));
+    auto set(build_host_set(inpaths, sp, canon, num_threads, sample));
+    LOG_INFO("Host set has %zu minimizers (one in %d) in %zu buckets (%zu bytes)\n", size_t(set->size()), sample, size_t(set->nbuckets()), set->bytes());
+    set->write(argv[optind]);
+    return EXIT_SUCCESS;
+}
+
+int screen_main(int argc, char *argv[]) {
+    int co, num_threads(1), inflate_threads(0), load_flags(0);
+    bool interleaved(false), compress(false), canon(true);
+    double fraction(HostScreen::DEFAULT_FRACTION);
+    std::FILE *ofp(stdout), *host_fp(nullptr);
+    while((co = getopt(argc, argv, "f:o:H:p:Z:CILPzh?")) >= 0) {
+        switch(co) {
+            case 'f': fraction = std::atof(optarg);
+                      if(fraction <= 0. || fraction > 1.) LOG_EXIT("-f must be in (0, 1], not '%s'.\n", optarg);
+                      break;
+            case 'o': if((ofp = std::fopen(optarg, "w")) == nullptr) LOG_EXIT("Could not open %s for writing.\n", optarg);
+                      break;
+            case 'H': if((host_fp = std::fopen(optarg, "w")) == nullptr) LOG_EXIT("Could not open %s for writing.\n", optarg);
+                      break;
+            case 'p': num_threads = std::atoi(optarg); break;
+            case 'Z': inflate_threads = std::atoi(optarg); break;
+            case 'C': canon = false; break;
+            case 'I': interleaved = true; break;
+            case 'L': load_flags |= DB_NO_MMAP; break;
+            case 'P': load_flags |= DB_MMAP_POPULATE; break;
+            case 'z': compress = true; break;
+            case 'h': case '?': goto usage;
+        }
+    }
+    if(argc - optind < 2 || argc - optind > 3) {
+        usage:
+        std::fprintf(stderr, "Usage: %s <flags> <host.set> <inr1.fq> [Optional: <inr2.fq>]\n"
+                             "Splits reads into host and non-host by the fraction of their minimizers in a host set (see bonsai hostset).\n"
+                             "Non-host reads are written to the output; pairs are written interleaved, and are host if their minimizers together are.\n"
+                             "Flags:\n-o:\tWrite non-host reads to path instead of stdout.\n"
+                             "-H:\tWrite host reads to path. [Default: drop them.]\n"
+                             "-f:\tFraction of a read's minimizers which must be in the host set for it to count as host. [%g]\n"
+                             "-p:\tSet number of threads. [1] (Set -1 to use all threads.)\n"
+                             "-I:\tInput is interleaved paired-end.\n"
+                             "-C:\tDo not canonicalize minimizers. The host set must have been built with -C too.\n"
+                             "-L:\tCopy the host set into private memory instead of using the file mapping.\n"
+                             "-P:\tPrefault the whole host set at load time (MAP_POPULATE).\n"
+                             "-z:\tCompress output (gzip, or zstd in zstd-enabled builds).\n"
+                             "-Z:\tNumber of threads inflating each BGZF or multi-frame zstd input file. [Default: a quarter of -p, at least 1.]\n",
+                     *argv, HostScreen::DEFAULT_FRACTION);
+        std::exit(EXIT_FAILURE);
+    }
+    if(interleaved && argc - optind == 3) LOG_EXIT("-I takes a single, interleaved, input file.\n");
+    if(num_threads < 0) num_threads = std::thread::hardware_concurrency();
+    const StaticTaxTable set(argv[optind], load_flags);
+    const HostScreen screen(set, fraction, canon);
+    screen_dataset(screen, argv[optind + 1], argv[optind + 2], ofp, host_fp, num_threads, interleaved, compress,
+                   inflate_threads > 0 ? inflate_threads: std::max(1, num_threads / 4));
+    if(ofp != stdout) std::fclose(ofp);
+    if(host_fp) std::fclose(host_fp);
+    return EXIT_SUCCESS;
+}
+
 int phase2_main(int argc, char *argv[]) {
     int c, mode(score_scheme::LEX), wsz(-1), num_threads(1), k(31);
-    bool canon(true);
+    bool canon(true), write_static(false);
+    double bloom_bits(0.);
     WRITE write_fmt = UNCOMPRESSED;
     std::size_t start_size(1<<16);
     std::string spacing, tax_path, seq2taxpath, paths_file;
@@ -108,11 +407,16 @@ int phase2_main(int argc, char *argv[]) {
                      "-M: Set seq2taxpath.\n"
                      "-S: Set spacing.\n"
                      "-z: Write gzip-compressed.\n"
+                     "-B: Write a compact static table for classification instead of a hash table. Incompatible with -z.\n"
+                     "-b: Also write a Bloom prefilter of the database's keys to <out.path>.bloom, with <arg> bits per key,\n"
+                     "    or if <arg> is below 1, enough bits per key for <arg> as the false-positive rate.\n"
                      , *argv);
         std::exit(EXIT_FAILURE);
     }
-    while((c = getopt(argc, argv, "Cw:M:S:p:k:T:F:tefHh?")) >= 0) {
+    while((c = getopt(argc, argv, "Cw:M:S:p:k:T:F:b:tefBHh?")) >= 0) {
         switch(c) {
+            case 'B': write_static = true; break;
+            case 'b': bloom_bits = prefilter_bits(optarg); break;
             case 'C': canon = false; break;
             case 'h': case '?': goto usage;
             case 'k': k = std::atoi(optarg); break;
@@ -138,9 +442,21 @@ int phase2_main(int argc, char *argv[]) {
     const std::string suf(".gz");
 #endif
     if(endswith(dbpath, suf))     write_fmt = ZLIB;
+    if(write_static && write_fmt) LOG_EXIT("Static tables are memory-mapped and cannot be compressed.\n");
     if(write_fmt && !endswith(dbpath, ".gz"))
         dbpath += suf, LOG_INFO("Writing gzipped, but without a .gz suffix. Adding it.\n");
     LOG_INFO("db output path: %s\n", dbpath.data());
+    auto write_db = [&](const Database<khash_t(c)> &db, const std::string &path) {
+        if(write_static) {
+            StaticTaxTable table(db.db_, db.k_, db.w_, db.s_);
+            LOG_INFO("Static table has %zu keys in %zu buckets (%zu bytes)\n", size_t(table.size()), size_t(table.nbuckets()), table.bytes());
+            table.write(path.data());
+        } else db.write(path.data(), write_fmt);
+        if(bloom_bits > 0.)
+            write_prefilter(kh_size(db.db_), [&](const auto &f) {
+                for(khiter_t ki(0); ki != kh_end(db.db_); ++ki) if(kh_exist(db.db_, ki)) f(kh_key(db.db_, ki));
+            }, path, bloom_bits);
+    };
     spvec_t sv(parse_spacing(spacing.data(), k));
     std::vector<std::string> inpaths(paths_file.size() ? get_paths(paths_file.data())
                                                        : std::vector<std::string>(argv + optind + 2, argv + argc));
@@ -177,7 +493,7 @@ int phase2_main(int argc, char *argv[]) {
         //goto fail;
         phase2_map.db_ = score_scheme::LEX == mode ? lca_map<score::Lex>(inpaths, taxmap, seq2taxpath.data(), sp, num_threads, canon, hash_size)
                                                    : lca_map<score::Entropy>(inpaths, taxmap, seq2taxpath.data(), sp, num_threads, canon, hash_size);
-        phase2_map.write(dbpath.data(), write_fmt);
+        write_db(phase2_map, dbpath);
         //fail:
         kh_destroy(p, taxmap);
         return EXIT_SUCCESS;
@@ -190,10 +506,11 @@ int phase2_main(int argc, char *argv[]) {
     phase2_map.db_ = minimized_map<score::Hash>(inpaths, phase1_map.db_, seq2taxpath.data(), taxmap, sp, num_threads, start_size, canon);
     std::string dbpath2 = argv[optind + 1];
     if(endswith(dbpath2, suf))     write_fmt = ZLIB;
+    if(write_static && write_fmt) LOG_EXIT("Static tables are memory-mapped and cannot be compressed.\n");
     if(write_fmt && !endswith(dbpath2, ".gz"))
         dbpath2 += suf, LOG_INFO("Writing gzipped, but without a .gz suffix. Adding it.\n");
     // Write minimized map
-    phase2_map.write(dbpath2.data(), write_fmt);
+    write_db(phase2_map, dbpath2);
     if(taxmap) kh_destroy(p, taxmap);
     return EXIT_SUCCESS;
 }
@@ -291,8 +608,55 @@ int hist_main(int argc, char *argv[]) {
      return EXIT_SUCCESS;
  }
 
+int decode_main(int argc, char *argv[]) {
+    int co;
+    const char *names_path(nullptr);
+    std::FILE *ofp(stdout);
+    while((co = getopt(argc, argv, "o:r:h?")) >= 0) {
+        switch(co) {
+            case 'o': ofp = std::fopen(optarg, "w"); break;
+            case 'r': names_path = optarg; break;
+            case 'h': case '?': goto usage;
+        }
+    }
+    if(optind + 1 != argc) {
+        usage:
+        std::fprintf(stderr, "Usage: %s <flags> <classify.bin>\nConverts binary output of classify -b ('-' for stdin) to kraken-style text.\n"
+                             "Flags:\n-o:\tRedirect output to path instead of stdout.\n"
+                             "-r:\tTake read names from <arg>, the (first) reads file given to classify. [Default: name reads by their 0-based index.]\n",
+                     *argv);
+        std::exit(EXIT_FAILURE);
+    }
+    LOG_ASSERT(ofp);
+    BinaryReader reader(argv[optind]);
+    auto nfp(names_path ? open_reads(names_path): nullptr);
+    FastxReader names(nfp.get());
+    FastxRecord read;
+    const int stride(reader.header().flags_ & BINARY_INTERLEAVED ? 2: 1);
+    BinaryRecord rec;
+    std::vector<ReadResult> results;
+    std::string name;
+    u64 next(0); // Index of the next read (or pair) in the names file
+    ks::string out(1u << 16);
+    while(reader.next(rec)) {
+        if(nfp) {
+            for(; next <= rec.index_; ++next) {
+                for(int i(0); i < stride; ++i) {
+                    if(!names.next(read)) LOG_EXIT("%s has fewer reads than the classification output.\n", names_path);
+                    if(i == 0) read.trim_readno(), name.assign(read.name_, read.l_name_);
+                }
+            }
+        } else name = std::to_string(rec.index_);
+        append_decoded_classification(rec, name.data(), results, out);
+        if(out.size() >= (1u << 16)) out.write(ofp), out.clear();
+    }
+    out.write(ofp);
+    if(ofp != stdout) std::fclose(ofp);
+    return EXIT_SUCCESS;
+}
+
 int err_main(int argc, char *argv[]) {
-    std::fprintf(stderr, "[bonsai:%s] No valid subcommand provided. Options: prebuild/p1/phase, build/p2/phase2, classify, metatree\n", BONSAI_VERSION);
+    std::fprintf(stderr, "[bonsai:%s] No valid subcommand provided. Options: prebuild/p1/phase, build/p2/phase2, classify, decode, prefilter, hostset, screen, metatree\n", BONSAI_VERSION);
     return EXIT_FAILURE;
 }
 
@@ -447,7 +811,11 @@ int main(int argc, char *argv[]) {
         {"lca",      phase1_main},
         {"hist",     hist_main},
         {"metatree", metatree_main},
-        {"classify", classify_main}
+        {"classify", classify_main},
+        {"decode",   decode_main},
+        {"prefilter", prefilter_main},
+        {"hostset",  hostset_main},
+        {"screen",   screen_main}
     };
     if(std::find_if(argv, argv + argc, [&](char *s) {return std::strcmp("-v", s) == 0 || std::strcmp("--version", s) == 0;}) != argv + argc) {
         std::fprintf(stdout, "bonsai|%s\n", BONSAI_VERSION);
@@ -1,6 +1,6 @@
 #include "bonsai/encoder.h"
 #include "bonsai/util.h"
-#include "kseq_declare.h"
+#include "fastx.h"
 #include "hll/flat_hash_map/flat_hash_map.hpp"
 #include <getopt.h>
 #ifdef _OPENMP
@@ -14,7 +14,7 @@ using namespace bns;
 #endif
 using CType = ska::flat_hash_map<uint64_t, VALUE_TYPE>;
 
-void update_kmerc(CType &kmerc, const std::string &path, int k, bool canon, const int htype, kseq_t *kseq=static_cast<kseq_t*>(nullptr), RollingHashingType rht=RollingHashingType::DNA) {
+void update_kmerc(CType &kmerc, const std::string &path, int k, bool canon, const int htype, FastxReader &reader, RollingHashingType rht=RollingHashingType::DNA) {
     Encoder<> enc(k, canon);
     RollingHasher<uint64_t> rolling_hasher(k, canon, rht);
     auto update_fn = [&kmerc](uint64_t x) {
@@ -23,11 +23,11 @@ void update_kmerc(CType &kmerc, const std::string &path, int k, bool canon, cons
         else ++it->second;
     };
     if(htype == 0) {
-        enc.for_each(update_fn, path.data(), kseq);
+        enc.for_each(update_fn, path.data(), reader);
     } else if(htype == 1) {
-        rolling_hasher.for_each_hash(update_fn, path.data(), kseq);
+        rolling_hasher.for_each_hash(update_fn, path.data(), reader);
     } else if(htype == 2) {
-        enc.for_each_hash(update_fn, path.data(), kseq);
+        enc.for_each_hash(update_fn, path.data(), reader);
     } else {
         std::fprintf(stderr, "Warning: this should never happen\n");
     }
@@ -105,15 +105,9 @@ int main(int argc, char **argv) {
     omp_set_num_threads(nthreads);
 #endif
     std::fprintf(stderr, "Counting %s %u-mers, %s\n", canon ? "canonical": "stranded", k, &kmerparsetype[0]);
-    std::vector<kseq_t> kseqs;
+    std::vector<FastxReader> readers(nthreads);
     std::vector<CType> threadkmercs(nthreads);
     for(auto &kmerc: threadkmercs) kmerc.reserve(1<<22); // reserve 4MB to start
-    while(std::ptrdiff_t(kseqs.size()) < nthreads) kseqs.emplace_back(kseq_init_stack());
-    const size_t initsize = 1ull << 22;
-    for(auto &ks: kseqs) {
-        ks.seq.m = initsize;
-        ks.seq.s = static_cast<char *>(std::malloc(initsize));
-    }
     const int htype = kmerparsetype == "bns" ? 0: kmerparsetype == "cyclic"? 1: 2;
 #ifdef _OPENMP
     #pragma omp parallel for schedule(dynamic)
@@ -125,7 +119,7 @@ int main(int argc, char **argv) {
         tid = omp_get_thread_num();
 #endif
         assert(tid < threadkmercs.size());
-        update_kmerc(threadkmercs.at(tid), infiles[i], k, canon, htype, &kseqs[tid], enable_protein ? bns::RollingHashingType::PROTEIN: RollingHashingType::DNA);
+        update_kmerc(threadkmercs.at(tid), infiles[i], k, canon, htype, readers[tid], enable_protein ? bns::RollingHashingType::PROTEIN: RollingHashingType::DNA);
     }
     auto &kmerc = threadkmercs.front();
     par_reduce(threadkmercs.data(), threadkmercs.size(), [](CType &lhs, const CType &rhs) {
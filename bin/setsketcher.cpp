@@ -1,6 +1,6 @@
 #include "bonsai/encoder.h"
 #include "bonsai/util.h"
-#include "kseq_declare.h"
+#include "fastx.h"
 //#include "hll/flat_hash_map/flat_hash_map.hpp"
 #include <getopt.h>
 #ifdef _OPENMP
@@ -15,16 +15,16 @@ using namespace bns;
 #endif
 
 template<typename Sketch>
-void update_sketch(Encoder<> &enc, RollingHasher<uint64_t> &rolling_hasher, Sketch &sketch, const std::string &path, const int htype, kseq_t *kseq=static_cast<kseq_t*>(nullptr)) {
+void update_sketch(Encoder<> &enc, RollingHasher<uint64_t> &rolling_hasher, Sketch &sketch, const std::string &path, const int htype, FastxReader &reader) {
     auto update_fn = [&sketch](uint64_t x) {
         sketch.update(x);
     };
     if(htype == 0) {
-        enc.for_each(update_fn, path.data(), kseq);
+        enc.for_each(update_fn, path.data(), reader);
     } else if(htype == 1) {
-        rolling_hasher.for_each_hash(update_fn, path.data(), kseq);
+        rolling_hasher.for_each_hash(update_fn, path.data(), reader);
     } else if(htype == 2) {
-        enc.for_each_hash(update_fn, path.data(), kseq);
+        enc.for_each_hash(update_fn, path.data(), reader);
     } else {
         std::fprintf(stderr, "Error: this should never happen. htype should be [0, 1, 2]\n");
         std::exit(EXIT_FAILURE);
@@ -73,7 +73,7 @@ void usage() {
                         "-z: Set sketch size (default: 4096)\n"
                         "-F: Load paths from <file> (in addition to positional arguments)\n"
                         "-P: Parse protein k-mers instead of DNA k-mers [this implies cyclic, avoiding direct encoding]\n"
-                        "-I: Set initial buffer size for sequence parsing to [size_t] (4194304 = 4MiB)\n"
+                        "-I: Set the block size for sequence parsing to [size_t] (4194304 = 4MiB)\n"
                         "-Z: Do not save sketches for individual files. Default behavior saves sketches for each file and also emits the union sketch.\n"
                         "-B: Store per-sample setsketches and k-mer samples in current directory instead of the file containing the sequence files\n"
         );
@@ -144,7 +144,8 @@ int main(int argc, char **argv) {
     std::fprintf(logfp, "Sketching %s %u-mers, %s\n", canon ? "canonical": "stranded", k, &kmerparsetype[0]);
     RollingHasher<uint64_t> *rencoders = static_cast<RollingHasher<uint64_t> *>(std::malloc(sizeof(RollingHasher<uint64_t>) * nthreads));
     Encoder<> *encoders = static_cast<Encoder<> *>(std::malloc(sizeof(Encoder<>) * nthreads));
-    kseq_t *kseqs = static_cast<kseq_t *>(std::calloc(nthreads, sizeof(kseq_t)));
+    std::vector<FastxReader> readers;
+    while(int(readers.size()) < nthreads) readers.emplace_back(nullptr, false, initsize);
     SSType *sketches = static_cast<SSType *>(std::calloc(nthreads, sizeof(SSType)));
     SSType *usketches = nullptr;
     if(save_sketches) usketches = static_cast<SSType *>(std::calloc(nthreads, sizeof(SSType)));
@@ -152,9 +153,6 @@ int main(int argc, char **argv) {
     const RollingHashingType rht = enable_protein ? RollingHashingType::PROTEIN: RollingHashingType::DNA;
     OMP_PFOR
     for(int idx = 0; idx < nthreads; ++idx) {
-        auto &back = kseqs[idx];
-        back.seq.m = initsize;
-        back.seq.s = static_cast<char *>(std::malloc(initsize));
         new (encoders + idx) Encoder<>(k, canon);
         new (rencoders + idx) RollingHasher<uint64_t>(k, canon, rht);
         new (sketches + idx) SSType(sketchsize, save_kmers, save_kmer_counts, startmax);
@@ -175,7 +173,7 @@ int main(int argc, char **argv) {
         if(s.total_updates()) s.clear();
         update_sketch(
                 encoders[tid], rencoders[tid], s, // Parsing/Sketching prep
-                infiles[i], htype, &kseqs[tid]    // Path/Sketch format/buffer
+                infiles[i], htype, readers[tid]   // Path/Sketch format/buffer
         );
         const size_t scard = s.cardinality();
         ++total_processed;
@@ -252,7 +250,6 @@ int main(int argc, char **argv) {
     }
     OMP_PFOR
     for(int i = 0; i < nthreads; ++i) {
-        kseq_destroy_stack(kseqs[i]);
         sketches[i].~SSType();
         encoders[i].~Encoder<>();
         rencoders[i].~RollingHasher<uint64_t>();
@@ -262,7 +259,6 @@ int main(int argc, char **argv) {
         for(int i = 0; i < nthreads; ++i)
             usketches[i].~SSType();
     }
-    std::free(kseqs);
     std::free(sketches);
     std::free(usketches);
     std::free(encoders);
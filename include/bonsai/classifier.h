@@ -1,20 +1,26 @@
 #pragma once
 #include <atomic>
+#include <mutex>
 #include "kspp/ks.h"
 #include "encoder.h"
+#include "dense_tax.h"
 #include "feature_min.h"
 #include "klib/kthread.h"
+#include "classify_format.h"
+#include "fastx.h"
+#include "prefilter.h"
+#include "report.h"
+#include "screen.h"
+#include "static_table.h"
 #include "util.h"
 
 namespace bns {
 using tax_counter = linear::counter<tax_t, u16>;
 
-static void append_kraken_classification(const tax_counter &hit_counts,
-                                  const std::vector<tax_t> &taxa,
+static void append_kraken_classification(const std::vector<tax_t> &taxa,
                                   const tax_t taxon, const u32 ambig_count, const u32 missing_count,
                                   bseq1_t *bs, kstring_t *bks);
-static void append_fastq_classification(const tax_counter &hit_counts,
-                                 const std::vector<u32> &taxa,
+static void append_fastq_classification(const std::vector<u32> &taxa,
                                  const tax_t taxon, const u32 ambig_count, const u32 missing_count,
                                  bseq1_t *bs, kstring_t *bks, const int verbose, const int is_paired);
 static void append_taxa_runs(tax_t taxon, const std::vector<tax_t> &taxa, kstring_t *bks);
@@ -23,7 +29,9 @@ static void append_taxa_runs(tax_t taxon, const std::vector<tax_t> &taxa, kstrin
 enum output_format: int {
     KRAKEN   = 1,
     FASTQ    = 2,
-    EMIT_ALL = 4
+    EMIT_ALL = 4,
+    BINARY   = 8, // Records as described in classify_format.h
+    REPORT_ONLY = 16 // No per-read output: only a clade report (see report.h)
 };
 
 
@@ -60,6 +68,20 @@ inline void append_taxa_runs(tax_t taxon, const std::vector<tax_t> &taxa, ks::st
     } else bks.putsn("0:0\n", 4);
 }
 
+// Runs as BinaryRecord::Result::runs_ stores them: {taxon, count} pairs of u32, none if unclassified.
+inline void append_taxa_runs_binary(tax_t taxon, const std::vector<tax_t> &taxa, ks::string &bks) {
+    if(!taxon) return;
+    u32 run[] {taxa[0], 1};
+    for(size_t i(1); i < taxa.size(); ++i) {
+        if(taxa[i] == run[0]) ++run[1];
+        else {
+            bks.putsn_(reinterpret_cast<const char *>(run), sizeof(run));
+            run[0] = taxa[i], run[1] = 1;
+        }
+    }
+    bks.putsn_(reinterpret_cast<const char *>(run), sizeof(run));
+}
+
 INLINE void append_counts(u32 count, const char character, ks::string &ks) {
     if(count) {
         char buf[] {character, ':'};
@@ -69,14 +91,15 @@ INLINE void append_counts(u32 count, const char character, ks::string &ks) {
     }
 }
 
-inline void append_fastq_classification(const tax_counter &,
-                                 const std::vector<tax_t> &taxa,
+inline void append_fastq_records(bseq1_t *bs, ks::string &bks, size_t cms, size_t cme, const int is_paired);
+
+inline void append_fastq_classification(const ks::string &runs,
                                  const tax_t taxon, const u32 ambig_count, const u32 missing_count,
                                  bseq1_t *bs, ks::string &bks, const int verbose, const int is_paired) {
-    char *cms, *cme; // comment start, comment end -- used for using comment in both output reads.
+    size_t cms, cme; // comment start, comment end -- used for using comment in both output reads.
     bks.puts(bs->name);
     bks.putc_(' ');
-    cms = bks.data() + bks.size();
+    cms = bks.size();
     static const char lut[] {'C', 'U'};
     char tmp[] {lut[taxon == 0], '\t'};
     bks.putsn_(tmp, 2);
@@ -86,19 +109,25 @@ inline void append_fastq_classification(const tax_counter &,
     bks.putc_('\t');
     append_counts(missing_count, 'M', bks);
     append_counts(ambig_count,   'A', bks);
-    if(verbose) append_taxa_runs(taxon, taxa, bks);
+    if(verbose) bks.putsn_(runs.data(), runs.size());
     else        bks.back() = '\n';
-    cme = bks.end();
-    // And now add the rest of the fastq record
+    cme = bks.size();
+    append_fastq_records(bs, bks, cms, cme, is_paired);
+}
+
+// Appends the sequence and qualities of a read whose header ends at bks[cme] (and, if paired, its mate,
+// whose header repeats the comment bks[cms:cme]).
+inline void append_fastq_records(bseq1_t *bs, ks::string &bks, size_t cms, size_t cme, const int is_paired) {
     bks.putsn_(bs->seq, bs->l_seq);
     bks.putsn_("\n+\n", 3);
     bks.putsn_(bs->qual ? bs->qual: bs->seq, bs->l_seq); // Append sequence if it's a fasta record
     bks.putc_('\n');
     if(is_paired) {
+        // Reserve space up front: the comment is copied from bks itself, so it must not be reallocated.
+        bks.resize(bks.size() + std::strlen((bs + 1)->name) + (cme - cms) + 2 * (bs + 1)->l_seq + 8);
         bks.puts((bs + 1)->name);
         bks.putc_(' ');
-        bks.putsn_(cms, (int)(cme - cms)); // Add comment section in.
-        bks.putc_('\n');
+        bks.putsn_(bks.data() + cms, (int)(cme - cms)); // Add comment section in, newline included.
         bks.putsn_((bs + 1)->seq, (bs + 1)->l_seq);
         bks.putsn_("\n+\n", 3);
         bks.putsn_((bs + 1)->qual ? (bs + 1)->qual: (bs + 1)->seq, (bs + 1)->l_seq);
@@ -109,8 +138,7 @@ inline void append_fastq_classification(const tax_counter &,
 
 
 
-inline void append_kraken_classification(const tax_counter &,
-                                  const std::vector<tax_t> &taxa,
+inline void append_kraken_classification(const ks::string &runs,
                                   const tax_t taxon, const u32 ambig_count, const u32 missing_count,
                                   bseq1_t *bs, ks::string &bks) {
     static const char tbl[]{'C', 'U'};
@@ -124,18 +152,117 @@ inline void append_kraken_classification(const tax_counter &,
     bks.putc_('\t');
     append_counts(missing_count, 'M', bks);
     append_counts(ambig_count,   'A', bks);
-    append_taxa_runs(taxon, taxa, bks);
+    bks.putsn_(runs.data(), runs.size());
     bks.terminate();
 }
 
+// A classification database: a static table if st_ is set, a khash otherwise.
+struct ClassifyTable {
+    const khash_t(c)     *db_;
+    const StaticTaxTable *st_;
+    const BlockedBloom   *bloom_ = nullptr; // Checked before the table by lookup_table, if set
+    // Writes the taxa of kmers[0:n] to out, with 0 for those absent from the database.
+    // scratch must have room for n entries.
+    void lookup_batch(const u64 *kmers, size_t n, tax_t *out, u64 *scratch) const {
+        if(st_) {
+            st_->get_batch(kmers, n, out, scratch);
+            return;
+        }
+        khash_get_batch(db_, kmers, n, scratch);
+        for(size_t i(0); i < n; ++i)
+            out[i] = scratch[i] == kh_end(db_) ? 0: kh_val(db_, scratch[i]);
+    }
+};
+
+// Owns a database loaded for classification, of either kind, and its Bloom prefilter if it has one.
+// Replicas share the prefilter of the first copy, so theirs is left null.
+struct LoadedTable {
+    std::unique_ptr<Database<khash_t(c)>> db_;
+    std::unique_ptr<StaticTaxTable>       st_;
+    std::unique_ptr<BlockedBloom>         bloom_;
+    LoadedTable() {}
+    LoadedTable(const char *path, int load_flags) {
+        if(database_magic(path) == STATIC_DB_MAGIC) st_.reset(new StaticTaxTable(path, load_flags));
+        else                                        db_.reset(new Database<khash_t(c)>(path, load_flags));
+        const std::string bloom_path(std::string(path) + ".bloom");
+        if((load_flags & DB_NO_PREFILTER) || ::access(bloom_path.data(), F_OK)) return;
+        bloom_.reset(new BlockedBloom(bloom_path.data(), load_flags));
+        if(bloom_->nkeys() != size()) {
+            LOG_WARNING("Ignoring Bloom prefilter %s, built for %zu keys: %s has %zu.\n", bloom_path.data(), size_t(bloom_->nkeys()), path, size_t(size()));
+            bloom_.reset();
+        } else LOG_INFO("Loaded Bloom prefilter %s (%zu bytes, %0.1f bits per key, expected false-positive rate %0.3g%%)\n",
+                        bloom_path.data(), bloom_->bytes(), bloom_->bits_per_key(), 100. * bloom_->expected_fpr());
+    }
+    ClassifyTable table() const {return ClassifyTable{db_ ? db_->db_: nullptr, st_.get(), bloom_.get()};}
+    u64 size() const {return st_ ? st_->size(): kh_size(db_->db_);}
+    template<typename Functor>
+    void for_each_key(const Functor &f) const {
+        if(st_) st_->for_each_key(f);
+        else for(khiter_t ki(0); ki != kh_end(db_->db_); ++ki) if(kh_exist(db_->db_, ki)) f(kh_key(db_->db_, ki));
+    }
+    unsigned k() const {return st_ ? st_->k_: db_->k_;}
+    unsigned w() const {return st_ ? st_->w_: db_->w_;}
+    const spvec_t &s() const {return st_ ? st_->s_: db_->s_;}
+    void place(const PagePolicy &policy) {
+        if(st_) st_->place(policy);
+        else    db_->place(policy);
+    }
+    LoadedTable replicate(const PagePolicy &policy) const {
+        LoadedTable ret;
+        if(st_) ret.st_.reset(new StaticTaxTable(*st_, policy));
+        else    ret.db_ = db_->replicate(policy);
+        return ret;
+    }
+    void prefault(int nthreads) const {
+        if(st_) st_->prefault(nthreads);
+        else    db_->prefault(nthreads);
+    }
+    PageStats page_stats() const {return st_ ? st_->page_stats(): db_->page_stats();}
+};
+
+// Hash of a read's name without a trailing /1 or /2, so that the mates of a pair hash alike
+// whether they are read from one file or two, or one of them is classified alone.
+INLINE u64 read_name_hash(const char *name) {
+    size_t len(std::strlen(name));
+    if(len > 2 && name[len - 2] == '/' && (name[len - 1] == '1' || name[len - 1] == '2')) len -= 2;
+    Hash128 h;
+    h.update(name, len);
+    return h.lo();
+}
+
 template<typename ScoreType>
 struct ClassifierGeneric {
-    const khash_t(c) *db_;
+    // tables_[d] is database d. Several databases sharing k, w and spacing are classified in one pass:
+    // minimizers are encoded once and probed against each.
+    // With NUMA_REPLICATE, tables_[d][i] is the copy of database d on numa_nodes_[i].
+    std::vector<std::vector<ClassifyTable>> tables_;
+    // Classification threads are spread over numa_nodes_ (if nonempty) and pinned there.
+    std::vector<int>                        numa_nodes_;
     const Spacer sp_;
     Encoder<ScoreType> enc_;
     uint32_t          nt_:16;
     uint32_t output_flag_:16;
     mutable std::atomic<u64> classified_[2];
+    // If positive, a read's remaining minimizers are not looked up once the leading taxon is a leaf whose score
+    // exceeds every other's by more than early_stop_ times the number remaining (see TreeResolver::settled).
+    // With 1, calls are exactly those of a full lookup; missing counts and runs then cover the probed minimizers only.
+    // 0 disables early termination.
+    double early_stop_;
+    // If nonzero, reads are cut into windows of window_ bases which are classified independently, in parallel,
+    // and each read's call is resolved from its windows' calls (see classify_windowed_seq). 0 classifies reads whole.
+    u32    window_;
+    // If set, host reads (see HostScreen) are dropped before classification: they are neither output nor counted.
+    const HostScreen *host_;
+    // If set, a pair's second mate's minimizers which its first mate shares are dropped before lookup.
+    // Mates of short inserts overlap, and canonical minimizers of the overlap would otherwise be looked up and counted twice.
+    bool   dedup_mates_;
+    // Subsampling, for fast profiling. Only reads (or pairs) whose read_name_hash falls below read_threshold_
+    // are classified, output and counted; the others are skipped before they are encoded, and the selection
+    // depends on names alone, so it is the same from run to run. Only minimizers whose sample_hash falls below
+    // kmer_threshold_ are looked up, as in FracMinHash; the others count as neither hits nor misses.
+    // Both are set by set_read_fraction and set_minimizer_sample, and are the maximum when not sampling.
+    double read_fraction_;
+    u64    read_threshold_, kmer_threshold_;
     public:
     void set_emit_all(bool setting) {
         if(setting) output_flag_ |= output_format::EMIT_ALL;
@@ -151,13 +278,38 @@ struct ClassifierGeneric {
     }
     INLINE int get_emit_all()    const {return output_flag_ & output_format::EMIT_ALL;}
     INLINE int get_emit_kraken() const {return output_flag_ & output_format::KRAKEN;}
+    void set_emit_binary(bool setting) {
+        if(setting) output_flag_ |= output_format::BINARY;
+        else        output_flag_ &= (~output_format::BINARY);
+    }
     INLINE int get_emit_fastq()  const {return output_flag_ & output_format::FASTQ;}
+    INLINE int get_emit_binary() const {return output_flag_ & output_format::BINARY;}
+    void set_report_only(bool setting) {
+        if(setting) output_flag_ |= output_format::REPORT_ONLY;
+        else        output_flag_ &= (~output_format::REPORT_ONLY);
+    }
+    INLINE int get_report_only() const {return output_flag_ & output_format::REPORT_ONLY;}
+    // Classifies the reads (or pairs) with a fraction in (0, 1] of the range of read_name_hash.
+    void set_read_fraction(double fraction) {
+        if(fraction <= 0. || fraction > 1.) throw std::invalid_argument("read fraction must be in (0, 1]");
+        read_fraction_  = fraction;
+        read_threshold_ = fraction == 1. ? std::numeric_limits<u64>::max(): u64(std::ldexp(fraction, 64));
+    }
+    // Looks up one in sample of each read's minimizers, by sample_hash.
+    void set_minimizer_sample(u64 sample) {kmer_threshold_ = sample_threshold(sample);}
+    INLINE bool read_sampled(const bseq1_t *bs) const {
+        return read_threshold_ == std::numeric_limits<u64>::max() || read_name_hash(bs->name) < read_threshold_;
+    }
+    INLINE bool kmer_sampled(u64 kmer) const {return sample_hash(kmer) < kmer_threshold_;}
+    bool sampling_kmers() const {return kmer_threshold_ != std::numeric_limits<u64>::max();}
     ClassifierGeneric(const khash_t(c) *map, const spvec_t &spaces, u8 k, std::uint16_t wsz, int num_threads=16,
                       bool emit_all=true, bool emit_fastq=true, bool emit_kraken=false, bool canonicalize=true):
-        db_(map),
+        tables_{{ClassifyTable{map, nullptr}}},
         sp_(k, wsz, spaces),
         enc_(sp_, canonicalize),
-        nt_(num_threads > 0 ? (uint16_t)(num_threads): (uint16_t)std::thread::hardware_concurrency())
+        nt_(num_threads > 0 ? (uint16_t)(num_threads): (uint16_t)std::thread::hardware_concurrency()),
+        output_flag_(0), early_stop_(0.), window_(0), host_(nullptr), dedup_mates_(true),
+        read_fraction_(1.), read_threshold_(std::numeric_limits<u64>::max()), kmer_threshold_(std::numeric_limits<u64>::max())
     {
         for(auto &c: classified_) c.store(0);
         set_emit_all(emit_all);
@@ -167,6 +319,24 @@ struct ClassifierGeneric {
     ClassifierGeneric(const char *dbpath, const spvec_t &spaces, u8 k, std::uint16_t wsz, int num_threads=16,
                       bool emit_all=true, bool emit_fastq=true, bool emit_kraken=false, bool canonicalize=true):
         ClassifierGeneric(khash_load<khash_t(c)>(dbpath), spaces, k, wsz, num_threads, emit_all, emit_fastq, emit_kraken, canonicalize) {}
+    // Reads are encoded with the table's window, so that their minimizers are those it holds.
+    ClassifierGeneric(const StaticTaxTable *table, int num_threads=16,
+                      bool emit_all=true, bool emit_fastq=true, bool emit_kraken=false, bool canonicalize=true):
+        ClassifierGeneric(static_cast<const khash_t(c) *>(nullptr), table->s_, table->k_, table->w_, num_threads, emit_all, emit_fastq, emit_kraken, canonicalize)
+    {
+        tables_[0][0].st_ = table;
+    }
+    size_t ndb() const {return tables_.size();}
+    bool replicated() const {return tables_[0].size() > 1;}
+    void add_database(const ClassifyTable &table) {tables_.push_back({table});}
+    // Looks kmers[0:n] up in database d, as ClassifyTable::lookup_batch.
+    // replica selects a per-node copy of the table, if there are any.
+    void lookup_batch(const u64 *kmers, size_t n, tax_t *out, u64 *scratch, int replica=-1, size_t d=0) const {
+        const auto &copies(tables_[d]);
+        copies[replica < 0 || copies.size() == 1 ? 0: replica].lookup_batch(kmers, n, out, scratch);
+    }
+    // Index into numa_nodes_ of the node classification thread tid runs on.
+    int numa_slot(int tid) const {return numa_nodes_.empty() ? -1: int(size_t(tid) * numa_nodes_.size() / nt_);}
     u64 n_classified()   const {return classified_[0];}
     u64 n_unclassified() const {return classified_[1];}
 };
@@ -196,148 +366,989 @@ INLINE void append_counts(u32 count, const char character, kstring_t *ks) {
     }
 }
 
+// Per-thread direct-mapped cache of minimizer -> taxon results, checked before the database.
+// Misses (taxon 0) are cached as well. A cache with 0 bits is disabled, and a cache whose hit rate
+// over its first WARMUP probes is below 1 / MIN_HIT_RATIO_INV turns itself off,
+// since probing then costs more than it saves.
+class MinimizerCache {
+    std::vector<u64>   keys_;
+    std::vector<tax_t> vals_;
+    unsigned           shift_;
+    bool               active_;
+    size_t slot(u64 key) const {return (key * UINT64_C(0x9E3779B97F4A7C15)) >> shift_;}
+public:
+    static constexpr unsigned DEFAULT_BITS = 15; // 384 KiB per thread
+    static constexpr u64 WARMUP = u64(1) << 20;
+    static constexpr u64 MIN_HIT_RATIO_INV = 16;
+    u64 lookups_, repeats_, probes_, hits_; // Minimizers seen, those equal to the previous window's, cache probes and hits.
+
+    MinimizerCache(unsigned bits=DEFAULT_BITS):
+        keys_(bits ? size_t(1) << bits: 0, BF), vals_(keys_.size()), shift_(64 - bits), active_(bits),
+        lookups_(0), repeats_(0), probes_(0), hits_(0) {}
+    bool active() const {return active_;}
+    bool get(u64 key, tax_t &val) {
+        ++probes_;
+        const size_t i(slot(key));
+        if(keys_[i] != key) return false;
+        val = vals_[i];
+        ++hits_;
+        return true;
+    }
+    void put(u64 key, tax_t val) {
+        const size_t i(slot(key));
+        keys_[i] = key, vals_[i] = val;
+    }
+    void check_rate() {
+        if(probes_ >= WARMUP && hits_ * MIN_HIT_RATIO_INV < probes_) {
+            active_ = false;
+            std::vector<u64>().swap(keys_), std::vector<tax_t>().swap(vals_);
+        }
+    }
+};
+
+// Per-thread set of the first mate's minimizers, used to drop those the second mate shares with it.
+// Open addressing with linear probing, in a table of at least four times as many slots as keys, so that
+// most probes end at their first slot. Clearing a table of a few kilobytes per pair costs less than tagging slots.
+class MateSet {
+    std::vector<u64> keys_; // BF marks an empty slot, as in MinimizerCache.
+    size_t           mask_;
+    unsigned         shift_;
+    INLINE size_t slot(u64 key) const {return (key * UINT64_C(0x9E3779B97F4A7C15)) >> shift_;}
+public:
+    MateSet(): mask_(0), shift_(64) {}
+    // Starts a pair whose first mate has at most n minimizers.
+    void reset(size_t n) {
+        unsigned bits(6);
+        while((size_t(1) << bits) < 4 * n) ++bits;
+        keys_.assign(size_t(1) << bits, BF);
+        mask_ = keys_.size() - 1, shift_ = 64 - bits;
+    }
+    void insert(u64 key) {
+        size_t i(slot(key));
+        while(keys_[i] != BF && keys_[i] != key) i = (i + 1) & mask_;
+        keys_[i] = key;
+    }
+    bool contains(u64 key) const {
+        size_t i(slot(key));
+        while(keys_[i] != BF && keys_[i] != key) i = (i + 1) & mask_;
+        return keys_[i] == key;
+    }
+};
+
+// Classification of one read (or pair), independent of its name and qualities.
+struct ReadResult {
+    tax_t      taxon_;
+    u32        missing_, ambig_;
+    ks::string runs_; // Taxa runs as emitted in kraken-style output, newline-terminated.
+    ReadResult(): taxon_(0), missing_(0), ambig_(0), runs_(64u) {}
+};
+
+/*
+ * With several databases, one record carries the results of all of them. The taxon field lists
+ * each database's taxon, comma-separated and in command-line order. The M:/A: counts and, if verbose,
+ * the runs follow as one block per database, with blocks separated by "|\t". A record counts as classified
+ * if any database classified it.
+ */
+inline void append_multi_fields(const std::vector<ReadResult> &results, int l_seq, const int verbose, ks::string &bks) {
+    for(size_t d(0); d < results.size(); ++d) {
+        if(d) bks.putc_(',');
+        bks.putuw_(results[d].taxon_);
+    }
+    bks.putc_('\t');
+    bks.putw_(l_seq);
+    bks.putc_('\t');
+    for(size_t d(0); d < results.size(); ++d) {
+        if(d) bks.putsn_("|\t", 2);
+        // Unlike single-database output, zero counts are written, so that no block is empty.
+        bks.putsn_("M:", 2), bks.putuw_(results[d].missing_), bks.putsn_("\tA:", 3), bks.putuw_(results[d].ambig_), bks.putc_('\t');
+        if(verbose) { // Runs are newline-terminated.
+            bks.putsn_(results[d].runs_.data(), results[d].runs_.size() - 1);
+            bks.putc_('\t');
+        }
+    }
+    bks.back() = '\n';
+}
+
+inline void append_kraken_classification(const std::vector<ReadResult> &results, bseq1_t *bs, ks::string &bks) {
+    bool classified(false);
+    for(const auto &res: results) classified |= res.taxon_ != 0;
+    bks.putc_(classified ? 'C': 'U');
+    bks.putc_('\t');
+    bks.puts(bs->name);
+    bks.putc_('\t');
+    append_multi_fields(results, bs->l_seq, true, bks);
+    bks.terminate();
+}
+
+inline void append_fastq_classification(const std::vector<ReadResult> &results, bseq1_t *bs, ks::string &bks,
+                                        const int verbose, const int is_paired) {
+    bool classified(false);
+    for(const auto &res: results) classified |= res.taxon_ != 0;
+    bks.puts(bs->name);
+    bks.putc_(' ');
+    const size_t cms(bks.size());
+    bks.putc_(classified ? 'C': 'U');
+    bks.putc_('\t');
+    append_multi_fields(results, bs->l_seq, verbose, bks);
+    append_fastq_records(bs, bks, cms, bks.size(), is_paired);
+}
+
+inline void append_binary_classification(const std::vector<ReadResult> &results, const bseq1_t *bs, u64 read_index, ks::string &bks) {
+    const u32 length(bs->l_seq);
+    bks.putsn_(reinterpret_cast<const char *>(&read_index), sizeof(read_index));
+    bks.putsn_(reinterpret_cast<const char *>(&length), sizeof(length));
+    for(const auto &res: results) {
+        const u32 head[] {res.taxon_, res.missing_, res.ambig_, u32(res.runs_.size() / (2 * sizeof(u32)))};
+        bks.putsn_(reinterpret_cast<const char *>(head), sizeof(head));
+        bks.putsn_(res.runs_.data(), res.runs_.size());
+    }
+}
+
+// Formats a binary record exactly as append_kraken_classification formatted the read it came from.
+inline void append_decoded_classification(const BinaryRecord &rec, const char *name, std::vector<ReadResult> &results, ks::string &bks) {
+    results.resize(rec.results_.size());
+    for(size_t d(0); d < results.size(); ++d) {
+        const auto &in(rec.results_[d]);
+        auto &res(results[d]);
+        res.taxon_ = in.taxon_, res.missing_ = in.missing_, res.ambig_ = in.ambig_;
+        res.runs_.clear();
+        if(in.runs_.empty()) res.runs_.putsn_("0:0\n", 4);
+        else {
+            for(const auto &run: in.runs_) append_taxa_run(run.first, run.second, res.runs_);
+            res.runs_.back() = '\n';
+        }
+    }
+    bseq1_t bs;
+    std::memset(&bs, 0, sizeof(bs));
+    bs.name = const_cast<char *>(name), bs.l_seq = rec.length_;
+    if(results.size() == 1) append_kraken_classification(results[0].runs_, results[0].taxon_, results[0].ambig_, results[0].missing_, &bs, bks);
+    else                    append_kraken_classification(results, &bs, bks);
+}
+
+// Bounded, sharded cache of classification results keyed by a 128-bit hash of the read's
+// sequence (and its mate's), so that byte-identical reads are formatted but not reclassified.
+// Each shard is a direct-mapped table guarded by its own mutex. Inserting replaces a slot's
+// previous occupant, and is skipped if the shard's byte budget would be exceeded.
+// Runs are kept in buffers of exactly their length, so the budget counts every byte held, whatever the standard library.
+class ReadCache {
+public:
+    struct Key {
+        u64 lo_, hi_;
+        // Key of the same read's result in database d.
+        Key db(size_t d) const {return Key{lo_ ^ (d * 0x9E3779B97F4A7C15ull), hi_ + d};}
+    };
+private:
+    static constexpr size_t NSHARDS = 64;
+    static constexpr size_t EXPECTED_RUNS_BYTES = 64;
+    struct Entry {
+        u64         lo_, hi_; // All-zero for empty slots.
+        tax_t       taxon_;
+        u32         missing_, ambig_, runs_len_;
+        std::unique_ptr<char[]> runs_;
+    };
+    struct alignas(64) Shard {
+        std::mutex         m_;
+        std::vector<Entry> entries_;
+        size_t             bytes_;
+    };
+    std::unique_ptr<Shard[]> shards_;
+    size_t                   nslots_, shard_budget_;
+    static size_t entry_bytes(const Entry &e) {return sizeof(Entry) + e.runs_len_;}
+public:
+    ReadCache(size_t max_bytes): shards_(new Shard[NSHARDS]) {
+        shard_budget_ = max_bytes / NSHARDS;
+        nslots_ = std::max(size_t(1), shard_budget_ / (sizeof(Entry) + EXPECTED_RUNS_BYTES));
+        for(size_t i(0); i < NSHARDS; ++i) {
+            shards_[i].entries_.resize(nslots_);
+            shards_[i].bytes_ = nslots_ * sizeof(Entry);
+        }
+        LOG_INFO("Duplicate read cache: %zu slots in %zu shards, capped at %zu bytes.\n", nslots_ * NSHARDS, NSHARDS, max_bytes);
+    }
+    // Bytes held by the cache, which never exceed the cap given to the constructor.
+    size_t bytes() {
+        size_t ret(0);
+        for(size_t i(0); i < NSHARDS; ++i) {
+            std::lock_guard<std::mutex> lock(shards_[i].m_);
+            ret += shards_[i].bytes_;
+        }
+        return ret;
+    }
+    template<typename T>
+    static Key make_key(const T *bs, int is_paired) {
+        Hash128 h;
+        h.update(bs->seq, bs->l_seq);
+        if(is_paired) h.update((bs + 1)->seq, (bs + 1)->l_seq);
+        return Key{h.lo(), h.hi()};
+    }
+    bool get(const Key &key, ReadResult &res) {
+        Shard &shard(shards_[key.hi_ % NSHARDS]);
+        std::lock_guard<std::mutex> lock(shard.m_);
+        const Entry &e(shard.entries_[key.lo_ % nslots_]);
+        if(e.lo_ != key.lo_ || e.hi_ != key.hi_) return false;
+        res.taxon_ = e.taxon_, res.missing_ = e.missing_, res.ambig_ = e.ambig_;
+        res.runs_.clear();
+        if(e.runs_len_) res.runs_.putsn_(e.runs_.get(), e.runs_len_);
+        res.runs_.terminate();
+        return true;
+    }
+    void put(const Key &key, const ReadResult &res) {
+        Shard &shard(shards_[key.hi_ % NSHARDS]);
+        std::lock_guard<std::mutex> lock(shard.m_);
+        Entry &e(shard.entries_[key.lo_ % nslots_]);
+        const size_t old_bytes(entry_bytes(e)), runs_bytes(res.runs_.size());
+        if(shard.bytes_ - old_bytes + sizeof(Entry) + runs_bytes > shard_budget_) return;
+        e.lo_ = key.lo_, e.hi_ = key.hi_;
+        e.taxon_ = res.taxon_, e.missing_ = res.missing_, e.ambig_ = res.ambig_;
+        if(e.runs_len_ != runs_bytes) e.runs_.reset(runs_bytes ? new char[runs_bytes]: nullptr), e.runs_len_ = runs_bytes;
+        if(runs_bytes) std::memcpy(e.runs_.get(), res.runs_.data(), runs_bytes);
+        shard.bytes_ += entry_bytes(e) - old_bytes;
+    }
+};
+
+// Per-thread scratch space for classify_seq, reused across reads.
+struct ClassifyScratch {
+    std::vector<tax_t> taxa_;    // Taxa of k-mers found in the database, in read order.
+    std::vector<u64>   kmers_;   // Minimizers of the read (and its mate).
+    std::vector<tax_t> hits_;    // Result of lookup, 0 for misses.
+    std::vector<u64>   misses_;  // Minimizers absent from the cache, looked up as a batch.
+    std::vector<u32>   miss_idx_;
+    std::vector<tax_t> miss_hits_;
+    std::vector<u64>   buckets_; // Scratch space for batched lookup.
+    std::vector<u64>   candidates_; // Keys passing a Bloom prefilter, and their indices and taxa
+    std::vector<u32>   candidate_idx_;
+    std::vector<tax_t> candidate_hits_;
+    TreeResolver       resolver_;
+    std::vector<MinimizerCache> caches_;  // One per database
+    std::vector<ReadResult>     results_; // One per database
+    u64                read_lookups_, read_hits_; // Duplicate read cache statistics
+    u64                skipped_lookups_, stopped_early_; // Early termination statistics
+    u64                filter_checks_, filtered_;        // Keys checked against and rejected by Bloom prefilters
+    MateSet            mates_;        // The first mate's minimizers, when deduplicating mates
+    u32                mate_dups_;    // Minimizers of the current pair's second mate dropped as duplicates
+    u64                mate_kmers_, mate_dropped_; // Second mates' minimizers, and those dropped
+    u32                unsampled_;    // Minimizers of the current read (or pair) left out by minimizer sampling
+    u64                reads_skipped_, kmers_sampled_, kmers_unsampled_; // Reads (or pairs) left out, and minimizers kept and left out, by subsampling
+    std::unique_ptr<Encoder<score::Lex>> enc_;
+    TaxonCounts       *counts_;  // One per database, owned by the pipeline; null unless a report is requested.
+    std::unique_ptr<HostScratch> host_; // Null unless host reads are screened out
+    const int          replica_; // Table replica probed by this thread, -1 for the shared table
+    ClassifyScratch(const DenseTaxonomy &tax, size_t ndb=1, int replica=-1, unsigned cache_bits=MinimizerCache::DEFAULT_BITS):
+        resolver_(tax), results_(ndb), read_lookups_(0), read_hits_(0), skipped_lookups_(0), stopped_early_(0), filter_checks_(0), filtered_(0),
+        mate_dups_(0), mate_kmers_(0), mate_dropped_(0), unsampled_(0), reads_skipped_(0), kmers_sampled_(0), kmers_unsampled_(0), counts_(nullptr), replica_(replica)
+    {
+        while(caches_.size() < ndb) caches_.emplace_back(cache_bits);
+    }
+};
+
+// Writes the taxa of keys[0:n] in database d to out, as ClassifierGeneric::lookup_batch.
+// If the database has a Bloom prefilter, only the keys it may hold are looked up in the table.
+template<typename ScoreType>
+void lookup_table(const ClassifierGeneric<ScoreType> &c, ClassifyScratch &scratch, size_t d, const u64 *keys, size_t n, tax_t *out) {
+    scratch.buckets_.resize(n);
+    const BlockedBloom *bloom(c.tables_[d][0].bloom_);
+    if(bloom == nullptr) {
+        c.lookup_batch(keys, n, out, scratch.buckets_.data(), scratch.replica_, d);
+        return;
+    }
+    auto &idx(scratch.candidate_idx_), &hits(scratch.candidate_hits_);
+    auto &candidates(scratch.candidates_);
+    idx.resize(n);
+    idx.resize(bloom->filter_batch(keys, n, scratch.buckets_.data(), idx.data()));
+    scratch.filter_checks_ += n, scratch.filtered_ += n - idx.size();
+    std::memset(out, 0, n * sizeof(tax_t));
+    if(idx.empty()) return;
+    candidates.resize(idx.size()), hits.resize(idx.size());
+    for(size_t i(0); i < idx.size(); ++i) candidates[i] = keys[idx[i]];
+    c.lookup_batch(candidates.data(), candidates.size(), hits.data(), scratch.buckets_.data(), scratch.replica_, d);
+    for(size_t i(0); i < idx.size(); ++i) out[idx[i]] = hits[i];
+}
+
+// Writes the taxa of scratch.kmers_[begin:end] in database d to scratch.hits_[begin:end], consulting the per-thread cache first.
+// Minimizers equal to the previous window's are not looked up at all.
+template<typename ScoreType>
+void lookup_minimizers(const ClassifierGeneric<ScoreType> &c, ClassifyScratch &scratch, size_t d=0,
+                       size_t begin=0, size_t end=std::numeric_limits<size_t>::max()) {
+    const auto &kmers(scratch.kmers_);
+    auto &hits(scratch.hits_);
+    auto &cache(scratch.caches_[d]);
+    auto &misses(scratch.misses_);
+    auto &miss_idx(scratch.miss_idx_);
+    end = std::min(end, kmers.size());
+    const size_t n(end - begin);
+    hits.resize(end);
+    cache.lookups_ += n;
+    if(!cache.active()) {
+        // Repeated minimizers probe the same, already cached, bucket within the batch,
+        // so compacting them away would cost more than it saves.
+        for(size_t i(begin + 1); i < end; ++i) cache.repeats_ += kmers[i] == kmers[i - 1];
+        lookup_table(c, scratch, d, kmers.data() + begin, n, hits.data() + begin);
+        return;
+    }
+    misses.clear(), miss_idx.clear();
+    for(size_t i(begin); i < end; ++i) {
+        if(i && kmers[i] == kmers[i - 1]) ++cache.repeats_;
+        else if(!cache.get(kmers[i], hits[i]))
+            misses.push_back(kmers[i]), miss_idx.push_back(i);
+    }
+    if(misses.size()) {
+        auto &miss_hits(scratch.miss_hits_);
+        miss_hits.resize(misses.size());
+        lookup_table(c, scratch, d, misses.data(), misses.size(), miss_hits.data());
+        for(size_t i(0); i < misses.size(); ++i)
+            hits[miss_idx[i]] = miss_hits[i], cache.put(misses[i], miss_hits[i]);
+        cache.check_rate();
+    }
+    for(size_t i(std::max(begin, size_t(1))); i < end; ++i)
+        if(kmers[i] == kmers[i - 1]) hits[i] = hits[i - 1];
+}
+
+/*
+ * Windowed classification, for long reads (ClassifierGeneric::window_).
+ * Whole-read classification makes a 100 kb read one task, with one huge hit list and resolution,
+ * which stalls the thread that owns it. Instead, each read is cut into windows of window_ bases
+ * (the last one takes the remainder, so it may be up to twice as long), which overlap by the
+ * span of a minimizer window (less a base) so that every minimizer window falls in exactly one read window. Windows are classified
+ * independently and spread across threads, so per-thread memory is bounded by the window length.
+ * A second pass resolves each read from its windows' calls and formats it: every window call
+ * counts as one hit, so the consensus is resolved over the taxonomy as minimizer hits are,
+ * and the runs in the output list the window calls in read order.
+ */
+struct WindowResult {
+    tax_t taxon_;
+    u32   missing_, ambig_;
+};
+struct ReadWindows {
+    std::vector<u32>          first_;   // Read i has windows [first_[i], first_[i + 1]).
+    std::vector<WindowResult> results_; // Window w's result in database d is results_[w * ndb + d].
+    std::vector<u32>          bounds_;  // Task i classifies windows [bounds_[i], bounds_[i + 1]).
+};
+
+// Number of windows a read of l_seq bases is cut into.
+INLINE u32 nwindows(int l_seq, u32 window) {return std::max(1, int(l_seq / window));}
+
 using Classifier = ClassifierGeneric<score::Lex>;
 namespace {
 struct kt_data {
     const ClassifierGeneric<score::Lex> &c_;
-    const khash_t(p) *taxmap;
+    const DenseTaxonomy &tax_;
+    std::unique_ptr<ClassifyScratch> *scratch_; // One per thread, created by the thread itself
+    ReadCache *read_cache_;    // Null unless duplicate reads are short-circuited
     bseq1_t *bs_;
-    const unsigned per_set_;
-    const unsigned total_;
-    std::atomic<u64> &retstr_size_;
+    const u32 *bounds_;        // Task i classifies reads [bounds_[i], bounds_[i + 1])
+    const u64 first_index_;    // Index in the input of the read (or pair) at bs_
+    ks::string *task_out_;     // Task i appends its output to task_out_[i].
+    TaxonCounts *counts_;      // Thread t counts reads in counts_[t * ndb:(t + 1) * ndb], if not null.
+    ReadWindows *windows_;     // Null unless reads are classified by windows
     const int is_paired_;
 };
 }
 
+// Minimizers probed between checks for early termination (see ClassifierGeneric::early_stop_).
+// Reads with fewer than two blocks' worth are always probed in full.
+static constexpr size_t EARLY_STOP_BLOCK = 64;
+
+// Writes the minimizers of a read (and its mate, if paired) to scratch.kmers_.
+// If dedup is set, those of the mate which the read shares are dropped, and counted in scratch.mate_dups_.
 template<typename ScoreType>
-unsigned classify_seq(const ClassifierGeneric<ScoreType> &c,
-                      Encoder<ScoreType> &enc,
-                      const khash_t(p) *taxmap, bseq1_t *bs, const int is_paired, std::vector<tax_t> &taxa) {
-    LOG_DEBUG("starting classify_seq with bs at pointer = %p\n", static_cast<const void*>(bs));
-    khiter_t ki;
-    tax_counter hit_counts;
-    u32 missing_count(0);
-    tax_t taxon(0);
-    ks::string bks(bs->sam, bs->l_sam);
-    bks.clear();
-    taxa.clear();
-
-    auto fn = [&] (u64 kmer) {
-        //If the kmer is missing from our database, just say we don't know what it is.
-        if((ki = kh_get(c, c.db_, kmer)) == kh_end(c.db_)) ++missing_count;
-        else taxa.push_back(kh_val(c.db_, ki)), hit_counts.add(kh_val(c.db_, ki));
-    };
+void encode_pair(Encoder<ScoreType> &enc, const bseq1_t *bs, const int is_paired, ClassifyScratch &scratch, bool dedup) {
+    auto &kmers(scratch.kmers_);
+    kmers.clear();
+    scratch.mate_dups_ = 0;
+    // Gather all minimizers first, then look them up as a batch so that the
+    // database probes can be prefetched instead of stalling one at a time.
+    auto fn = [&] (u64 kmer) {kmers.push_back(kmer);};
     // This simplification loses information about the run of congituous labels. Do these matter?
     enc.for_each(fn, bs->seq, bs->l_seq);
-    unsigned ambig_count(bs->l_seq - enc.sp_.c_ + 1 - taxa.size() - missing_count);
-    if(is_paired) {
+    if(!is_paired) return;
+    if(!dedup) {
         enc.for_each(fn, (bs + 1)->seq, (bs + 1)->l_seq);
-        ambig_count += (bs + 1)->l_seq - (enc.sp_.c_ - 1) - taxa.size() - missing_count;
+        return;
+    }
+    const size_t nfirst(kmers.size());
+    auto &mates(scratch.mates_);
+    mates.reset(nfirst);
+    for(const u64 kmer: kmers) mates.insert(kmer);
+    enc.for_each([&](u64 kmer) {
+        if(mates.contains(kmer)) ++scratch.mate_dups_;
+        else                     kmers.push_back(kmer);
+    }, (bs + 1)->seq, (bs + 1)->l_seq);
+    scratch.mate_kmers_ += kmers.size() - nfirst + scratch.mate_dups_, scratch.mate_dropped_ += scratch.mate_dups_;
+}
+
+// Writes the minimizers of a read (and its mate, if paired) to be looked up to scratch.kmers_: those of encode_pair,
+// deduplicated if c.dedup_mates_ is set, less those left out by minimizer sampling, which are counted in scratch.unsampled_.
+template<typename ScoreType>
+void encode_minimizers(const ClassifierGeneric<ScoreType> &c, Encoder<ScoreType> &enc, const bseq1_t *bs, const int is_paired, ClassifyScratch &scratch) {
+    encode_pair(enc, bs, is_paired, scratch, c.dedup_mates_);
+    scratch.unsampled_ = 0;
+    if(!c.sampling_kmers()) return;
+    auto &kmers(scratch.kmers_);
+    size_t n(0);
+    for(const u64 kmer: kmers) if(c.kmer_sampled(kmer)) kmers[n++] = kmer;
+    scratch.unsampled_ = kmers.size() - n, scratch.kmers_unsampled_ += kmers.size() - n, scratch.kmers_sampled_ += n;
+    kmers.resize(n);
+}
+
+// Classifies a read (or pair) into scratch.results_. Runs are only built if emit_runs is set.
+// If encoded is set, scratch.kmers_ already holds the read's minimizers.
+template<typename ScoreType>
+void classify_minimizers(const ClassifierGeneric<ScoreType> &c, Encoder<ScoreType> &enc,
+                         const bseq1_t *bs, const int is_paired, ClassifyScratch &scratch, bool emit_runs=true, bool encoded=false) {
+    auto &taxa(scratch.taxa_);
+    auto &kmers(scratch.kmers_);
+    if(!encoded) encode_minimizers(c, enc, bs, is_paired, scratch);
+    // Each window of sp_.w_ bases (at least a k-mer's span) yields one minimizer, or none if it holds ambiguous bases.
+    unsigned nkmer_windows(std::max(bs->l_seq - int(enc.sp_.w_) + 1, 0));
+    if(is_paired) nkmer_windows += std::max((bs + 1)->l_seq - int(enc.sp_.w_) + 1, 0);
+    for(size_t d(0); d < c.ndb(); ++d) {
+        auto &res(scratch.results_[d]);
+        u32 missing_count(0);
+        taxa.clear();
+        // With early termination, minimizers are probed a block at a time until the call is settled.
+        const size_t block(c.early_stop_ > 0. && kmers.size() > 2 * EARLY_STOP_BLOCK ? EARLY_STOP_BLOCK: kmers.size());
+        size_t end(0);
+        for(;;) {
+            const size_t begin(end);
+            end = std::min(begin + block, kmers.size());
+            lookup_minimizers(c, scratch, d, begin, end);
+            for(size_t i(begin); i < end; ++i) {
+                const tax_t tax(scratch.hits_[i]);
+                //If the kmer is missing from our database, just say we don't know what it is.
+                if(tax == 0) ++missing_count;
+                else taxa.push_back(tax), scratch.resolver_.add(tax);
+            }
+            if(end == kmers.size()) break;
+            // The leader cannot lead by more than the number of hits, so most checks need not resolve anything.
+            const u32 margin(std::ceil(c.early_stop_ * (kmers.size() - end)));
+            if(taxa.size() > margin && scratch.resolver_.settled(margin)) break;
+        }
+        if(end < kmers.size()) scratch.skipped_lookups_ += kmers.size() - end, ++scratch.stopped_early_;
+        res.taxon_   = scratch.resolver_.resolve();
+        res.missing_ = missing_count;
+        res.ambig_   = nkmer_windows - kmers.size() - scratch.mate_dups_ - scratch.unsampled_;
+        res.runs_.clear();
+        if(!emit_runs || c.get_report_only()) continue;
+        if(c.get_emit_binary())      append_taxa_runs_binary(res.taxon_, taxa, res.runs_);
+        else if(c.get_emit_kraken()) append_taxa_runs(res.taxon_, taxa, res.runs_);
     }
+}
 
-    ++c.classified_[!(taxon = resolve_tree(hit_counts, taxmap))];
-    if(c.get_emit_all() || taxon) {
+// Counts the read (or pair) classified in scratch.results_ and appends its output to bks.
+// Returns the number of bytes appended.
+template<typename ScoreType>
+unsigned append_classification(const ClassifierGeneric<ScoreType> &c, bseq1_t *bs, const int is_paired,
+                               ClassifyScratch &scratch, ks::string &bks, u64 read_index) {
+    const size_t start(bks.size());
+    const auto &results(scratch.results_);
+    bool classified(false);
+    for(const auto &res: results) classified |= res.taxon_ != 0;
+    ++c.classified_[!classified];
+    if(scratch.counts_)
+        for(size_t d(0); d < results.size(); ++d) scratch.counts_[d].add(results[d].taxon_);
+    if(c.get_report_only()) return 0;
+    if(c.get_emit_binary()) {
+        if(c.get_emit_all() || classified) append_binary_classification(results, bs, read_index, bks);
+    } else if(c.get_emit_all() || classified) {
+        const ReadResult &res(results[0]);
         switch(c.output_flag_) {
             case EMIT_ALL | FASTQ | KRAKEN: case FASTQ | KRAKEN: case FASTQ: case EMIT_ALL | FASTQ:
-                append_fastq_classification(hit_counts, taxa, taxon, ambig_count, missing_count, bs, bks, c.get_emit_kraken(), is_paired); break;
+                if(results.size() == 1) append_fastq_classification(res.runs_, res.taxon_, res.ambig_, res.missing_, bs, bks, c.get_emit_kraken(), is_paired);
+                else                    append_fastq_classification(results, bs, bks, c.get_emit_kraken(), is_paired);
+                break;
             case EMIT_ALL | KRAKEN: case KRAKEN:
-                append_kraken_classification(hit_counts, taxa, taxon, ambig_count, missing_count, bs, bks); break;
+                if(results.size() == 1) append_kraken_classification(res.runs_, res.taxon_, res.ambig_, res.missing_, bs, bks);
+                else                    append_kraken_classification(results, bs, bks);
+                break;
         }
     }
-    LOG_DEBUG("About to return. Len of bks = %zu. len of string: %d\n", bks.size(), std::strlen(bks.data()));
-    bs->l_sam = bks.size();
-    bs->sam = bks.release();
-    return bs->l_sam;
+    return bks.size() - start;
 }
 
+// Classifies a read (or pair) and appends its output to bks. Returns the number of bytes appended.
+template<typename ScoreType>
+unsigned classify_seq(const ClassifierGeneric<ScoreType> &c,
+                      Encoder<ScoreType> &enc,
+                      bseq1_t *bs, const int is_paired, ClassifyScratch &scratch, ks::string &bks, ReadCache *read_cache=nullptr, u64 read_index=0) {
+    LOG_DEBUG("starting classify_seq with bs at pointer = %p\n", static_cast<const void*>(bs));
+    const auto &results(scratch.results_);
+    if(!c.read_sampled(bs)) return ++scratch.reads_skipped_, 0;
+    // Host reads are screened with the classifier's minimizers if the host set shares its encoding.
+    bool encoded(false);
+    if(c.host_) {
+        if((encoded = c.host_->compatible(enc.sp_))) {
+            encode_minimizers(c, enc, bs, is_paired, scratch);
+            if(c.host_->is_host(scratch.kmers_.data(), scratch.kmers_.size(), *scratch.host_)) return 0;
+        } else if(c.host_->is_host(bs, is_paired, *scratch.host_)) return 0;
+    }
+    if(read_cache) {
+        const ReadCache::Key key(ReadCache::make_key(bs, is_paired));
+        ++scratch.read_lookups_;
+        bool hit(true);
+        for(size_t d(0); hit && d < c.ndb(); ++d) hit = read_cache->get(key.db(d), scratch.results_[d]);
+        if(hit) ++scratch.read_hits_;
+        else {
+            classify_minimizers(c, enc, bs, is_paired, scratch, true, encoded);
+            for(size_t d(0); d < c.ndb(); ++d) read_cache->put(key.db(d), results[d]);
+        }
+    } else classify_minimizers(c, enc, bs, is_paired, scratch, true, encoded);
+    return append_classification(c, bs, is_paired, scratch, bks, read_index);
+}
 
-inline void kt_for_helper(void *data_, long index, int) {
+// Classifies a read from its nwin window results (ndb per window) and appends its output to bks.
+template<typename ScoreType>
+unsigned classify_windowed_seq(const ClassifierGeneric<ScoreType> &c, bseq1_t *bs, const WindowResult *windows, u32 nwin,
+                               ClassifyScratch &scratch, ks::string &bks, u64 read_index) {
+    const size_t ndb(c.ndb());
+    auto &taxa(scratch.taxa_);
+    for(size_t d(0); d < ndb; ++d) {
+        auto &res(scratch.results_[d]);
+        taxa.clear();
+        res.missing_ = res.ambig_ = 0;
+        for(u32 i(0); i < nwin; ++i) {
+            const WindowResult &win(windows[i * ndb + d]);
+            taxa.push_back(win.taxon_);
+            if(win.taxon_) scratch.resolver_.add(win.taxon_);
+            res.missing_ += win.missing_, res.ambig_ += win.ambig_;
+        }
+        res.taxon_ = scratch.resolver_.resolve();
+        res.runs_.clear();
+        if(c.get_report_only())      continue;
+        if(c.get_emit_binary())      append_taxa_runs_binary(res.taxon_, taxa, res.runs_);
+        else if(c.get_emit_kraken()) append_taxa_runs(res.taxon_, taxa, res.runs_);
+    }
+    return append_classification(c, bs, 0, scratch, bks, read_index);
+}
+
+
+// Returns thread tid's scratch space, creating it on first use.
+inline ClassifyScratch &thread_scratch(kt_data *data, int tid) {
+    if(!data->scratch_[tid]) {
+        // Pin before allocating, so that the thread's scratch space is node-local by first touch.
+        const int slot(data->c_.numa_slot(tid));
+        if(slot >= 0 && !numa::pin_thread(data->c_.numa_nodes_[slot]))
+            LOG_WARNING("Could not pin thread %i to NUMA node %i.\n", tid, data->c_.numa_nodes_[slot]);
+        data->scratch_[tid].reset(new ClassifyScratch(data->tax_, data->c_.ndb(), data->c_.replicated() ? slot: -1));
+        data->scratch_[tid]->enc_.reset(new Encoder<score::Lex>(data->c_.enc_));
+        if(data->counts_) data->scratch_[tid]->counts_ = data->counts_ + tid * data->c_.ndb();
+        if(data->c_.host_) data->scratch_[tid]->host_ = data->c_.host_->make_scratch();
+    }
+    return *data->scratch_[tid];
+}
+
+inline void kt_for_helper(void *data_, long index, int tid) {
     kt_data *data((kt_data *)data_);
-    size_t retstr_size(0);
     const int inc(!!data->is_paired_ + 1);
-    Encoder<score::Lex> enc(data->c_.enc_);
-    std::vector<tax_t> taxa;
-    //static_assert(std::is_same_v<unsigned, std::decay_t<decltype((data->per_set_ + static_cast<unsigned>(1)) * index)>>, "Should be true.");
-    for(unsigned i(index * data->per_set_); i < std::min((data->per_set_ + 1) * static_cast<unsigned>(index), data->total_); retstr_size += classify_seq(data->c_, enc, data->taxmap, data->bs_ + i, data->is_paired_, taxa), i += inc);
-    data->retstr_size_ += retstr_size;
+    ClassifyScratch &scratch(thread_scratch(data, tid));
+    ks::string &out(data->task_out_[index]);
+    out.clear();
+    if(const ReadWindows *windows = data->windows_) {
+        const size_t ndb(data->c_.ndb());
+        for(u32 i(data->bounds_[index]), e(data->bounds_[index + 1]); i < e; ++i) {
+            // Reads left out by subsampling have no windows.
+            if(windows->first_[i + 1] == windows->first_[i]) {++scratch.reads_skipped_; continue;}
+            classify_windowed_seq(data->c_, data->bs_ + i, windows->results_.data() + windows->first_[i] * ndb,
+                                  windows->first_[i + 1] - windows->first_[i], scratch, out, data->first_index_ + i);
+        }
+        return;
+    }
+    for(u32 i(data->bounds_[index]), e(data->bounds_[index + 1]); i < e; classify_seq(data->c_, *scratch.enc_, data->bs_ + i, data->is_paired_, scratch, out, data->read_cache_, data->first_index_ + i / inc), i += inc);
+}
+
+// Classifies the windows of task index into data->windows_->results_.
+inline void kt_window_helper(void *data_, long index, int tid) {
+    kt_data *data((kt_data *)data_);
+    const auto &c(data->c_);
+    ClassifyScratch &scratch(thread_scratch(data, tid));
+    ReadWindows &windows(*data->windows_);
+    const u32 window(c.window_), overlap(c.enc_.sp_.w_ - 1), ndb(c.ndb());
+    const u32 begin(windows.bounds_[index]), end(windows.bounds_[index + 1]);
+    u32 read(std::upper_bound(windows.first_.begin(), windows.first_.end(), begin) - windows.first_.begin() - 1);
+    for(u32 w(begin); w < end; ++w) {
+        while(windows.first_[read + 1] <= w) ++read;
+        const bseq1_t &bs(data->bs_[read]);
+        const u32 i(w - windows.first_[read]);
+        bseq1_t win(bs);
+        win.seq  += i * window;
+        win.l_seq = i + 1 == windows.first_[read + 1] - windows.first_[read] ? bs.l_seq - i * window: std::min(window + overlap, bs.l_seq - i * window);
+        classify_minimizers(c, *scratch.enc_, &win, 0, scratch, false);
+        for(u32 d(0); d < ndb; ++d) {
+            const ReadResult &res(scratch.results_[d]);
+            windows.results_[w * ndb + d] = WindowResult{res.taxon_, res.missing_, res.ambig_};
+        }
+    }
 }
 
 
 
 using Classifier = ClassifierGeneric<score::Lex>;
 
-inline void classify_seqs(const Classifier &c, const khash_t(p) *taxmap, bseq1_t *bs,
-                          ks::string &cks, const unsigned chunk_size, const unsigned per_set, const int is_paired, ForPool &pool) {
-    assert(per_set && ((per_set & (per_set - 1)) == 0));
-
-    std::atomic<u64> retstr_size(0);
-    kt_data data{c, taxmap, bs, per_set, chunk_size, retstr_size, is_paired};
-    pool.forpool(&kt_for_helper, (void *)&data, chunk_size / per_set + 1);
-    cks.resize(retstr_size.load());
-    const int inc((is_paired != 0) + 1);
-#if !NDEBUG
-    for(u32 i(0); i < chunk_size; i += inc) {
-        cks.putsn_(bs[i].sam, bs[i].l_sam);
-        LOG_DEBUG("sam1: %s. len: %d. chunk size: %u\n", bs[i].sam, bs[i].l_sam, chunk_size);
-    }
-#else
-    for(u32 i(0); i < chunk_size; cks.putsn_(bs[i].sam, bs[i].l_sam), i += inc);
-#endif
-    cks.terminate();
-}
-
-struct del_data {
-    bseq1_t *seqs_;
-    unsigned per_set_;
-    unsigned total_;
+/*
+ * Load balancing for classify_seqs.
+ * A chunk is cut into contiguous tasks holding roughly equal numbers of bases rather than reads,
+ * so that long reads mixed with short ones do not leave threads idle at the end of a chunk.
+ * The grain adapts to the chunk: it aims for TASKS_PER_THREAD tasks per thread,
+ * but no task is smaller than MIN_TASK_BASES, which keeps scheduling overhead negligible.
+ * Tasks are dispatched through kt_forpool, whose workers steal indices from one another once their own run out.
+ */
+static constexpr unsigned TASKS_PER_THREAD = 8;
+static constexpr u64      MIN_TASK_BASES   = 1 << 14;
+// Bases read per chunk, per classification thread, when the chunk size is chosen automatically.
+static constexpr u64      CHUNK_BASES_PER_THREAD = TASKS_PER_THREAD * (MIN_TASK_BASES << 2);
+
+inline void partition_by_bases(const bseq1_t *bs, u32 nseq, int is_paired, unsigned nthreads, std::vector<u32> &bounds) {
+    const u32 inc(!!is_paired + 1);
+    u64 total(0);
+    for(u32 i(0); i < nseq; total += bs[i++].l_seq);
+    const u64 target(std::max(MIN_TASK_BASES, total / (u64(nthreads) * TASKS_PER_THREAD) + 1));
+    bounds.assign(1, 0);
+    u64 acc(0);
+    for(u32 i(0); i < nseq; i += inc) {
+        acc += bs[i].l_seq + (is_paired ? bs[i + 1].l_seq: 0);
+        if(acc >= target) bounds.push_back(i + inc), acc = 0;
+    }
+    if(bounds.back() != nseq) bounds.push_back(nseq);
+}
+
+// Classifies bs[0:nseq]. Each task formats its reads into its own buffer in task_out, which grows to
+// the largest number of tasks seen and keeps its memory from chunk to chunk. Returns the number of tasks:
+// the output is task_out[0:ntasks], in order.
+// If counts is set, reads are also counted by taxon, each thread in its own c.ndb() elements of it.
+// With c.window_ set, reads are single-end and classified by windows, using windows for scratch space;
+// windows are then dispatched in tasks of roughly equal numbers, and read_cache is not used.
+// Reads left out by subsampling get no windows.
+inline size_t classify_seqs(const Classifier &c, const DenseTaxonomy &tax, std::unique_ptr<ClassifyScratch> *scratch, ReadCache *read_cache, bseq1_t *bs,
+                            const u32 nseq, const int is_paired, ForPool &pool, std::vector<u32> &bounds,
+                            std::vector<ks::string> &task_out, u64 first_index=0, TaxonCounts *counts=nullptr, ReadWindows *windows=nullptr) {
+    partition_by_bases(bs, nseq, is_paired, c.nt_, bounds);
+    const size_t ntasks(bounds.size() - 1);
+    if(task_out.size() < ntasks) task_out.resize(ntasks);
+    kt_data data{c, tax, scratch, read_cache, bs, bounds.data(), first_index, task_out.data(), counts, c.window_ ? windows: nullptr, is_paired};
+    if(data.windows_) {
+        auto &first(windows->first_);
+        first.assign(1, 0);
+        for(u32 i(0); i < nseq; ++i) first.push_back(first.back() + (c.read_sampled(bs + i) ? nwindows(bs[i].l_seq, c.window_): 0));
+        windows->results_.resize(size_t(first.back()) * c.ndb());
+        const u32 per_task(std::max<u64>(MIN_TASK_BASES / c.window_, first.back() / (u64(c.nt_) * TASKS_PER_THREAD)) + 1);
+        windows->bounds_.clear();
+        for(u32 w(0); w < first.back(); w += per_task) windows->bounds_.push_back(w);
+        windows->bounds_.push_back(first.back());
+        pool.forpool(&kt_window_helper, (void *)&data, windows->bounds_.size() - 1);
+    }
+    pool.forpool(&kt_for_helper, (void *)&data, ntasks);
+    return ntasks;
+}
+
+/*
+ * Read -> classify -> write pipeline for process_dataset.
+ * Step 0 parses a chunk of reads, step 1 classifies it on the ForPool and step 2
+ * writes its output. kt_pipeline keeps each step in input order, so output is
+ * identical to the sequential version, while decompression, classification and
+ * writing of consecutive chunks overlap.
+ * With a report, threads count reads by taxon as they classify them. Step 2 rewrites the report
+ * from the counts so far when one is due, and write_report() writes the final one.
+ */
+// A batch owns no per-read memory: records are views into blocks_, which return to their reader
+// for reuse when the batch is cleared, and clearing keeps the capacity of every buffer.
+// Once the first NBUFFERS batches have been through, reading and classifying allocate nothing per read.
+// Output stays in the buffers the classification tasks wrote it to, and is written from there with writev.
+struct ReadBatch {
+    std::vector<bseq1_t>       seqs_;   // Views into blocks_
+    std::vector<FastxBlockPtr> blocks_;
+    int                        nseq_;
+    u64                        first_;  // Index in the input of the batch's first read (or pair)
+    std::vector<ks::string>    task_out_; // Output of each classification task
+    std::vector<ks::string>    host_out_; // Host reads of each screening task (ScreenPipeline only)
+    size_t                     ntasks_;   // Number of task_out_ buffers holding this batch's output
+    ReadBatch(): nseq_(0), first_(0), ntasks_(0) {}
+    void clear() {
+        seqs_.clear();
+        blocks_.clear();
+        nseq_ = 0;
+        ntasks_ = 0;
+    }
 };
 
+struct ClassifierPipeline {
+    static constexpr int NBUFFERS = 3; // Number of batches in flight: one each for read, classify and write.
+    const Classifier  &c_;
+    const DenseTaxonomy tax_;
+    std::vector<std::unique_ptr<ClassifyScratch>> scratch_;
+    FastxReader       *r1_, *r2_; // r2_ is null for single-end input, and r1_ for interleaved input.
+    const unsigned     chunk_size_;
+    OutputSink        &out_;
+    const int          is_paired_;
+    ForPool            pool_;
+    ReadBatch          batches_[NBUFFERS];
+    u64                nbatches_, nseq_;
+    std::unique_ptr<ReadCache> read_cache_;
+    std::vector<u32>   bounds_; // Task boundaries for the batch being classified
+    TaxonReport       *report_;
+    std::vector<TaxonCounts> counts_; // Per thread and database, if report_ is set
+    ReadWindows        windows_; // Windows of the batch being classified, if c.window_ is set
+
+    ClassifierPipeline(const Classifier &c, const khash_t(p) *taxmap, FastxReader *r1, FastxReader *r2,
+                       unsigned chunk_size, OutputSink &out, size_t read_cache_bytes=0, TaxonReport *report=nullptr):
+        c_(c), tax_(taxmap), r1_(r1), r2_(r2),
+        chunk_size_(chunk_size ? chunk_size: std::min(u64(std::numeric_limits<int>::max()), std::max(u64(1) << 20, CHUNK_BASES_PER_THREAD * c.nt_))),
+        out_(out), is_paired_(r2 != nullptr), pool_(c.nt_), nbatches_(0), nseq_(0),
+        read_cache_(read_cache_bytes ? new ReadCache(read_cache_bytes): nullptr), report_(report)
+    {
+        scratch_.resize(c.nt_);
+        if(report_) {
+            counts_.reserve(c.nt_ * c.ndb());
+            while(counts_.size() < c.nt_ * c.ndb()) counts_.emplace_back(tax_);
+        }
+    }
+    // Sums the threads' counts so far into a report.
+    void write_report() {
+        std::vector<std::vector<u64>> sums(c_.ndb(), std::vector<u64>(tax_.size() + 2));
+        for(size_t i(0); i < counts_.size(); ++i) counts_[i].add_to(sums[i % c_.ndb()]);
+        report_->write(tax_, sums);
+    }
+
+    void run() {kt_pipeline(NBUFFERS, &ClassifierPipeline::step, static_cast<void *>(this), 3);}
+    void log_cache_stats() const {
+        u64 lookups(0), repeats(0), probes(0), hits(0), read_lookups(0), read_hits(0), skipped(0), stopped(0), checks(0), filtered(0),
+            screened(0), host(0), mate_kmers(0), mate_dropped(0), reads_skipped(0), kmers_sampled(0), kmers_unsampled(0);
+        unsigned ninactive(0), nused(0);
+        for(const auto &sp: scratch_) {
+            if(!sp) continue;
+            ++nused;
+            const ClassifyScratch &scratch(*sp);
+            for(const auto &cache: scratch.caches_) {
+                lookups += cache.lookups_, repeats += cache.repeats_, probes += cache.probes_, hits += cache.hits_;
+                ninactive += !cache.active();
+            }
+            read_lookups += scratch.read_lookups_, read_hits += scratch.read_hits_;
+            skipped += scratch.skipped_lookups_, stopped += scratch.stopped_early_;
+            checks += scratch.filter_checks_, filtered += scratch.filtered_;
+            if(scratch.host_) screened += scratch.host_->screened_, host += scratch.host_->host_;
+            mate_kmers += scratch.mate_kmers_, mate_dropped += scratch.mate_dropped_;
+            reads_skipped += scratch.reads_skipped_, kmers_sampled += scratch.kmers_sampled_, kmers_unsampled += scratch.kmers_unsampled_;
+        }
+        if(c_.read_fraction_ < 1.) {
+            const u64 nreads(nseq_ / (is_paired_ + 1));
+            LOG_INFO("Read subsampling: classified %zu of %zu reads (or pairs) (%0.2f%%).\n",
+                     size_t(nreads - reads_skipped), size_t(nreads), nreads ? 100. * (nreads - reads_skipped) / nreads: 0.);
+        }
+        if(c_.sampling_kmers())
+            LOG_INFO("Minimizer sampling: looked up %zu of %zu minimizers (%0.2f%%).\n", size_t(kmers_sampled), size_t(kmers_sampled + kmers_unsampled),
+                     kmers_sampled + kmers_unsampled ? 100. * kmers_sampled / (kmers_sampled + kmers_unsampled): 0.);
+        if(mate_kmers)
+            LOG_INFO("Mate deduplication: %zu of %zu second-mate minimizers (%0.2f%%) were shared with the first mate and not looked up.\n",
+                     size_t(mate_dropped), size_t(mate_kmers), 100. * mate_dropped / mate_kmers);
+        if(c_.host_)
+            LOG_INFO("Host screen: removed %zu of %zu reads (or pairs) (%0.2f%%) before classification.\n",
+                     size_t(host), size_t(screened), screened ? 100. * host / screened: 0.);
+        if(checks)
+            LOG_INFO("Bloom prefilter: %zu of %zu table lookups (%0.2f%%) rejected without probing the table.\n",
+                     size_t(filtered), size_t(checks), 100. * filtered / checks);
+        if(c_.early_stop_ > 0.)
+            LOG_INFO("Early termination: %zu read classifications stopped early, skipping %zu minimizer lookups (%0.2f%% of all).\n",
+                     size_t(stopped), size_t(skipped), lookups + skipped ? 100. * skipped / (lookups + skipped): 0.);
+        if(read_lookups)
+            LOG_INFO("Duplicate read cache: %zu of %zu reads reused a cached classification (%0.2f%%)\n",
+                     size_t(read_hits), size_t(read_lookups), 100. * read_hits / read_lookups);
+        if(lookups == 0) return;
+        LOG_INFO("Minimizer cache: %zu lookups, %0.2f%% repeated from the previous window, %0.2f%% cache hits (%0.2f%% of probes), "
+                 "%0.2f%% sent to the database. Cache off in %u/%u per-thread caches.\n",
+                 size_t(lookups), 100. * repeats / lookups, 100. * hits / lookups, probes ? 100. * hits / probes: 0.,
+                 100. * (lookups - repeats - hits) / lookups, ninactive, nused * unsigned(c_.ndb()));
+    }
 
+    static void *step(void *data, int step, void *in) {
+        ClassifierPipeline &pl(*static_cast<ClassifierPipeline *>(data));
+        switch(step) {
+            case 0: {
+                // At most NBUFFERS batches are in flight and batches leave the pipeline in order,
+                // so by the time we read batch n, batch n - NBUFFERS has been written out.
+                ReadBatch *batch(pl.batches_ + pl.nbatches_ % NBUFFERS);
+                batch->clear();
+                fastx_read_batch(*pl.r1_, pl.r2_, pl.chunk_size_, batch->seqs_, batch->blocks_);
+                if((batch->nseq_ = batch->seqs_.size()) == 0) return nullptr;
+                LOG_INFO("Read %i seqs with chunk size %u\n", batch->nseq_, pl.chunk_size_);
+                ++pl.nbatches_;
+                batch->first_ = pl.nseq_ / (pl.is_paired_ + 1);
+                pl.nseq_ += batch->nseq_;
+                return static_cast<void *>(batch);
+            }
+            case 1: {
+                ReadBatch *batch(static_cast<ReadBatch *>(in));
+                batch->ntasks_ = classify_seqs(pl.c_, pl.tax_, pl.scratch_.data(), pl.read_cache_.get(), batch->seqs_.data(), batch->nseq_, pl.is_paired_,
+                                               pl.pool_, pl.bounds_, batch->task_out_, batch->first_, pl.report_ ? pl.counts_.data(): nullptr, &pl.windows_);
+                return in;
+            }
+            case 2: {
+                ReadBatch *batch(static_cast<ReadBatch *>(in));
+                if(!pl.out_.write(batch->task_out_.data(), batch->ntasks_))
+                    LOG_EXIT("Could not write classification output.\n");
+                if(pl.report_ && pl.report_->due()) pl.write_report();
+                return nullptr;
+            }
+        }
+        return nullptr;
+    }
+};
+
+/*
+ * Read -> screen -> write pipeline for screen_dataset, built as ClassifierPipeline.
+ * Each task writes its reads to its own buffer of non-host reads, and host reads to another,
+ * or drops them if host reads are not kept. Pairs are written interleaved.
+ */
+struct ScreenPipeline {
+    static constexpr int NBUFFERS = 3;
+    const HostScreen  &screen_;
+    FastxReader       *r1_, *r2_; // As in ClassifierPipeline
+    const unsigned     nt_, chunk_size_;
+    OutputSink        &out_, *host_out_; // host_out_ is null unless host reads are kept.
+    const int          is_paired_;
+    ForPool            pool_;
+    ReadBatch          batches_[NBUFFERS];
+    std::vector<std::unique_ptr<HostScratch>> scratch_; // One per thread, created by the thread itself
+    std::vector<u32>   bounds_;
+    u64                nbatches_, nseq_, bases_;
+    ReadBatch         *batch_; // Batch being screened
+
+    ScreenPipeline(const HostScreen &screen, FastxReader *r1, FastxReader *r2, unsigned nthreads, OutputSink &out, OutputSink *host_out):
+        screen_(screen), r1_(r1), r2_(r2), nt_(std::max(1u, nthreads)),
+        chunk_size_(std::min(u64(std::numeric_limits<int>::max()), std::max(u64(1) << 20, CHUNK_BASES_PER_THREAD * nt_))),
+        out_(out), host_out_(host_out), is_paired_(r2 != nullptr), pool_(nt_), scratch_(nt_), nbatches_(0), nseq_(0), bases_(0), batch_(nullptr) {}
+
+    void run() {kt_pipeline(NBUFFERS, &ScreenPipeline::step, static_cast<void *>(this), 3);}
+    u64 nscreened() const {u64 ret(0); for(const auto &sp: scratch_) if(sp) ret += sp->screened_; return ret;}
+    u64 nhost()     const {u64 ret(0); for(const auto &sp: scratch_) if(sp) ret += sp->host_;     return ret;}
+    u64 nprobes()   const {u64 ret(0); for(const auto &sp: scratch_) if(sp) ret += sp->probes_;   return ret;}
+
+    static void screen_task(void *data, long index, int tid) {
+        ScreenPipeline &pl(*static_cast<ScreenPipeline *>(data));
+        if(!pl.scratch_[tid]) pl.scratch_[tid] = pl.screen_.make_scratch();
+        HostScratch &scratch(*pl.scratch_[tid]);
+        ReadBatch &batch(*pl.batch_);
+        ks::string &out(batch.task_out_[index]), &host(batch.host_out_[index]);
+        out.clear(), host.clear();
+        const int inc(pl.is_paired_ + 1);
+        for(u32 i(pl.bounds_[index]), e(pl.bounds_[index + 1]); i < e; i += inc) {
+            const bool is_host(pl.screen_.is_host(batch.seqs_.data() + i, pl.is_paired_, scratch));
+            if(is_host && pl.host_out_ == nullptr) continue;
+            ks::string &dest(is_host ? host: out);
+            append_fastx_record(batch.seqs_[i], dest);
+            if(pl.is_paired_) append_fastx_record(batch.seqs_[i + 1], dest);
+        }
+    }
+    static void *step(void *data, int step, void *in) {
+        ScreenPipeline &pl(*static_cast<ScreenPipeline *>(data));
+        switch(step) {
+            case 0: {
+                ReadBatch *batch(pl.batches_ + pl.nbatches_ % NBUFFERS);
+                batch->clear();
+                fastx_read_batch(*pl.r1_, pl.r2_, pl.chunk_size_, batch->seqs_, batch->blocks_);
+                if((batch->nseq_ = batch->seqs_.size()) == 0) return nullptr;
+                ++pl.nbatches_;
+                pl.nseq_ += batch->nseq_;
+                for(const auto &bs: batch->seqs_) pl.bases_ += bs.l_seq;
+                return static_cast<void *>(batch);
+            }
+            case 1: {
+                ReadBatch *batch(static_cast<ReadBatch *>(in));
+                partition_by_bases(batch->seqs_.data(), batch->nseq_, pl.is_paired_, pl.nt_, pl.bounds_);
+                batch->ntasks_ = pl.bounds_.size() - 1;
+                if(batch->task_out_.size() < batch->ntasks_) batch->task_out_.resize(batch->ntasks_), batch->host_out_.resize(batch->ntasks_);
+                pl.batch_ = batch;
+                pl.pool_.forpool(&ScreenPipeline::screen_task, data, batch->ntasks_);
+                return in;
+            }
+            case 2: {
+                ReadBatch *batch(static_cast<ReadBatch *>(in));
+                if(!pl.out_.write(batch->task_out_.data(), batch->ntasks_)
+                   || (pl.host_out_ && !pl.host_out_->write(batch->host_out_.data(), batch->ntasks_)))
+                    LOG_EXIT("Could not write screened reads.\n");
+                return nullptr;
+            }
+        }
+        return nullptr;
+    }
+};
+
+// Opens a (possibly compressed) sequence file, or standard input for "-". Pipes and FIFOs work
+// like regular files: reads are parsed as they arrive.
+// nthreads threads inflate BGZF and multi-frame zstd input; see InputStream.
+inline std::unique_ptr<InputStream> open_reads(const char *path, int nthreads=1) {
+    try {
+        return std::unique_ptr<InputStream>(new InputStream(path, nthreads));
+    } catch(const file_open_error &) {
+        LOG_EXIT("Could not open input file %s.\n", path);
+    } catch(const std::exception &ex) {
+        LOG_EXIT("%s\n", ex.what());
+    }
+    return nullptr;
+}
+
+// chunk_size is the number of bases read per batch; 0 chooses it from the number of threads.
+// If read_cache_bytes is nonzero, byte-identical reads (or pairs) reuse cached classifications,
+// using at most about that much memory.
+// If interleaved is set, fq1 holds pairs as consecutive records and fq2 must be null.
+// Either path may be "-" for standard input. Output is written batch by batch, so memory stays
+// bounded by the batches in flight however long the input is.
+// If compress is set, output goes through zlib (see OutputSink). Binary output starts with a BinaryHeader.
+// inflate_threads threads per input file decompress BGZF and multi-frame zstd input.
+// If report is set, a clade report of the reads is written with it, periodically and at the end.
 inline void process_dataset(const Classifier &c, const khash_t(p) *taxmap, const char *fq1, const char *fq2,
-                            std::FILE *out, unsigned chunk_size,
-                            unsigned per_set) {
-    // TODO: consider reusing buffers for processing large numbers of files.
-    int nseq(0), max_nseq(0);
-    gzFile ifp1(gzopen(fq1, "rb")), ifp2(fq2 ? gzopen(fq2, "rb"): nullptr);
-    kseq_t *ks1(kseq_init(ifp1)), *ks2(ifp2 ? kseq_init(ifp2): nullptr);
-    ks::string cks(256u);
-    const int fn = fileno(out), is_paired(fq2 != 0);
-    del_data dd{nullptr, per_set, chunk_size};
-    ForPool pool(c.nt_);
-    if((dd.seqs_ = bseq_read(chunk_size, &nseq, (void *)ks1, (void *)ks2)) == nullptr) {
-        LOG_WARNING("Could not get any sequences from file, fyi.\n");
-        goto fail; // Wheeeeee
-    }
-    classify_seqs(c, taxmap, dd.seqs_, cks, nseq, per_set, is_paired, pool);
-    std::fprintf(stderr, "nseq: %i\n", nseq);
-    max_nseq = std::max(max_nseq, nseq);
-    while((dd.seqs_ = bseq_realloc_read(chunk_size, &nseq, (void *)ks1, (void *)ks2, dd.seqs_)) && nseq) {
-        LOG_INFO("Read %i seqs with chunk size %u\n", nseq, chunk_size);
-        max_nseq = std::max(max_nseq, nseq);
-        // Classify
-        classify_seqs(c, taxmap, dd.seqs_, cks, nseq, per_set, is_paired, pool);
-        // Write out
-        LOG_DEBUG("Emitting batch. str: %s", cks.data());
-        if(cks.size() > (1ull << 16)) {
-            cks.write(fn);
-            cks.clear();
+                            std::FILE *out, unsigned chunk_size=0, size_t read_cache_bytes=0, bool interleaved=false,
+                            bool compress=false, int inflate_threads=1, TaxonReport *report=nullptr) {
+    if(interleaved && fq2) LOG_EXIT("Interleaved input takes a single file.\n");
+    if(c.window_ && (fq2 || interleaved)) LOG_EXIT("Windowed classification takes single-end reads.\n");
+    if(c.window_ && c.host_) LOG_EXIT("Host screening is not supported with windowed classification.\n");
+    if(c.window_ && c.window_ < c.enc_.sp_.w_) LOG_EXIT("Windows of %u bases are shorter than a minimizer window.\n", unsigned(c.window_));
+    if(c.window_ && read_cache_bytes) {
+        LOG_WARNING("The duplicate read cache is not used with windowed classification.\n");
+        read_cache_bytes = 0;
+    }
+    auto in1(open_reads(fq1, inflate_threads)), in2(fq2 ? open_reads(fq2, inflate_threads): nullptr);
+    FastxReader r1(in1.get(), true), r2(in2.get(), true);
+    FastxReader *mates(in2 ? &r2: interleaved ? &r1: nullptr);
+    std::fflush(out);
+    {
+        OutputSink sink(fileno(out), compress);
+        if(c.get_emit_binary() && !c.get_report_only()) {
+            BinaryHeader header;
+            header.ndb_   = c.ndb();
+            if(mates)            header.flags_ |= BINARY_PAIRED;
+            if(interleaved)      header.flags_ |= BINARY_INTERLEAVED;
+            if(c.get_emit_all()) header.flags_ |= BINARY_ALL;
+            if(!sink.write(&header, sizeof(header))) LOG_EXIT("Could not write classification output.\n");
         }
+        ClassifierPipeline pl(c, taxmap, &r1, mates, chunk_size, sink, read_cache_bytes, report);
+        pl.run();
+        if(report) pl.write_report();
+        if(pl.nseq_ == 0) LOG_WARNING("Could not get any sequences from file, fyi.\n");
+        else              LOG_INFO("Classified %zu seqs in %zu batches\n", size_t(pl.nseq_), size_t(pl.nbatches_));
+        pl.log_cache_stats();
     }
-    cks.write(fn);
-    cks.clear();
-    // No use parallelizing the frees, there's a global lock on the freeing anyhow.
-    for(int i(0); i < max_nseq; bseq_destroy(dd.seqs_ + i++));
-    free(dd.seqs_);
-    fail:
-    // Clean up.
-    gzclose(ifp1);
-    kseq_destroy(ks1);
-    if(ks2) kseq_destroy(ks2);
-    if(ifp2) gzclose(ifp2);
-}
-
-static void append_fastq_classification(const tax_counter &,
-                                        const std::vector<tax_t> &taxa,
+}
+
+// Splits reads into host and non-host (see HostScreen), writing non-host reads to out and host reads to host_out,
+// or dropping them if host_out is null. Input is read as by process_dataset, and pairs are written interleaved.
+inline void screen_dataset(const HostScreen &screen, const char *fq1, const char *fq2, std::FILE *out, std::FILE *host_out,
+                           unsigned nthreads=1, bool interleaved=false, bool compress=false, int inflate_threads=1) {
+    if(interleaved && fq2) LOG_EXIT("Interleaved input takes a single file.\n");
+    auto in1(open_reads(fq1, inflate_threads)), in2(fq2 ? open_reads(fq2, inflate_threads): nullptr);
+    FastxReader r1(in1.get(), true), r2(in2.get(), true);
+    std::fflush(out);
+    if(host_out) std::fflush(host_out);
+    const auto start(std::chrono::steady_clock::now());
+    OutputSink sink(fileno(out), compress);
+    std::unique_ptr<OutputSink> host_sink(host_out ? new OutputSink(fileno(host_out), compress): nullptr);
+    ScreenPipeline pl(screen, &r1, in2 ? &r2: interleaved ? &r1: nullptr, nthreads, sink, host_sink.get());
+    pl.run();
+    const double secs(std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count());
+    const u64 nscreened(pl.nscreened()), nhost(pl.nhost());
+    if(nscreened == 0) LOG_WARNING("Could not get any sequences from file, fyi.\n");
+    else LOG_INFO("Screened %zu reads%s in %0.2fs (%0.1f Mbases/s): %zu host (%0.2f%%), %0.1f minimizers probed per read.\n",
+                  size_t(nscreened), pl.is_paired_ ? " (pairs)": "", secs, pl.bases_ / secs * 1e-6,
+                  size_t(nhost), 100. * nhost / nscreened, double(pl.nprobes()) / nscreened);
+}
+
+static void append_fastq_classification(const std::vector<tax_t> &taxa,
                                         const tax_t taxon, const u32 ambig_count, const u32 missing_count,
                                         bseq1_t *bs, kstring_t *bks, const int verbose, const int is_paired) {
     char *cms, *cme; // comment start, comment end -- used for using comment in both output reads.
@@ -374,8 +1385,7 @@ static void append_fastq_classification(const tax_counter &,
     bks->s[bks->l] = 0;
 }
 
-static void append_kraken_classification(const tax_counter &,
-                                  const std::vector<tax_t> &taxa,
+static void append_kraken_classification(const std::vector<tax_t> &taxa,
                                   const tax_t taxon, const u32 ambig_count, const u32 missing_count,
                                   bseq1_t *bs, kstring_t *bks) {
     static const char tbl[]{'C', 'U'};
@@ -0,0 +1,120 @@
+#pragma once
+#include "kseq_declare.h"
+#include "util.h"
+
+namespace bns {
+
+/*
+ * Binary classification output (classify -b).
+ * Text output spends most of its time formatting integers and copies every read name;
+ * the binary format writes fixed-width fields instead, and leaves names to the reads file.
+ *
+ * A BinaryHeader is followed by one record per emitted read (or pair). Fields are in host byte order;
+ * the magic number tells a reader if it differs from its own.
+ *   u64 read index: 0-based position of the read (or pair) in the input
+ *   u32 read length (of the first mate)
+ *   per database, in command-line order:
+ *     u32 taxon, u32 missing k-mers, u32 ambiguous k-mers, u32 number of runs n
+ *     n x {u32 taxon, u32 count}: the read's database hits, run-length encoded. Empty if the taxon is 0.
+ * bonsai decode converts records back to kraken-style text.
+ */
+static constexpr u64 BINARY_MAGIC   = 0x3156534C43534E42ull; // "BNSCLSV1"
+static constexpr u32 BINARY_VERSION = 1;
+
+enum BinaryFlags: u32 {
+    BINARY_PAIRED      = 1,
+    BINARY_INTERLEAVED = 2, // Pairs are consecutive records of one file.
+    BINARY_ALL         = 4  // Unclassified reads are included.
+};
+
+struct BinaryHeader {
+    u64 magic_   = BINARY_MAGIC;
+    u32 version_ = BINARY_VERSION;
+    u32 ndb_     = 1;
+    u32 flags_   = 0;
+    u32 reserved_ = 0;
+};
+
+struct BinaryRecord {
+    struct Result {
+        u32 taxon_, missing_, ambig_;
+        std::vector<std::pair<u32, u32>> runs_; // (taxon, count)
+    };
+    u64                 index_;
+    u32                 length_;
+    std::vector<Result> results_; // One per database
+};
+
+// Reads binary classification output, compressed or not.
+class BinaryReader {
+    gzFile       fp_;
+    BinaryHeader header_;
+    template<typename T>
+    bool read(T *p, size_t n) {
+        return gzread(fp_, static_cast<void *>(p), sizeof(T) * n) == static_cast<int>(sizeof(T) * n);
+    }
+public:
+    BinaryReader(const char *path): fp_(std::strcmp(path, "-") ? gzopen(path, "rb"): gzdopen(::dup(STDIN_FILENO), "rb")) {
+        if(fp_ == nullptr) LOG_EXIT("Could not open %s.\n", path);
+        gzbuffer(fp_, 1 << 17);
+        if(!read(&header_, 1)) LOG_EXIT("%s is too short for binary classification output.\n", path);
+        if(header_.magic_ != BINARY_MAGIC)
+            LOG_EXIT("%s is not binary classification output, or was written on a machine of different endianness.\n", path);
+        if(header_.version_ != BINARY_VERSION) LOG_EXIT("%s has unsupported version %u.\n", path, header_.version_);
+    }
+    ~BinaryReader() {gzclose(fp_);}
+    const BinaryHeader &header() const {return header_;}
+    // Returns false at the end of the input.
+    bool next(BinaryRecord &rec) {
+        if(!read(&rec.index_, 1)) return false;
+        if(!read(&rec.length_, 1)) LOG_EXIT("Truncated binary classification record.\n");
+        rec.results_.resize(header_.ndb_);
+        for(auto &res: rec.results_) {
+            u32 head[4];
+            if(!read(head, 4)) LOG_EXIT("Truncated binary classification record.\n");
+            res.taxon_ = head[0], res.missing_ = head[1], res.ambig_ = head[2];
+            res.runs_.resize(head[3]);
+            static_assert(sizeof(std::pair<u32, u32>) == 2 * sizeof(u32), "runs are read in place");
+            if(head[3] && !read(res.runs_.data(), head[3])) LOG_EXIT("Truncated binary classification record.\n");
+        }
+        return true;
+    }
+};
+
+// Classification output to a file descriptor, optionally compressed through zlib.
+// Builds with the zstd zlib wrapper (ZWRAP_USE_ZSTD) write zstd frames instead of gzip.
+class OutputSink {
+    int                fd_;
+    gzFile             gz_;
+    std::vector<iovec> iov_;
+public:
+    OutputSink(int fd, bool compress): fd_(fd), gz_(nullptr) {
+        if(compress) {
+            if((gz_ = gzdopen(::dup(fd), "wb1")) == nullptr) LOG_EXIT("Could not open compressed output.\n");
+            gzbuffer(gz_, 1 << 17);
+        }
+    }
+    ~OutputSink() {if(gz_ && gzclose(gz_) != Z_OK) LOG_WARNING("Could not finish compressed output.\n");}
+    bool write(const void *buf, size_t nb) {
+        if(gz_ == nullptr) return write_full(fd_, buf, nb) == static_cast<ssize_t>(nb);
+        for(const char *p(static_cast<const char *>(buf)), *end(p + nb); p < end;) {
+            const unsigned len(std::min(size_t(end - p), size_t(1) << 30));
+            if(gzwrite(gz_, p, len) != static_cast<int>(len)) return false;
+            p += len;
+        }
+        return true;
+    }
+    // Writes bufs[0:n] in order, gathered into as few system calls as possible rather than copied together first.
+    bool write(const ks::string *bufs, size_t n) {
+        if(gz_) {
+            for(size_t i(0); i < n; ++i) if(!write(bufs[i].data(), bufs[i].size())) return false;
+            return true;
+        }
+        iov_.clear();
+        for(size_t i(0); i < n; ++i)
+            if(bufs[i].size()) iov_.push_back(iovec{const_cast<char *>(bufs[i].data()), bufs[i].size()});
+        return writev_full(fd_, iov_.data(), iov_.size());
+    }
+};
+
+} // namespace bns
@@ -2,16 +2,51 @@
 #define _DATABASE_H__
 
 #include "encoder.h"
+#include "pages.h"
 #include "util.h"
+#include <cerrno>
 #include <cinttypes>
 #include <forward_list>
 #include <unordered_set>
+#include <fcntl.h>
+#include <sys/mman.h>
 
 #define __fr(item, fp) if(std::fread(&(item), 1, sizeof(item), fp) != sizeof(item)) throw std::runtime_error("Error: Could not read " #item);
-#define __fw(item, fp) if(std::fwrite(&(item), 1, sizeof(item), fp) != sizeof(item)) throw std::runtime_error("Error: Could not write " # item);
 
 namespace bns {
 
+/*
+ * Database files come in two layouts.
+ * Stream: k, w, the spacing and then khash_write_impl's output. Used for .gz/.zst
+ *   databases and always read into private memory.
+ * Mapped: a DBHeader padded to DB_PAGE_SIZE, followed by the flags, keys and vals
+ *   arrays, each starting on a page boundary. These are mmap'd read-only and probed
+ *   in place, so startup does no copying and concurrent processes share the page cache.
+ */
+static constexpr u64    DB_MAGIC     = 0x31564D4D44534E42ull; // "BNSDMMV1"
+static constexpr u32    DB_VERSION   = 1;
+static constexpr size_t DB_PAGE_SIZE = 1ull << 12;
+
+enum DBLoadFlags: int {
+    DB_MMAP_POPULATE = 1, // Prefault the whole table at load time (MAP_POPULATE).
+    DB_MMAP_WILLNEED = 2, // Start asynchronous readahead of the whole table.
+    DB_MMAP_RANDOM   = 4, // Disable readahead around faults, which only helps sequential access.
+    DB_NO_MMAP       = 8, // Copy mapped databases into private memory instead of probing the mapping.
+    DB_NO_PREFILTER  = 16 // Do not load the database's Bloom prefilter (see prefilter.h).
+};
+
+struct DBHeader {
+    u64 magic_;
+    u32 version_, k_, w_, key_size_, val_size_, spacing_len_;
+    u64 n_buckets_, size_, n_occupied_, upper_bound_;
+    u64 flags_offset_, keys_offset_, vals_offset_, file_size_;
+    u16 spacing_[64];
+    u32 canon_;  // Static host sets: 2 if keys are canonical, 1 if not, 0 if unrecorded
+    u64 sample_; // Static host sets: keys were sampled at one in sample_; 0 if unsampled
+};
+static_assert(sizeof(DBHeader) <= DB_PAGE_SIZE, "Database header must fit in one page.");
+
+INLINE constexpr u64 db_page_roundup(u64 x) {return (x + DB_PAGE_SIZE - 1) & ~u64(DB_PAGE_SIZE - 1);}
 
 template <typename T>
 struct Database {
@@ -21,6 +56,8 @@ struct Database {
     int      owns_hash_;
     spvec_t  s_;
     Spacer  *sp_;
+    void    *mm_;   // Mapping backing db_'s arrays: the database file, or anonymous memory from place().
+    size_t   mmsz_;
 
     Spacer *make_sp() {
         //std::fprintf(stderr, "Making sp with spacer = %s\n", str(s_).data());
@@ -30,32 +67,88 @@ struct Database {
         return ret;
     }
 
-    Database(const char *fn): owns_hash_(1), sp_(nullptr) {
+    Database(const char *fn, int load_flags=0): owns_hash_(1), sp_(nullptr), mm_(nullptr), mmsz_(0) {
         int filetype(0);
         {
             std::string fns = fn;
             std::string gzsuf   = ".gz";
             std::string zstdsuf = ".zst";
             if(std::equal(std::crbegin(gzsuf), std::crend(gzsuf), std::crbegin(fns))) filetype = 1;
-            else if(std::equal(std::crbegin(gzsuf), std::crend(gzsuf), std::crbegin(fns))) filetype = 2;
+            else if(std::equal(std::crbegin(zstdsuf), std::crend(zstdsuf), std::crbegin(fns))) filetype = 2;
         }
-        std::FILE *fp = filetype ? popen((std::string(filetype == 1 ? "gzip -dc " : "zstd -qdc ") + fn).data(), "rb"): std::fopen(fn, "rb");
-        if (fp) {
+        const auto start(std::chrono::system_clock::now());
+        std::FILE *fp = filetype ? popen((std::string(filetype == 1 ? "gzip -dc " : "zstd -qdc ") + fn).data(), "r"): std::fopen(fn, "rb");
+        if(!fp) LOG_EXIT("Could not open %s for reading.\n", fn);
+        u64 magic(0);
+        if(filetype == 0 && std::fread(&magic, sizeof(magic), 1, fp) == 1 && magic == DB_MAGIC) {
+            std::fclose(fp);
+            load_mapped(fn, load_flags);
+        } else {
+            if(filetype == 0) std::rewind(fp);
             __fr(k_, fp);
             __fr(w_, fp);
             s_ = spvec_t(k_ - 1);
             LOG_DEBUG("reading %zu bytes from file for vector, with %zu reserved\n", s_.size(), s_.capacity());
-            if(std::fread(s_.data(), s_.size(), sizeof(uint8_t), fp) != s_.size() * sizeof(uint8_t))
+            if(std::fread(s_.data(), sizeof(s_[0]), s_.size(), fp) != s_.size())
                 throw std::runtime_error("Error: Could not read spacing from file");
             db_ = khash_load_impl<T>(fp);
-        } else LOG_EXIT("Could not open %s for reading.\n", fn);
+            if(filetype) pclose(fp);
+            else         std::fclose(fp);
+        }
         sp_ = make_sp();
         assert(sp_);
-        LOG_DEBUG("Read database!\n");
-        std::fclose(fp);
+        LOG_INFO("Loaded database %s (%s, %zu buckets) in %lfs\n", fn, mm_ ? "mapped": "in memory", size_t(db_->n_buckets),
+                 std::chrono::duration<double>(std::chrono::system_clock::now() - start).count());
+    }
+    void load_mapped(const char *fn, int load_flags) {
+        const int fd(::open(fn, O_RDONLY));
+        if(fd < 0) LOG_EXIT("Could not open %s for reading.\n", fn);
+        DBHeader hdr;
+        if(read_full(fd, &hdr, sizeof(hdr)) != sizeof(hdr) || hdr.version_ != DB_VERSION)
+            LOG_EXIT("Could not read header from %s, or unsupported database version.\n", fn);
+        if(hdr.key_size_ != sizeof(*db_->keys) || hdr.val_size_ != sizeof(*db_->vals))
+            LOG_EXIT("Database %s has %u-byte keys and %u-byte values, expected %zu and %zu.\n", fn,
+                     hdr.key_size_, hdr.val_size_, sizeof(*db_->keys), sizeof(*db_->vals));
+        struct stat st;
+        if(::fstat(fd, &st) || u64(st.st_size) < hdr.file_size_) LOG_EXIT("Database %s is truncated.\n", fn);
+        // Each array must lie within the file, as must the spacing within the header.
+        auto fits = [&hdr](u64 offset, u64 bytes) {return offset <= hdr.file_size_ && bytes <= hdr.file_size_ - offset;};
+        if(hdr.spacing_len_ > sizeof(hdr.spacing_) / sizeof(hdr.spacing_[0]) || hdr.n_buckets_ > hdr.file_size_
+           || !fits(hdr.flags_offset_, __ac_fsize(hdr.n_buckets_) * sizeof(*db_->flags))
+           || !fits(hdr.keys_offset_,  hdr.n_buckets_ * sizeof(*db_->keys))
+           || !fits(hdr.vals_offset_,  hdr.n_buckets_ * sizeof(*db_->vals)))
+            LOG_EXIT("Database %s has a corrupt header.\n", fn);
+        k_ = hdr.k_;
+        w_ = hdr.w_;
+        s_ = spvec_t(hdr.spacing_, hdr.spacing_ + hdr.spacing_len_);
+        db_ = static_cast<T *>(std::calloc(1, sizeof(T)));
+        db_->n_buckets   = hdr.n_buckets_;
+        db_->size        = hdr.size_;
+        db_->n_occupied  = hdr.n_occupied_;
+        db_->upper_bound = hdr.upper_bound_;
+        mmsz_ = hdr.file_size_;
+        if((mm_ = ::mmap(nullptr, mmsz_, PROT_READ, MAP_SHARED | (load_flags & DB_MMAP_POPULATE ? MAP_POPULATE: 0), fd, 0)) == MAP_FAILED)
+            LOG_EXIT("Could not mmap %s: %s\n", fn, std::strerror(errno));
+        ::close(fd);
+        if((load_flags & DB_MMAP_RANDOM)   && ::madvise(mm_, mmsz_, MADV_RANDOM))
+            LOG_WARNING("madvise(MADV_RANDOM) failed: %s\n", std::strerror(errno));
+        if((load_flags & DB_MMAP_WILLNEED) && ::madvise(mm_, mmsz_, MADV_WILLNEED))
+            LOG_WARNING("madvise(MADV_WILLNEED) failed: %s\n", std::strerror(errno));
+        char *base(static_cast<char *>(mm_));
+        db_->flags = reinterpret_cast<decltype(db_->flags)>(base + hdr.flags_offset_);
+        db_->keys  = reinterpret_cast<decltype(db_->keys)>(base + hdr.keys_offset_);
+        db_->vals  = reinterpret_cast<decltype(db_->vals)>(base + hdr.vals_offset_);
+        if(load_flags & DB_NO_MMAP) {
+            khash_alloc_arrays(db_);
+            std::memcpy(db_->flags, base + hdr.flags_offset_, __ac_fsize(db_->n_buckets) * sizeof(*db_->flags));
+            std::memcpy(db_->keys,  base + hdr.keys_offset_,  db_->n_buckets * sizeof(*db_->keys));
+            std::memcpy(db_->vals,  base + hdr.vals_offset_,  db_->n_buckets * sizeof(*db_->vals));
+            ::munmap(mm_, mmsz_);
+            mm_ = nullptr, mmsz_ = 0;
+        }
     }
     Database(unsigned k, unsigned w, const spvec_t &s, unsigned owns=1, T *db=nullptr):
-        k_(k), w_(w), db_(db), owns_hash_(owns), s_(s), sp_(make_sp())
+        k_(k), w_(w), db_(db), owns_hash_(owns), s_(s), sp_(make_sp()), mm_(nullptr), mmsz_(0)
     {
     }
     Database(Spacer sp, unsigned owns=1, T *db=nullptr):
@@ -70,50 +163,170 @@ struct Database {
         db_(nullptr),
         owns_hash_(owns),
         s_(other.s_),
-        sp_(make_sp())
+        sp_(make_sp()),
+        mm_(nullptr),
+        mmsz_(0)
     {
     }
 
     ~Database() {
-        if(owns_hash_) khash_destroy(db_);
+        release();
         if(sp_)        delete sp_;
     }
-    void write(const char *fn, bool write_gz=false) const {
-        // TODO: add compression/work with zlib.
-        if(write_gz) {
+    void release() {
+        if(mm_) {
+            // Only the table struct is ours; its arrays live in the mapping.
+            std::free(db_);
+            ::munmap(mm_, mmsz_);
+            mm_ = nullptr, mmsz_ = 0;
+        } else if(owns_hash_) khash_destroy(db_);
+        db_ = nullptr;
+    }
+    bool mapped() const {return mm_ != nullptr;}
+
+    // Copies the table into anonymous memory from alloc_pages, laid out as in the mapped format.
+    // The caller owns the returned struct and the mapping in mm/mmsz.
+    T *placed_copy(const PagePolicy &policy, void *&mm, size_t &mmsz) const {
+        const u64 flagsz(__ac_fsize(db_->n_buckets) * sizeof(*db_->flags)),
+                  keysz(db_->n_buckets * sizeof(*db_->keys)),
+                  valsz(db_->n_buckets * sizeof(*db_->vals));
+        const u64 keys_offset(db_page_roundup(flagsz)), vals_offset(db_page_roundup(keys_offset + keysz));
+        mmsz = vals_offset + valsz;
+        mm = alloc_pages(mmsz, policy);
+        char *base(static_cast<char *>(mm));
+        T *ret(static_cast<T *>(std::malloc(sizeof(T))));
+        if(!ret) throw std::bad_alloc();
+        *ret = *db_;
+        ret->flags = reinterpret_cast<decltype(db_->flags)>(base);
+        ret->keys  = reinterpret_cast<decltype(db_->keys)>(base + keys_offset);
+        ret->vals  = reinterpret_cast<decltype(db_->vals)>(base + vals_offset);
+        // The first write to each page allocates it, so the copy lands where the policy says.
+        parallel_copy(ret->flags, db_->flags, flagsz, policy.nthreads_);
+        parallel_copy(ret->keys,  db_->keys,  keysz,  policy.nthreads_);
+        parallel_copy(ret->vals,  db_->vals,  valsz,  policy.nthreads_);
+        return ret;
+    }
+    // Moves the table into memory from alloc_pages, releasing the file mapping or heap arrays it used before.
+    void place(const PagePolicy &policy) {
+        void *mm;
+        size_t mmsz;
+        T *placed(placed_copy(policy, mm, mmsz));
+        release();
+        db_ = placed, mm_ = mm, mmsz_ = mmsz, owns_hash_ = 1;
+    }
+    // A copy of the table in memory from alloc_pages, for NUMA_REPLICATE.
+    std::unique_ptr<Database> replicate(const PagePolicy &policy) const {
+        void *mm;
+        size_t mmsz;
+        std::unique_ptr<Database> ret(new Database(k_, w_, s_, 1, placed_copy(policy, mm, mmsz)));
+        ret->mm_ = mm, ret->mmsz_ = mmsz;
+        return ret;
+    }
+    // Faults in every page of the table on nthreads threads.
+    void prefault(int nthreads) const {
+        bns::prefault(db_->flags, __ac_fsize(db_->n_buckets) * sizeof(*db_->flags), nthreads);
+        bns::prefault(db_->keys, db_->n_buckets * sizeof(*db_->keys), nthreads);
+        bns::prefault(db_->vals, db_->n_buckets * sizeof(*db_->vals), nthreads);
+    }
+    PageStats page_stats() const {
+        PageStats ret(bns::page_stats(db_->flags, __ac_fsize(db_->n_buckets) * sizeof(*db_->flags)));
+        ret.add(bns::page_stats(db_->keys, db_->n_buckets * sizeof(*db_->keys)));
+        ret.add(bns::page_stats(db_->vals, db_->n_buckets * sizeof(*db_->vals)));
+        return ret;
+    }
+
+    // UNCOMPRESSED writes the mapped layout; ZLIB writes a gzip-compressed stream.
+    void write(const char *fn, int fmt=UNCOMPRESSED) const {
+        if(fmt != UNCOMPRESSED) {
             gzFile ofp = gzopen(fn, "wb");
             if(!ofp) LOG_EXIT("Could not open %s for writing.\n", fn);
 #define gzw(_x, ofp) if(gzwrite(ofp, static_cast<const void *>(&_x), sizeof(_x)) != sizeof(_x)) throw std::runtime_error("Error writing to file")
             gzw(k_, ofp);
             gzw(w_, ofp);
-            gzwrite(ofp, static_cast<const void *>(s_.data()), s_.size() * sizeof(s_[0]));
+            if(gzwrite(ofp, static_cast<const void *>(s_.data()), s_.size() * sizeof(s_[0])) != int(s_.size() * sizeof(s_[0])))
+                throw std::runtime_error("Error writing to file");
             khash_write_impl<T>(db_, ofp);
             gzclose(ofp);
             return;
 #undef gzw
         } // else
+        write_mapped(fn);
+    }
+    void write_mapped(const char *fn) const {
+        if(s_.size() > sizeof(DBHeader::spacing_) / sizeof(DBHeader::spacing_[0]))
+            throw std::runtime_error("Spacing too long for database header.");
+        if(!mm_) // A mapped table was already cleaned before it was written.
+            for(khiter_t ki(0); ki != kh_end(db_); ++ki)
+                if(!kh_exist(db_, ki))
+                    kh_key(db_, ki) = 0, kh_val(db_, ki) = 0;
+        DBHeader hdr;
+        std::memset(&hdr, 0, sizeof(hdr));
+        hdr.magic_       = DB_MAGIC;
+        hdr.version_     = DB_VERSION;
+        hdr.k_           = k_;
+        hdr.w_           = w_;
+        hdr.key_size_    = sizeof(*db_->keys);
+        hdr.val_size_    = sizeof(*db_->vals);
+        hdr.spacing_len_ = s_.size();
+        std::copy(s_.begin(), s_.end(), hdr.spacing_);
+        hdr.n_buckets_   = db_->n_buckets;
+        hdr.size_        = db_->size;
+        hdr.n_occupied_  = db_->n_occupied;
+        hdr.upper_bound_ = db_->upper_bound;
+        const u64 flagsz(__ac_fsize(db_->n_buckets) * sizeof(*db_->flags)),
+                  keysz(db_->n_buckets * sizeof(*db_->keys)),
+                  valsz(db_->n_buckets * sizeof(*db_->vals));
+        hdr.flags_offset_ = DB_PAGE_SIZE;
+        hdr.keys_offset_  = db_page_roundup(hdr.flags_offset_ + flagsz);
+        hdr.vals_offset_  = db_page_roundup(hdr.keys_offset_ + keysz);
+        hdr.file_size_    = hdr.vals_offset_ + valsz;
         std::FILE *ofp(std::fopen(fn, "wb"));
         if(!ofp) LOG_EXIT("Could not open %s for writing.\n", fn);
-        __fw(k_, ofp);
-        __fw(w_, ofp);
-        if(std::fwrite(s_.data(), s_.size(), sizeof(uint8_t), ofp) != s_.size()) throw std::runtime_error("Error writing database");
-        khash_write_impl<T>(db_, ofp);
-        std::fclose(ofp);
+        auto write_at = [ofp](u64 offset, const void *data, size_t nb) {
+            // Pad with zeroes up to offset.
+            static const char zeros[DB_PAGE_SIZE]{0};
+            for(u64 pos(std::ftell(ofp)); pos < offset;) {
+                const size_t npad(std::min(offset - pos, u64(DB_PAGE_SIZE)));
+                if(std::fwrite(zeros, 1, npad, ofp) != npad) throw std::runtime_error("Error writing database");
+                pos += npad;
+            }
+            if(std::fwrite(data, 1, nb, ofp) != nb) throw std::runtime_error("Error writing database");
+        };
+        write_at(0, &hdr, sizeof(hdr));
+        write_at(hdr.flags_offset_, db_->flags, flagsz);
+        write_at(hdr.keys_offset_,  db_->keys,  keysz);
+        write_at(hdr.vals_offset_,  db_->vals,  valsz);
+        if(std::fclose(ofp)) throw std::runtime_error("Error writing database");
     }
 
     template<typename Q=T>
     typename std::enable_if<std::is_same<khash_t(c), Q>::value, u32>::type
-    get_lca(u64 kmer) {
+    get_lca(u64 kmer) const {
         khiter_t ki;
-        return ((ki = kh_get(c, db_, kmer)) == kh_end(db_)) ? kh_val(db_, ki)
-                                                            : -1u;
+        return ((ki = kh_get(c, db_, kmer)) == kh_end(db_)) ? -1u
+                                                            : kh_val(db_, ki);
+    }
+    // Batched, prefetching version of get_lca. Missing k-mers are assigned taxid 0.
+    // idx must hold at least n entries and is used as scratch space for bucket indices.
+    template<typename Q=T>
+    typename std::enable_if<std::is_same<khash_t(c), Q>::value>::type
+    get_lca_batch(const u64 *kmers, size_t n, tax_t *out, khint_t *idx) const {
+        khash_get_batch(db_, kmers, n, idx);
+        for(size_t i(0); i < n; ++i)
+            out[i] = idx[i] == kh_end(db_) ? 0: kh_val(db_, idx[i]);
+    }
+    template<typename Q=T>
+    typename std::enable_if<std::is_same<khash_t(c), Q>::value>::type
+    get_lca_batch(const std::vector<u64> &kmers, std::vector<tax_t> &out) const {
+        std::vector<khint_t> idx(kmers.size());
+        out.resize(kmers.size());
+        get_lca_batch(kmers.data(), kmers.size(), out.data(), idx.data());
     }
 };
 
 } /* bns namespace */
 
 #undef __fr
-#undef __fw
 
 
 #endif /* ifndef _DATABASE_H__ */
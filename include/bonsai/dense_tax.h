@@ -0,0 +1,299 @@
+#pragma once
+#include "util.h"
+
+namespace bns {
+
+// Preprocessed taxonomy answering LCA queries in constant time.
+// Taxids are mapped to dense indices (0 is a virtual node above the root, standing in for taxid 0),
+// the tree is flattened into an Euler tour, and range-minimum queries over tour depths
+// are answered from a sparse table over fixed-size blocks plus scans of at most two partial blocks.
+// Semantics match lca(const khash_t(p) *, tax_t, tax_t):
+// 0 acts as the identity, taxids missing from the taxonomy (or whose ancestry is broken) yield -1,
+// and nodes whose only common ancestor is above the root yield 1.
+class DenseTaxonomy {
+public:
+    static constexpr u32 MISSING = std::numeric_limits<u32>::max();
+private:
+    static constexpr size_t BLOCK_SIZE = 16;
+    static constexpr size_t MAX_DIRECT_TAXID = size_t(1) << 27;
+
+    std::vector<u32>   direct_; // taxid -> dense index if taxids are small enough to index directly.
+    khash_t(p)        *sparse_; // Otherwise, a hash table.
+    std::vector<tax_t> taxids_; // dense index -> taxid
+    std::vector<u32>   parents_;
+    std::vector<u32>   depths_; // Same convention as node_depth: the root has depth 1.
+    std::vector<u32>   first_;  // First occurrence in the Euler tour, MISSING if unreachable from the root.
+    std::vector<u64>   tour_;   // (depth << 32) | dense index
+    std::vector<u64>   table_;  // Sparse table over block minima of tour_
+    size_t             nblocks_;
+
+    void set_index(tax_t taxid, u32 idx) {
+        if(sparse_ == nullptr) {direct_[taxid] = idx; return;}
+        int khr;
+        khint_t ki(kh_put(p, sparse_, taxid, &khr));
+        kh_val(sparse_, ki) = idx;
+    }
+    static u64 encode(u32 depth, u32 idx) {return (u64(depth) << 32) | idx;}
+    u64 scan(size_t l, size_t r) const {
+        u64 ret(tour_[l]);
+        while(++l <= r) ret = std::min(ret, tour_[l]);
+        return ret;
+    }
+    u64 block_min(size_t l, size_t r) const {
+        const unsigned j(63 - __builtin_clzll(r - l + 1));
+        const u64 *level(table_.data() + j * nblocks_);
+        return std::min(level[l], level[r - (size_t(1) << j) + 1]);
+    }
+    void build_table() {
+        nblocks_ = (tour_.size() + BLOCK_SIZE - 1) / BLOCK_SIZE;
+        const unsigned nlevels(64 - __builtin_clzll(nblocks_));
+        table_.resize(nlevels * nblocks_);
+        for(size_t i(0); i < nblocks_; ++i)
+            table_[i] = scan(i * BLOCK_SIZE, std::min((i + 1) * BLOCK_SIZE, tour_.size()) - 1);
+        for(unsigned j(1); j < nlevels; ++j) {
+            const u64 *prev(table_.data() + (j - 1) * nblocks_);
+            u64 *cur(table_.data() + j * nblocks_);
+            const size_t half(size_t(1) << (j - 1));
+            for(size_t i(0); i + (half << 1) <= nblocks_; ++i)
+                cur[i] = std::min(prev[i], prev[i + half]);
+        }
+    }
+
+public:
+    DenseTaxonomy(const khash_t(p) *map): sparse_(nullptr), nblocks_(0) {
+        if(map == nullptr) RUNTIME_ERROR("null taxonomy.");
+        tax_t maxid(0);
+        for(khiter_t ki(0); ki < kh_end(map); ++ki)
+            if(kh_exist(map, ki)) maxid = std::max(maxid, kh_key(map, ki));
+        const size_t n(kh_size(map) + 1);
+        if(maxid < MAX_DIRECT_TAXID) direct_.assign(size_t(maxid) + 1, MISSING);
+        else sparse_ = kh_init(p), kh_resize(p, sparse_, n);
+        std::vector<tax_t> parent_taxids;
+        taxids_.reserve(n), parent_taxids.reserve(n);
+        taxids_.push_back(0), parent_taxids.push_back(0);
+        for(khiter_t ki(0); ki < kh_end(map); ++ki) {
+            if(!kh_exist(map, ki) || kh_key(map, ki) == 0) continue;
+            set_index(kh_key(map, ki), taxids_.size());
+            taxids_.push_back(kh_key(map, ki));
+            parent_taxids.push_back(kh_val(map, ki));
+        }
+        const size_t nnodes(taxids_.size());
+
+        // Link each node to its parent, leaving self-loops and missing parents detached.
+        parents_.assign(nnodes, MISSING);
+        std::vector<u32> offsets(nnodes + 1), children(nnodes);
+        for(size_t i(1); i < nnodes; ++i) {
+            const tax_t ptax(parent_taxids[i]);
+            if(ptax == taxids_[i]) continue;
+            if((parents_[i] = ptax ? index(ptax): 0) != MISSING) ++offsets[parents_[i] + 1];
+        }
+        for(size_t i(0); i < nnodes; ++i) offsets[i + 1] += offsets[i];
+        {
+            std::vector<u32> cursor(offsets.begin(), offsets.end() - 1);
+            for(size_t i(1); i < nnodes; ++i)
+                if(parents_[i] != MISSING) children[cursor[parents_[i]]++] = i;
+        }
+
+        // Iterative DFS from the virtual root, recording the Euler tour.
+        depths_.assign(nnodes, 0);
+        first_.assign(nnodes, MISSING);
+        tour_.reserve(2 * nnodes);
+        std::vector<std::pair<u32, u32>> stack{{0u, offsets[0]}};
+        first_[0] = 0;
+        tour_.push_back(encode(0, 0));
+        while(stack.size()) {
+            const u32 node(stack.back().first), next(stack.back().second);
+            if(next < offsets[node + 1]) {
+                const u32 child(children[next]);
+                ++stack.back().second;
+                depths_[child] = depths_[node] + 1;
+                first_[child] = tour_.size();
+                tour_.push_back(encode(depths_[child], child));
+                stack.emplace_back(child, offsets[child]);
+            } else {
+                stack.pop_back();
+                if(stack.size()) tour_.push_back(encode(depths_[stack.back().first], stack.back().first));
+            }
+        }
+        size_t nunreachable(0);
+        for(size_t i(1); i < nnodes; ++i)
+            if(first_[i] == MISSING) parents_[i] = MISSING, ++nunreachable;
+        if(nunreachable)
+            LOG_WARNING("%zu taxa in taxonomy of size %zu do not reach the root. LCA queries involving them return -1.\n", nunreachable, nnodes - 1);
+        build_table();
+        LOG_DEBUG("Built dense taxonomy over %zu nodes with Euler tour of length %zu.\n", nnodes - 1, tour_.size());
+    }
+    DenseTaxonomy(const DenseTaxonomy &) = delete;
+    DenseTaxonomy &operator=(const DenseTaxonomy &) = delete;
+    ~DenseTaxonomy() {if(sparse_) kh_destroy(p, sparse_);}
+
+    size_t size() const {return taxids_.size() - 1;}
+    size_t bytes() const {
+        return direct_.size() * sizeof(u32) + (sparse_ ? sparse_->n_buckets * (sizeof(tax_t) * 2 + 1): 0)
+             + taxids_.size() * sizeof(tax_t) + (parents_.size() + depths_.size() + first_.size()) * sizeof(u32)
+             + (tour_.size() + table_.size()) * sizeof(u64);
+    }
+
+    u32 index(tax_t taxid) const {
+        if(sparse_ == nullptr) return taxid < direct_.size() ? direct_[taxid]: MISSING;
+        khint_t ki(kh_get(p, sparse_, taxid));
+        return ki == kh_end(sparse_) ? MISSING: kh_val(sparse_, ki);
+    }
+    tax_t taxid(u32 idx)        const {return taxids_[idx];}
+    u32   parent_index(u32 idx) const {return parents_[idx];}
+    u32   depth_index(u32 idx)  const {return depths_[idx];}
+    bool  reachable(u32 idx)    const {return first_[idx] != MISSING;}
+    // Reachable nodes without children: in the Euler tour, a leaf is followed by its parent.
+    bool  leaf(u32 idx) const {
+        return reachable(idx) && (first_[idx] + 1 == tour_.size() || (tour_[first_[idx] + 1] >> 32) < depths_[idx]);
+    }
+    // Parent taxid, or 0 for the root and for unknown taxa.
+    tax_t parent(tax_t taxid) const {
+        const u32 idx(index(taxid));
+        return idx == MISSING || parents_[idx] == MISSING ? 0: taxids_[parents_[idx]];
+    }
+    // Matches node_depth, except that unknown taxa have depth 0.
+    unsigned depth(tax_t taxid) const {
+        const u32 idx(index(taxid));
+        return idx == MISSING ? 0: depths_[idx];
+    }
+
+    // Both indices must be reachable from the root.
+    u32 lca_index(u32 a, u32 b) const {
+        size_t l(first_[a]), r(first_[b]);
+        if(l > r) std::swap(l, r);
+        const size_t bl(l / BLOCK_SIZE), br(r / BLOCK_SIZE);
+        if(bl == br) return static_cast<u32>(scan(l, r));
+        u64 ret(std::min(scan(l, (bl + 1) * BLOCK_SIZE - 1), scan(br * BLOCK_SIZE, r)));
+        if(bl + 1 < br) ret = std::min(ret, block_min(bl + 1, br - 1));
+        return static_cast<u32>(ret);
+    }
+    tax_t lca(tax_t a, tax_t b) const noexcept {
+        if(a == b || b == 0) return a;
+        if(a == 0) return b;
+        const u32 ia(index(a)), ib(index(b));
+        if(ia == MISSING || ib == MISSING || first_[ia] == MISSING || first_[ib] == MISSING)
+            return static_cast<tax_t>(-1);
+        const u32 ret(lca_index(ia, ib));
+        return ret ? taxids_[ret]: 1;
+    }
+    // out[i] = lca(a[i], b[i])
+    void lca_batch(const tax_t *a, const tax_t *b, size_t n, tax_t *out) const noexcept {
+        static constexpr size_t PREFETCH_DIST = 8;
+        for(size_t i(0); i < n; ++i) {
+            if(i + PREFETCH_DIST < n && sparse_ == nullptr) {
+                const tax_t na(a[i + PREFETCH_DIST]), nb(b[i + PREFETCH_DIST]);
+                if(na < direct_.size()) __builtin_prefetch(direct_.data() + na);
+                if(nb < direct_.size()) __builtin_prefetch(direct_.data() + nb);
+            }
+            out[i] = lca(a[i], b[i]);
+        }
+    }
+    // out[i] = lca(a, b[i])
+    void lca_batch(tax_t a, const tax_t *b, size_t n, tax_t *out) const noexcept {
+        static constexpr size_t PREFETCH_DIST = 8;
+        for(size_t i(0); i < n; ++i) {
+            if(i + PREFETCH_DIST < n && sparse_ == nullptr && b[i + PREFETCH_DIST] < direct_.size())
+                __builtin_prefetch(direct_.data() + b[i + PREFETCH_DIST]);
+            out[i] = lca(a, b[i]);
+        }
+    }
+    // LCA of every taxid in [beg, end).
+    template<typename It>
+    tax_t lca(It beg, It end) const noexcept {
+        if(beg == end) return 0;
+        tax_t ret(*beg);
+        while(++beg != end && ret != static_cast<tax_t>(-1)) ret = lca(ret, *beg);
+        return ret;
+    }
+};
+
+// Per-thread engine for resolve_tree over a DenseTaxonomy.
+// Hit counts live in a score array indexed by dense taxon, and only the entries listed in touched_
+// are reset between reads, so resolving a read does no hashing and, once warm, no allocation.
+// Results match resolve_tree(const linear::counter<tax_t, u16> &, const khash_t(p) *):
+// the hit taxon with the highest-weighted root-to-leaf path wins, and ties resolve to their LCA.
+class TreeResolver {
+    const DenseTaxonomy &tax_;
+    std::vector<u32> counts_;  // Indexed by dense taxon; zero everywhere but touched_.
+    std::vector<u32> touched_;
+    std::vector<u32> ties_;
+    std::vector<std::pair<tax_t, u32>> unknown_; // Hits to taxa absent from the taxonomy.
+public:
+    TreeResolver(const DenseTaxonomy &tax): tax_(tax), counts_(tax.size() + 1) {}
+    void add(tax_t taxid, u32 count=1) {
+        const u32 idx(tax_.index(taxid));
+        if(unlikely(idx == DenseTaxonomy::MISSING)) {
+            for(auto &pair: unknown_) if(pair.first == taxid) {pair.second += count; return;}
+            unknown_.emplace_back(taxid, count);
+            return;
+        }
+        if(counts_[idx] == 0) touched_.push_back(idx);
+        counts_[idx] += count;
+    }
+    void clear() {
+        for(const auto idx: touched_) counts_[idx] = 0;
+        touched_.clear();
+        unknown_.clear();
+    }
+    // True if the hits so far have a unique best-scoring taxon, which is a leaf (or absent from the taxonomy),
+    // and whose score exceeds every other taxon's by more than margin. Then no margin further hits can change
+    // what resolve() returns: the leader's score can only grow, nothing below it can overtake it, and any other
+    // taxon scores at most a touched taxon's score (or 0) plus the new hits.
+    bool settled(u32 margin) const {
+        u32 best(0), second(0), leader(DenseTaxonomy::MISSING);
+        for(const auto idx: touched_) {
+            u32 score(0);
+            for(u32 node(idx); node && node != DenseTaxonomy::MISSING; node = tax_.parent_index(node))
+                score += counts_[node];
+            if(score > best) second = best, best = score, leader = idx;
+            else second = std::max(second, score);
+        }
+        for(const auto &pair: unknown_) {
+            if(pair.second > best) second = best, best = pair.second, leader = DenseTaxonomy::MISSING;
+            else second = std::max(second, pair.second);
+        }
+        return best > second + margin && (leader == DenseTaxonomy::MISSING || tax_.leaf(leader));
+    }
+    // Resolves the hits added since the last call and resets for the next read.
+    tax_t resolve() {
+        u32 max_score(0), best(DenseTaxonomy::MISSING);
+        tax_t best_unknown(0);
+        ties_.clear();
+        for(const auto idx: touched_) {
+            u32 score(0);
+            for(u32 node(idx); node && node != DenseTaxonomy::MISSING; node = tax_.parent_index(node))
+                score += counts_[node];
+            if(score > max_score) {
+                max_score = score, best = idx;
+                ties_.clear();
+            } else if(score == max_score) {
+                if(ties_.empty()) ties_.push_back(best);
+                ties_.push_back(idx);
+            }
+        }
+        bool unknown_tie(false);
+        for(const auto &pair: unknown_) {
+            if(pair.second > max_score) {
+                max_score = pair.second, best = DenseTaxonomy::MISSING, best_unknown = pair.first;
+                ties_.clear(), unknown_tie = false;
+            } else if(pair.second == max_score) unknown_tie = true;
+        }
+        tax_t ret;
+        if(unknown_tie) ret = static_cast<tax_t>(-1);
+        else if(ties_.empty()) ret = best == DenseTaxonomy::MISSING ? best_unknown: tax_.taxid(best);
+        else {
+            u32 cur(ties_[0]);
+            ret = 0;
+            for(size_t i(0); i < ties_.size(); ++i) {
+                if(!tax_.reachable(ties_[i])) {ret = static_cast<tax_t>(-1); break;}
+                cur = tax_.lca_index(cur, ties_[i]);
+            }
+            if(ret == 0) ret = cur ? tax_.taxid(cur): 1;
+        }
+        clear();
+        return ret;
+    }
+};
+
+} // namespace bns
@@ -11,6 +11,7 @@
 #include "sketch/filterhll.h"
 #include "entropy.h"
 #include "kseq_declare.h"
+#include "fastx.h"
 #include "qmap.h"
 #include "spacer.h"
 #include "util.h"
@@ -360,7 +361,24 @@ public:
         if(destroy) kseq_destroy(ks);
     }
     template<typename Functor>
+    void for_each_hash(const Functor &func, FastxReader &reader) {
+        FastxRecord rec;
+        while(reader.next(rec)) for_each_hash<Functor>(func, rec.seq_, rec.l_seq_);
+    }
+    template<typename Functor>
+    void for_each_hash(const Functor &func, const char *path, FastxReader &reader) {
+        InputStream in(path); // Throws file_open_error
+        reader.reset(&in);
+        for_each_hash<Functor>(func, reader);
+        reader.reset(nullptr);
+    }
+    template<typename Functor>
     void for_each_hash(const Functor &func, const char *path, kseq_t *ks=nullptr) {
+        if(ks == nullptr) {
+            FastxReader reader;
+            for_each_hash<Functor>(func, path, reader);
+            return;
+        }
         gzFile fp(gzopen(path, "rb"));
         if(!fp) UNRECOVERABLE_ERROR(ks::sprintf("Could not open file at %s. Abort!\n", path).data());
         gzbuffer(fp, 1<<18);
@@ -452,8 +470,35 @@ public:
         else              for_each_uncanon<Functor>(func, ks);
         if(destroy) kseq_destroy(ks);
     }
+    // Parses records with FastxReader; the kseq_t overloads are kept for callers that manage their own kseq.
+    template<typename Functor>
+    void for_each(const Functor &func, FastxReader &reader) {
+        FastxRecord rec;
+        while(reader.next(rec)) {
+            assign(rec.seq_, rec.l_seq_);
+            if(canonicalize_) {
+                if(sp_.unwindowed()) for_each_canon_unwindowed<Functor>(func);
+                else                 for_each_canon_windowed<Functor>(func);
+            } else if(sp_.unspaced()) {
+                if(sp_.unwindowed()) for_each_uncanon_unspaced_unwindowed(func);
+                else                 for_each_uncanon_unspaced_windowed(func);
+            } else for_each_uncanon_spaced(func);
+        }
+    }
+    template<typename Functor>
+    void for_each(const Functor &func, const char *path, FastxReader &reader) {
+        InputStream in(path); // Throws file_open_error
+        reader.reset(&in);
+        for_each<Functor>(func, reader);
+        reader.reset(nullptr);
+    }
     template<typename Functor>
     void for_each(const Functor &func, const char *path, kseq_t *ks=nullptr) {
+        if(ks == nullptr) {
+            FastxReader reader;
+            for_each<Functor>(func, path, reader);
+            return;
+        }
         gzFile fp(gzopen(path, "rb"));
         if(!fp) UNRECOVERABLE_ERROR(ks::sprintf("Could not open file at %s. Abort!\n", path).data());
         gzbuffer(fp, 1<<18);
@@ -733,7 +778,24 @@ public:
         else       for_each_uncanon<Functor>(func, fp, ks);
     }
     template<typename Functor>
+    void for_each_hash(const Functor &func, FastxReader &reader) {
+        FastxRecord rec;
+        while(reader.next(rec)) for_each_hash<Functor>(func, rec.seq_, rec.l_seq_);
+    }
+    template<typename Functor>
+    void for_each_hash(const Functor &func, const char *inpath, FastxReader &reader) {
+        InputStream in(inpath);
+        reader.reset(&in);
+        for_each_hash<Functor>(func, reader);
+        reader.reset(nullptr);
+    }
+    template<typename Functor>
     void for_each_hash(const Functor &func, const char *inpath, kseq_t *ks=nullptr) {
+        if(ks == nullptr) {
+            FastxReader reader;
+            for_each_hash<Functor>(func, inpath, reader);
+            return;
+        }
         gzFile fp = gzopen(inpath, "rb");
         if(!fp) throw file_open_error(inpath);
         gzbuffer(fp, 1<<18);
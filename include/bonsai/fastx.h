@@ -0,0 +1,275 @@
+#pragma once
+#include <atomic>
+#include <memory>
+#if __SSE2__ || __AVX2__
+#  include <immintrin.h>
+#endif
+#include "input.h"
+#include "kseq_declare.h"
+#include "util.h"
+
+namespace bns {
+
+/*
+ * Block-based FASTA/FASTQ parser.
+ * kseq reads its input a byte at a time and copies each record's name, comment, sequence and qualities
+ * into buffers of their own, which bseq_read then copies again into a malloc'd bseq1_t.
+ * FastxReader instead decompresses the input in large blocks, finds line ends with vector compares
+ * and parses records in place: a record's fields are NUL-terminated views into its block, and nothing
+ * is allocated or copied per record. Multi-line sequences and qualities are joined in place.
+ *
+ * Views stay valid until the following call to next(). A reader that retains blocks keeps them instead,
+ * until take_blocks() hands them to the caller, so that a whole batch of records can outlive the reader's
+ * position in the input. Blocks come back to the reader for reuse once the caller drops them, so
+ * reading allocates nothing once as many blocks as are in flight at once have been allocated.
+ */
+struct FastxRecord {
+    char *name_, *comment_, *seq_, *qual_; // comment_ and qual_ are null if absent.
+    u32   l_name_, l_seq_;
+    // Drops a trailing "/1" or "/2" from the name, as bseq_read does.
+    void trim_readno() {
+        if(l_name_ > 2 && name_[l_name_ - 2] == '/' && std::isdigit(static_cast<unsigned char>(name_[l_name_ - 1])))
+            name_[l_name_ -= 2] = '\0';
+    }
+};
+
+struct FastxBlock {
+    std::unique_ptr<char[]> data_;
+    size_t                  capacity_;
+    FastxBlock(size_t capacity): data_(new char[capacity]), capacity_(capacity) {}
+};
+using FastxBlockPtr = std::shared_ptr<FastxBlock>;
+
+// Returns the first occurrence of c (or of c2) in [p, end), or end.
+INLINE const char *find_byte(const char *p, const char *end, char c, char c2) {
+#if __AVX2__
+    const __m256i v(_mm256_set1_epi8(c)), v2(_mm256_set1_epi8(c2));
+    for(; p + 32 <= end; p += 32) {
+        const __m256i x(_mm256_loadu_si256(reinterpret_cast<const __m256i *>(p)));
+        if(const unsigned mask = _mm256_movemask_epi8(_mm256_or_si256(_mm256_cmpeq_epi8(x, v), _mm256_cmpeq_epi8(x, v2))))
+            return p + __builtin_ctz(mask);
+    }
+#elif __SSE2__
+    const __m128i v(_mm_set1_epi8(c)), v2(_mm_set1_epi8(c2));
+    for(; p + 16 <= end; p += 16) {
+        const __m128i x(_mm_loadu_si128(reinterpret_cast<const __m128i *>(p)));
+        if(const unsigned mask = _mm_movemask_epi8(_mm_or_si128(_mm_cmpeq_epi8(x, v), _mm_cmpeq_epi8(x, v2))))
+            return p + __builtin_ctz(mask);
+    }
+#endif
+    for(; p < end && *p != c && *p != c2; ++p);
+    return p;
+}
+INLINE const char *find_byte(const char *p, const char *end, char c) {return find_byte(p, end, c, c);}
+
+class FastxReader {
+public:
+    static constexpr size_t BLOCK_SIZE = 1ull << 22;
+private:
+    InputStream               *in_;
+    size_t                     block_size_;
+    FastxBlockPtr              cur_;
+    size_t                     pos_, end_;   // Unparsed bytes of cur_
+    bool                       eof_, retain_;
+    bool                       cur_used_;    // Records were returned from cur_ since the last take_blocks()
+    std::vector<FastxBlockPtr> held_;        // Earlier blocks with records not yet taken
+    std::vector<FastxBlockPtr> pool_;        // Every block retained so far, free for reuse when we hold its only reference
+
+    FastxBlockPtr new_block(size_t capacity) {
+        for(auto &block: pool_) {
+            if(block.use_count() != 1) continue;
+            std::atomic_thread_fence(std::memory_order_acquire); // Pairs with the release of the last other reference.
+            if(block->capacity_ < capacity) block = std::make_shared<FastxBlock>(capacity);
+            return block;
+        }
+        FastxBlockPtr ret(std::make_shared<FastxBlock>(capacity));
+        if(retain_) pool_.push_back(ret);
+        return ret;
+    }
+
+    // Moves the unparsed tail to the start of a block, and fills the rest of it.
+    // Blocks that records were returned from are left alone, and a new one is started.
+    void refill() {
+        const size_t tail(end_ - pos_);
+        const size_t need(std::max(block_size_, tail << 1) + 1); // One spare byte terminates a last line without a newline.
+        if(!cur_ || cur_used_ || cur_.use_count() > 1 + retain_ || cur_->capacity_ < need) {
+            FastxBlockPtr block(new_block(need));
+            if(tail) std::memcpy(block->data_.get(), cur_->data_.get() + pos_, tail);
+            if(cur_used_) held_.push_back(std::move(cur_)), cur_used_ = false;
+            cur_ = std::move(block);
+        } else if(tail) std::memmove(cur_->data_.get(), cur_->data_.get() + pos_, tail);
+        pos_ = 0, end_ = tail;
+        while(end_ + 1 < cur_->capacity_) {
+            const size_t n(in_->read(cur_->data_.get() + end_, cur_->capacity_ - end_ - 1));
+            if(n == 0) {
+                eof_ = true;
+                break;
+            }
+            end_ += n;
+        }
+    }
+    // Returns the end of the line starting at p, or null if it is not in the block yet.
+    // At the end of the input, a last line without a newline ends at end_.
+    char *line_end(char *p) const {
+        char *const end(cur_->data_.get() + end_);
+        char *const ret(const_cast<char *>(find_byte(p, end, '\n')));
+        return ret == end && !eof_ ? nullptr: ret;
+    }
+    // Number of bytes in [p, end) other than line ends.
+    static u32 joined_length(const char *p, const char *end) {
+        u32 ret(0);
+        for(const char *nl; p < end; p = nl + 1) {
+            nl = find_byte(p, end, '\n');
+            ret += nl - p - (nl > p && nl[-1] == '\r');
+        }
+        return ret;
+    }
+    // Joins the lines in [p, end) in place and NUL-terminates them. Returns the joined length.
+    static u32 join(char *p, char *end) {
+        char *const start(p);
+        char *out(p);
+        for(char *nl; p < end; p = nl + 1) {
+            nl = const_cast<char *>(find_byte(p, end, '\n'));
+            const size_t len(nl - p - (nl > p && nl[-1] == '\r'));
+            if(out != p) std::memmove(out, p, len);
+            out += len;
+        }
+        *out = '\0';
+        return out - start;
+    }
+    // Parses the record at pos_ in place. Returns false if it does not end in the block.
+    bool parse(FastxRecord &rec) {
+        char *const data(cur_->data_.get()), *const end(data + end_);
+        char *const header(data + pos_);
+        char *const hend(line_end(header));
+        if(hend == nullptr) return false;
+        char *const seq(hend + std::min(ptrdiff_t(1), end - hend));
+        char *seq_end, *qual(nullptr), *next;
+        if(*header == '>') {
+            // The sequence runs to the next line starting with '>' (or '@', as with kseq).
+            for(const char *p(seq);; p = next + 1) {
+                next = const_cast<char *>(find_byte(p, end, '>', '@'));
+                if(next == end) {
+                    if(!eof_) return false;
+                    break;
+                }
+                if(next[-1] == '\n') break;
+            }
+            seq_end = next;
+        } else {
+            // Sequence lines run to a line starting with '+', followed by as many quality values as bases.
+            for(seq_end = seq; seq_end == end || *seq_end != '+'; seq_end = next + 1)
+                if(seq_end == end || (next = line_end(seq_end)) == end || next == nullptr) return false;
+            char *const plus_end(line_end(seq_end));
+            if(plus_end == nullptr || plus_end == end) return false;
+            qual = plus_end + 1;
+            const u32 l_seq(joined_length(seq, seq_end));
+            u32 l_qual(0);
+            for(next = qual; l_qual < l_seq;) {
+                char *const nl(next < end ? line_end(next): nullptr);
+                if(nl == nullptr) return false;
+                l_qual += nl - next - (nl > next && nl[-1] == '\r');
+                next = nl + (nl < end);
+            }
+        }
+        // The record is complete: split the header and terminate the fields.
+        char *name_end(header + 1), *const hstop(hend - (hend > header + 1 && hend[-1] == '\r'));
+        while(name_end < hstop && *name_end != ' ' && *name_end != '\t') ++name_end;
+        rec.name_    = header + 1;
+        rec.l_name_  = name_end - rec.name_;
+        rec.comment_ = name_end + 1 < hstop ? name_end + 1: nullptr;
+        *name_end = '\0', *hstop = '\0';
+        // Empty fields are not joined in place, as that would overwrite the following line.
+        rec.seq_   = seq < seq_end ? seq: hstop;
+        rec.l_seq_ = seq < seq_end ? join(seq, seq_end): 0;
+        rec.qual_  = qual && qual < next && join(qual, next) ? qual: nullptr;
+        pos_ = next - data;
+        return true;
+    }
+public:
+    FastxReader(InputStream *in=nullptr, bool retain=false, size_t block_size=BLOCK_SIZE):
+        in_(in), block_size_(std::max(block_size, size_t(1) << 12)), pos_(0), end_(0), eof_(in == nullptr), retain_(retain), cur_used_(false) {}
+    // Starts reading from another input, keeping the current block's memory if possible.
+    void reset(InputStream *in) {
+        in_ = in, pos_ = end_ = 0, eof_ = in == nullptr;
+        if(cur_used_) held_.push_back(std::move(cur_)), cur_used_ = false;
+    }
+    bool next(FastxRecord &rec) {
+        for(;;) {
+            // Skip anything before the first header.
+            while(pos_ < end_ && cur_->data_[pos_] != '@' && cur_->data_[pos_] != '>') ++pos_;
+            if(pos_ < end_ && parse(rec)) {
+                if(retain_) cur_used_ = true;
+                return true;
+            }
+            if(eof_) {
+                if(pos_ < end_) LOG_WARNING("Truncated record at the end of the sequence input.\n"), pos_ = end_;
+                return false;
+            }
+            refill();
+        }
+    }
+    // Hands over the blocks holding records returned since the last call.
+    void take_blocks(std::vector<FastxBlockPtr> &blocks) {
+        for(auto &block: held_) blocks.push_back(std::move(block));
+        held_.clear();
+        if(cur_used_) blocks.push_back(cur_), cur_used_ = false;
+    }
+};
+
+// Appends a record as FASTQ, or as FASTA if it has no qualities.
+inline void append_fastx_record(const bseq1_t &bs, ks::string &out) {
+    out.putc_(bs.qual ? '@': '>');
+    out.puts(bs.name);
+    if(bs.comment) out.putc_(' '), out.puts(bs.comment);
+    out.putc_('\n');
+    out.putsn_(bs.seq, bs.l_seq);
+    out.putc_('\n');
+    if(bs.qual) {
+        out.putsn_("+\n", 2);
+        out.putsn_(bs.qual, bs.l_seq);
+        out.putc_('\n');
+    }
+}
+
+/*
+ * As bseq_read, but seqs are views into blocks of retaining readers, which are appended to blocks.
+ * Records are read until at least chunk_size bases have been. If r2 is set, pairs are read from r1 and r2
+ * in lockstep; if r2 == &r1, the input is interleaved. Names of records in seqs are trimmed of read numbers,
+ * and their sam fields are null.
+ */
+inline void fastx_read_batch(FastxReader &r1, FastxReader *r2, u64 chunk_size, std::vector<bseq1_t> &seqs, std::vector<FastxBlockPtr> &blocks) {
+    u64 size(0);
+    FastxRecord rec, mate;
+    auto add = [&](FastxRecord &r) {
+        r.trim_readno();
+        bseq1_t bs;
+        bs.l_seq = r.l_seq_, bs.id = seqs.size(), bs.l_sam = 0;
+        bs.name = r.name_, bs.comment = r.comment_, bs.seq = r.seq_, bs.qual = r.qual_, bs.sam = nullptr;
+        seqs.push_back(bs);
+        size += r.l_seq_;
+    };
+    seqs.clear();
+    while(r1.next(rec)) {
+        if(r2 && r2 != &r1 && !r2->next(mate)) {
+            LOG_WARNING("The 2nd file has fewer sequences.\n");
+            break;
+        }
+        add(rec);
+        if(r2) {
+            if(r2 == &r1 && !r1.next(mate)) {
+                LOG_WARNING("The last read of the interleaved input has no mate; skipping it.\n");
+                size -= seqs.back().l_seq;
+                seqs.pop_back();
+                break;
+            }
+            add(mate);
+        }
+        if(size >= chunk_size && (seqs.size() & 1) == 0) break;
+    }
+    if(size == 0 && r2 && r2 != &r1 && r2->next(mate)) LOG_WARNING("The 1st file has fewer sequences.\n");
+    r1.take_blocks(blocks);
+    if(r2 && r2 != &r1) r2->take_blocks(blocks);
+}
+
+} // namespace bns
@@ -4,6 +4,7 @@
 #include "spacer.h"
 #include "khash64.h"
 #include "util.h"
+#include "dense_tax.h"
 #include "klib/kthread.h"
 #include <set>
 
@@ -29,37 +30,37 @@ inline void lca2depth(khash_t(c) *lca_map, khash_t(p) *tax_map);
 inline khash_t(64) *make_taxdepth_hash(khash_t(c) *kc, const khash_t(p) *tax);
 
 
-inline void update_lca_map(khash_t(c) *kc, const khash_t(all) *set, const khash_t(p) *tax, tax_t taxid);
-inline void update_td_map(khash_t(64) *kc, const khash_t(all) *set, const khash_t(p) *tax, tax_t taxid);
-inline void update_feature_counter(khash_t(64) *kc, const khash_t(all) *set, const khash_t(p) *tax, tax_t taxid);
+inline void update_lca_map(khash_t(c) *kc, const khash_t(all) *set, const DenseTaxonomy &tax, tax_t taxid);
+inline void update_td_map(khash_t(64) *kc, const khash_t(all) *set, const DenseTaxonomy &tax, tax_t taxid);
+inline void update_feature_counter(khash_t(64) *kc, const khash_t(all) *set, const DenseTaxonomy &tax, tax_t taxid);
 inline void update_minimized_map(const khash_t(all) *set, const khash_t(64) *full_map, khash_t(c) *ret);
 
 // Wrap these in structs so that downstream code can be managed as a set, not updated one-by-one.
 struct LcaMap {
     using ReturnType = khash_t(c) *;
     static constexpr size_t ValSize = sizeof(*(ReturnType{0})->vals);
-    static void update(const khash_t(p) *tax, const khash_t(all) *set, const khash_t(64) *, khash_t(c) *r32, khash_t(64) *, tax_t taxid) {
-        update_lca_map(r32, set, tax, taxid);
+    static void update(const DenseTaxonomy *tax, const khash_t(all) *set, const khash_t(64) *, khash_t(c) *r32, khash_t(64) *, tax_t taxid) {
+        update_lca_map(r32, set, *tax, taxid);
     }
 };
 struct TdMap {
     using ReturnType = khash_t(64) *;
     static constexpr size_t ValSize = sizeof(*(ReturnType{0})->vals);
-    static void update(const khash_t(p) *tax, const khash_t(all) *set, const khash_t(64) *, khash_t(c) *, khash_t(64) *r64, tax_t taxid) {
-        update_td_map(r64, set, tax, taxid);
+    static void update(const DenseTaxonomy *tax, const khash_t(all) *set, const khash_t(64) *, khash_t(c) *, khash_t(64) *r64, tax_t taxid) {
+        update_td_map(r64, set, *tax, taxid);
     }
 };
 struct FcMap {
     using ReturnType = khash_t(64) *;
     static constexpr size_t ValSize = sizeof(*(ReturnType{0})->vals);
-    static void update(const khash_t(p) *tax, const khash_t(all) *set, const khash_t(64) *, khash_t(c) *, khash_t(64) *r64, tax_t taxid) {
-        update_feature_counter(r64, set, tax, taxid);
+    static void update(const DenseTaxonomy *tax, const khash_t(all) *set, const khash_t(64) *, khash_t(c) *, khash_t(64) *r64, tax_t taxid) {
+        update_feature_counter(r64, set, *tax, taxid);
     }
 };
 struct MinMap {
     using ReturnType = khash_t(c) *;
     static constexpr size_t ValSize = sizeof(*(ReturnType{0})->vals);
-    static void update(const khash_t(p) *, const khash_t(all) *set, const khash_t(64) *d64, khash_t(c) *r32, khash_t(64) *, tax_t) {
+    static void update(const DenseTaxonomy *, const khash_t(all) *set, const khash_t(64) *d64, khash_t(c) *r32, khash_t(64) *, tax_t) {
         update_minimized_map(set, d64, r32);
     }
 };
@@ -94,6 +95,8 @@ template<typename ScoreType, typename MapUpdater>
 typename MapUpdater::ReturnType
 make_map(const std::vector<std::string> fns, const khash_t(p) *tax_map, const char *seq2tax_path, const Spacer &sp, int num_threads, bool canon, size_t start_size, const khash_t(64) *data) {
     MapUpdater mu;
+    // Preprocess the taxonomy once so that per-k-mer LCA queries are constant-time.
+    std::unique_ptr<DenseTaxonomy> dense_tax(tax_map ? new DenseTaxonomy(tax_map): nullptr);
 
     khash_t(c) *r32 = nullptr;
     khash_t(64) *r64 = nullptr;
@@ -146,7 +149,7 @@ make_map(const std::vector<std::string> fns, const khash_t(p) *tax_map, const ch
             ++submitted, ++completed;
             LOG_DEBUG("Have now submitted %zu element\n", submitted);
             const tax_t taxid(get_taxid(fns[index].data(), name_hash));
-            mu.update(tax_map, counter, data, r32, r64, taxid);
+            mu.update(dense_tax.get(), counter, data, r32, r64, taxid);
         }
     }
 
@@ -154,7 +157,7 @@ make_map(const std::vector<std::string> fns, const khash_t(p) *tax_map, const ch
     for(auto &f: futures) if(f.valid()) {
         const size_t index(f.get());
         const tax_t taxid(get_taxid(fns[index].data(), name_hash));
-        mu.update(tax_map, counters.data() + index, data, r32, r64, taxid);
+        mu.update(dense_tax.get(), counters.data() + index, data, r32, r64, taxid);
         ++completed;
     }
 
@@ -202,32 +205,46 @@ khash_t(64) *taxdepth_map(const std::vector<std::string> &fns, const khash_t(p)
     return make_map<ScoreType, TdMap>(fns, tax_map, seq2tax_path, sp, num_threads, canon, start_size, nullptr);
 }
 
-inline void update_lca_map(khash_t(c) *kc, const khash_t(all) *set, const khash_t(p) *tax, tax_t taxid) {
+inline void update_lca_map(khash_t(c) *kc, const khash_t(all) *set, const DenseTaxonomy &tax, tax_t taxid) {
+    static constexpr size_t LCA_BATCH_SIZE = 1024;
     int khr;
     khint_t k2;
     static int warn_missing = 1;
+    std::vector<u64> shared;
     LOG_DEBUG("Adding set of size %zu to total set of current size %zu.\n", kh_size(set), kh_size(kc));
+    // First insert new keys, collecting those already assigned to another taxon.
+    // Their buckets are only looked up once insertion (and therefore rehashing) is complete.
     for(khiter_t ki(kh_begin(set)); ki < kh_end(set); ++ki) {
         if(kh_exist(set, ki)) {
-            if((k2 = kh_get(c, kc, kh_key(set, ki))) == kh_end(kc)) {
-                k2 = kh_put(c, kc, kh_key(set, ki), &khr);
-                if(unlikely(khr < 0))
-                    RUNTIME_ERROR(ks::sprintf("Could not insert key %" PRIu64 " to table of size %zu.", kh_key(set, ki), kh_size(kc)).data());
+            k2 = kh_put(c, kc, kh_key(set, ki), &khr);
+            if(unlikely(khr < 0))
+                RUNTIME_ERROR(ks::sprintf("Could not insert key %" PRIu64 " to table of size %zu.", kh_key(set, ki), kh_size(kc)).data());
+            if(khr) {
                 kh_val(kc, k2) = taxid;
 #if !NDEBUG
                 if(unlikely(kh_size(kc) % 1000000 == 0)) LOG_DEBUG("Final hash size %zu\n", kh_size(kc));
 #endif
-            } else if(kh_val(kc, k2) != taxid) {
-                kh_val(kc, k2) = lca(tax, taxid, kh_val(kc, k2));
-                if(kh_val(kc, k2) == UINT32_C(1))
-                    if(warn_missing) LOG_WARNING("ancestor of %u missing from taxonomy. This is not unexpected considering the issues the NCBI taxonomy has.\n", taxid), warn_missing = 0;
-            }
+            } else if(kh_val(kc, k2) != taxid) shared.push_back(kh_key(set, ki));
+        }
+    }
+    // Then resolve LCAs in batches.
+    khint_t buckets[LCA_BATCH_SIZE];
+    tax_t olds[LCA_BATCH_SIZE], news[LCA_BATCH_SIZE];
+    for(size_t i(0); i < shared.size(); i += LCA_BATCH_SIZE) {
+        const size_t n(std::min(LCA_BATCH_SIZE, shared.size() - i));
+        khash_get_batch(kc, shared.data() + i, n, buckets);
+        for(size_t j(0); j < n; ++j) olds[j] = kh_val(kc, buckets[j]);
+        tax.lca_batch(taxid, olds, n, news);
+        for(size_t j(0); j < n; ++j) {
+            kh_val(kc, buckets[j]) = news[j];
+            if(news[j] == UINT32_C(1))
+                if(warn_missing) LOG_WARNING("ancestor of %u missing from taxonomy. This is not unexpected considering the issues the NCBI taxonomy has.\n", taxid), warn_missing = 0;
         }
     }
     LOG_DEBUG("After updating with set of size %zu, total set current size is %zu.\n", kh_size(set), kh_size(kc));
 }
 
-inline void update_td_map(khash_t(64) *kc, const khash_t(all) *set, const khash_t(p) *tax, tax_t taxid) {
+inline void update_td_map(khash_t(64) *kc, const khash_t(all) *set, const DenseTaxonomy &tax, tax_t taxid) {
     int khr;
     khint_t k2;
     tax_t val;
@@ -238,17 +255,17 @@ inline void update_td_map(khash_t(64) *kc, const khash_t(all) *set, const khash_
                 k2 = kh_put(64, kc, kh_key(set, ki), &khr);
                 if(unlikely(khr < 0))
                     RUNTIME_ERROR(ks::sprintf("Could not insert key %" PRIu64 " to table of size %zu.", kh_key(set, ki), kh_size(kc)).data());
-                kh_val(kc, k2) = TDencode(node_depth(tax, kh_val(kc, ki)), kh_val(kc, ki));
+                kh_val(kc, k2) = TDencode(tax.depth(kh_val(kc, ki)), kh_val(kc, ki));
                 if(unlikely(kh_size(kc) % 1000000 == 0)) LOG_INFO("Final hash size %zu\n", kh_size(kc));
             } else if(kh_val(kc, k2) != taxid) {
-                do val = lca(tax, taxid, kh_val(kc, k2));
-                while(!kh_try_set(64, kc, k2, val == (tax_t)-1 ? 1: TDencode(node_depth(tax, val), val)));
+                do val = tax.lca(taxid, kh_val(kc, k2));
+                while(!kh_try_set(64, kc, k2, val == (tax_t)-1 ? 1: TDencode(tax.depth(val), val)));
             }
         }
     }
     LOG_DEBUG("After updating with set of size %zu, total set current size is %zu.\n", kh_size(set), kh_size(kc));
 }
-inline void update_feature_counter(khash_t(64) *kc, const khash_t(all) *set, const khash_t(p) *tax, const tax_t taxid) {
+inline void update_feature_counter(khash_t(64) *kc, const khash_t(all) *set, const DenseTaxonomy &tax, const tax_t taxid) {
     // TODO: make this threadsafe.
     int khr;
     khint_t k2;
@@ -258,8 +275,8 @@ inline void update_feature_counter(khash_t(64) *kc, const khash_t(all) *set, con
                 k2 = kh_put(64, kc, kh_key(set, ki), &khr);
                 if(unlikely(khr < 0))
                     RUNTIME_ERROR(ks::sprintf("Could not insert key %" PRIu64 " to table of size %zu.", kh_key(set, ki), kh_size(kc)).data());
-                kh_val(kc, k2) = FMencode(1, node_depth(tax, taxid));
-            } else while(!kh_try_set(64, kc, k2, FMencode(FMcount(kh_val(kc, k2)), lca(tax, taxid, kh_val(kc, k2)))));
+                kh_val(kc, k2) = FMencode(1, tax.depth(taxid));
+            } else while(!kh_try_set(64, kc, k2, FMencode(FMcount(kh_val(kc, k2)), tax.lca(taxid, kh_val(kc, k2)))));
         }
     }
 }
@@ -121,6 +121,33 @@ INLINE constexpr uint64_t rrot(uint64_t x) {
     return (x >> n) | (x << (64 - n));
 }
 
+// Streaming 128-bit hash of byte strings, used to recognize byte-identical reads.
+// Two independent multiply-rotate lanes over 8-byte words, each finalized with wang_hash.
+// Not cryptographic, but collisions between distinct reads are vanishingly unlikely.
+class Hash128 {
+    u64 h1_, h2_;
+public:
+    Hash128(u64 seed=0): h1_(seed ^ UINT64_C(0x9E3779B97F4A7C15)), h2_(~seed ^ UINT64_C(0xC2B2AE3D27D4EB4F)) {}
+    void update(const void *data, size_t len) {
+        const u8 *p(static_cast<const u8 *>(data));
+        h1_ ^= len * UINT64_C(0x87C37B91114253D5), h2_ ^= len * UINT64_C(0x4CF5AD432745937F);
+        u64 v;
+        for(; len >= 8; p += 8, len -= 8) {
+            std::memcpy(&v, p, 8);
+            h1_ = lrot<31>(h1_ ^ (v * UINT64_C(0x87C37B91114253D5))) * UINT64_C(0x9E3779B97F4A7C15);
+            h2_ = lrot<29>(h2_ ^ (v * UINT64_C(0x4CF5AD432745937F))) * UINT64_C(0xC2B2AE3D27D4EB4F);
+        }
+        if(len) {
+            v = 0;
+            std::memcpy(&v, p, len);
+            h1_ = lrot<31>(h1_ ^ (v * UINT64_C(0x87C37B91114253D5))) * UINT64_C(0x9E3779B97F4A7C15);
+            h2_ = lrot<29>(h2_ ^ (v * UINT64_C(0x4CF5AD432745937F))) * UINT64_C(0xC2B2AE3D27D4EB4F);
+        }
+    }
+    u64 lo() const {return wang_hash(h1_ ^ lrot<17>(h2_));}
+    u64 hi() const {return wang_hash(h2_ ^ lrot<43>(h1_));}
+};
+
 // rotate 31-left bits of "v" to the left by "s" positions
 // Precondition: s must be less than lbits
 template<unsigned lbits>
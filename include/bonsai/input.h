@@ -0,0 +1,387 @@
+#pragma once
+#include <cerrno>
+#include <condition_variable>
+#include <deque>
+#include <fcntl.h>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <unistd.h>
+#include "kseq_declare.h"
+#include "util.h"
+#if ZWRAP_USE_ZSTD
+#  define ZSTD_STATIC_LINKING_ONLY
+#  include "zstd.h"
+#endif
+
+namespace bns {
+
+/*
+ * Sequence input, decompressed off the parsing thread.
+ * The format is detected from the first bytes rather than the file name:
+ *  - BGZF (blocked gzip, as written by bgzip) and zstd files of several frames (zstd -T, pzstd)
+ *    consist of independently compressed blocks. A producer thread splits the input at block
+ *    boundaries and a pool of workers inflates groups of blocks in parallel, in input order.
+ *  - Plain gzip and single-frame zstd can only be inflated serially; the producer thread does so,
+ *    so that decompression still overlaps parsing.
+ *  - Anything else is passed through unchanged.
+ * zstd needs a zstd-enabled build (ZWRAP_USE_ZSTD).
+ */
+class InputStream {
+public:
+    enum Format: int {RAW, GZIP, BGZF, ZSTD};
+    static constexpr size_t CHUNK_BYTES = 1ull << 20; // Compressed bytes per unit of parallel work
+    static constexpr size_t OUT_BYTES   = 1ull << 22; // Decompressed bytes per chunk from serial formats
+    static constexpr size_t MAX_FRAME   = 1ull << 26; // Larger zstd frames are decompressed serially.
+private:
+    struct Buffer {
+        std::unique_ptr<char[]> data_;
+        size_t                  size_ = 0, capacity_ = 0;
+        void reserve(size_t n) {
+            if(n <= capacity_) return;
+            std::unique_ptr<char[]> tmp(new char[n]);
+            if(size_) std::memcpy(tmp.get(), data_.get(), size_);
+            data_ = std::move(tmp), capacity_ = n;
+        }
+        void append(const char *p, size_t n) {
+            if(size_ + n > capacity_) reserve(std::max(size_ + n, capacity_ << 1));
+            std::memcpy(data_.get() + size_, p, n);
+            size_ += n;
+        }
+    };
+    struct Chunk {
+        Buffer           in_, out_;
+        std::vector<u32> blocks_; // Compressed size of each block (or frame) in in_
+        bool             done_ = false;
+    };
+    using ChunkPtr = std::shared_ptr<Chunk>;
+
+    int                      fd_;
+    Format                   format_;
+    std::string              path_;
+    Buffer                   pending_;  // Input read but not yet handed out
+    size_t                   start_;    // Start of unconsumed input in pending_
+    bool                     input_eof_;
+    std::mutex               m_;
+    std::condition_variable  cv_;
+    std::deque<ChunkPtr>     order_;    // Chunks in input order, for read()
+    std::deque<ChunkPtr>     todo_;     // Chunks no worker has claimed yet
+    size_t                   max_chunks_;
+    bool                     finished_, stop_;
+    std::string              error_;
+    std::thread              producer_;
+    std::vector<std::thread> workers_;
+    ChunkPtr                 cur_;
+    size_t                   cur_pos_;
+
+    size_t available() const {return pending_.size_ - start_;}
+    const unsigned char *peek() const {return reinterpret_cast<const unsigned char *>(pending_.data_.get() + start_);}
+    // Reads until at least n bytes are available or the input ends. Returns false in the latter case.
+    bool fill(size_t n) {
+        while(available() < n && !input_eof_) {
+            if(start_ && start_ == pending_.size_) start_ = pending_.size_ = 0;
+            else if(start_ > (pending_.capacity_ >> 1)) {
+                std::memmove(pending_.data_.get(), pending_.data_.get() + start_, available());
+                pending_.size_ -= start_, start_ = 0;
+            }
+            pending_.reserve(std::max(pending_.size_ + std::max(n - available(), CHUNK_BYTES), pending_.capacity_));
+            const ssize_t rc(::read(fd_, pending_.data_.get() + pending_.size_, pending_.capacity_ - pending_.size_));
+            if(rc < 0) {
+                if(errno == EINTR) continue;
+                throw std::runtime_error(path_ + ": " + std::strerror(errno));
+            }
+            if(rc == 0) input_eof_ = true;
+            pending_.size_ += rc;
+        }
+        return available() >= n;
+    }
+    static u16 le16(const unsigned char *p) {return p[0] | (p[1] << 8);}
+    static u32 le32(const unsigned char *p) {return u32(le16(p)) | (u32(le16(p + 2)) << 16);}
+    static bool is_zstd(const unsigned char *p) {
+        const u32 magic(le32(p));
+        return magic == 0xFD2FB528u || (magic & 0xFFFFFFF0u) == 0x184D2A50u; // Frame or skippable frame
+    }
+    // Size of the BGZF block at p, 0 if p is not one, or -1 if more input is needed to tell.
+    long bgzf_block_size(const unsigned char *p, size_t n) const {
+        if(n < 12) return -1;
+        if(p[0] != 0x1f || p[1] != 0x8b || p[2] != 8 || !(p[3] & 4)) return 0;
+        const size_t xlen(le16(p + 10));
+        if(n < 12 + xlen) return -1;
+        for(size_t i(12); i + 4 <= 12 + xlen; i += 4 + le16(p + i + 2))
+            if(p[i] == 'B' && p[i + 1] == 'C' && le16(p + i + 2) == 2) return long(le16(p + i + 4)) + 1;
+        return 0;
+    }
+    Format detect() {
+        fill(18);
+        if(available() >= 4 && is_zstd(peek())) return ZSTD;
+        if(available() >= 2 && peek()[0] == 0x1f && peek()[1] == 0x8b) {
+            fill(1 << 16);
+            return bgzf_block_size(peek(), available()) > 0 ? BGZF: GZIP;
+        }
+        return RAW;
+    }
+
+    // Producer side.
+    bool push(ChunkPtr chunk, bool parallel) {
+        std::unique_lock<std::mutex> lock(m_);
+        cv_.wait(lock, [&]() {return order_.size() < max_chunks_ || stop_;});
+        if(stop_) return false;
+        order_.push_back(chunk);
+        if(parallel) todo_.push_back(chunk);
+        cv_.notify_all();
+        return true;
+    }
+    void produce() {
+        try {
+            switch(format_) {
+                case RAW:  produce_raw();  break;
+                case GZIP: produce_gzip(); break;
+                case BGZF: produce_blocks(); break;
+                case ZSTD: produce_blocks(); break;
+            }
+        } catch(const std::exception &ex) {
+            std::lock_guard<std::mutex> lock(m_);
+            error_ = ex.what();
+        }
+        std::lock_guard<std::mutex> lock(m_);
+        finished_ = true;
+        cv_.notify_all();
+    }
+    void produce_raw() {
+        while(fill(1) || available()) {
+            ChunkPtr chunk(std::make_shared<Chunk>());
+            chunk->out_.append(pending_.data_.get() + start_, available());
+            start_ = pending_.size_;
+            chunk->done_ = true;
+            if(!push(chunk, false)) return;
+            fill(OUT_BYTES);
+        }
+    }
+    void produce_gzip() {
+        z_stream strm;
+        std::memset(&strm, 0, sizeof(strm));
+        if(inflateInit2(&strm, 15 + 16) != Z_OK) throw std::runtime_error("inflateInit2 failed");
+        std::unique_ptr<z_stream, int (*)(z_stream *)> guard(&strm, inflateEnd);
+        ChunkPtr chunk;
+        bool member_done(false);
+        for(;;) {
+            if(!available() && !fill(1)) break;
+            if(member_done) {
+                // Concatenated gzip members continue the stream; trailing garbage is ignored, as gzread does.
+                if(!fill(2) || peek()[0] != 0x1f || peek()[1] != 0x8b) break;
+                inflateReset(&strm);
+                member_done = false;
+            }
+            if(!chunk) chunk = std::make_shared<Chunk>(), chunk->out_.reserve(OUT_BYTES);
+            strm.next_in   = const_cast<Bytef *>(peek());
+            strm.avail_in  = std::min(available(), size_t(1) << 30);
+            strm.next_out  = reinterpret_cast<Bytef *>(chunk->out_.data_.get() + chunk->out_.size_);
+            strm.avail_out = chunk->out_.capacity_ - chunk->out_.size_;
+            const int rc(inflate(&strm, Z_NO_FLUSH));
+            start_ += reinterpret_cast<const unsigned char *>(strm.next_in) - peek();
+            chunk->out_.size_ = chunk->out_.capacity_ - strm.avail_out;
+            if(rc == Z_STREAM_END) member_done = true;
+            else if(rc != Z_OK && rc != Z_BUF_ERROR) throw std::runtime_error(path_ + ": corrupt gzip data");
+            else if(rc == Z_BUF_ERROR && strm.avail_out && !fill(available() + 1)) throw std::runtime_error(path_ + ": truncated gzip data");
+            if(chunk->out_.size_ == chunk->out_.capacity_) {
+                chunk->done_ = true;
+                if(!push(std::move(chunk), false)) return;
+                chunk.reset();
+            }
+        }
+        if(chunk) chunk->done_ = true, push(std::move(chunk), false);
+        if(!member_done) throw std::runtime_error(path_ + ": truncated gzip data");
+    }
+    // Splits BGZF blocks or zstd frames into chunks of about CHUNK_BYTES for the workers.
+    void produce_blocks() {
+        ChunkPtr chunk;
+        for(;;) {
+            if(!fill(18) && !available()) break;
+            size_t size(0);
+            if(format_ == BGZF) {
+                const long bs(bgzf_block_size(peek(), available()));
+                if(bs <= 0) throw std::runtime_error(path_ + ": malformed BGZF block");
+                size = bs;
+                if(!fill(size)) throw std::runtime_error(path_ + ": truncated BGZF block");
+            } else {
+#if ZWRAP_USE_ZSTD
+                for(;;) {
+                    const size_t rc(ZSTD_findFrameCompressedSize(peek(), available()));
+                    if(!ZSTD_isError(rc)) {size = rc; break;}
+                    if(available() >= MAX_FRAME) {
+                        // Too large to be worth buffering whole: finish the input serially.
+                        if(chunk) push(std::move(chunk), true);
+                        produce_zstd_stream();
+                        return;
+                    }
+                    if(!fill(available() + 1)) throw std::runtime_error(path_ + ": truncated zstd frame");
+                }
+#endif
+            }
+            if(!chunk) chunk = std::make_shared<Chunk>();
+            chunk->in_.append(pending_.data_.get() + start_, size);
+            chunk->blocks_.push_back(size);
+            start_ += size;
+            if(chunk->in_.size_ >= CHUNK_BYTES) {
+                if(!push(std::move(chunk), true)) return;
+                chunk.reset();
+            }
+        }
+        if(chunk) push(std::move(chunk), true);
+    }
+#if ZWRAP_USE_ZSTD
+    void produce_zstd_stream() {
+        std::unique_ptr<ZSTD_DStream, size_t (*)(ZSTD_DStream *)> ds(ZSTD_createDStream(), ZSTD_freeDStream);
+        ZSTD_initDStream(ds.get());
+        ChunkPtr chunk;
+        while(available() || fill(1)) {
+            if(!chunk) chunk = std::make_shared<Chunk>(), chunk->out_.reserve(OUT_BYTES);
+            ZSTD_inBuffer in{peek(), available(), 0};
+            ZSTD_outBuffer out{chunk->out_.data_.get(), chunk->out_.capacity_, chunk->out_.size_};
+            const size_t rc(ZSTD_decompressStream(ds.get(), &out, &in));
+            if(ZSTD_isError(rc)) throw std::runtime_error(path_ + ": " + ZSTD_getErrorName(rc));
+            start_ += in.pos;
+            chunk->out_.size_ = out.pos;
+            if(out.pos == out.size) {
+                chunk->done_ = true;
+                if(!push(std::move(chunk), false)) return;
+                chunk.reset();
+            }
+            if(!available()) fill(1);
+        }
+        if(chunk) chunk->done_ = true, push(std::move(chunk), false);
+    }
+#endif
+
+    // Worker side.
+    void work() {
+        z_stream strm;
+        std::memset(&strm, 0, sizeof(strm));
+        if(inflateInit2(&strm, -15) != Z_OK) LOG_EXIT("inflateInit2 failed.\n");
+#if ZWRAP_USE_ZSTD
+        std::unique_ptr<ZSTD_DCtx, size_t (*)(ZSTD_DCtx *)> dctx(ZSTD_createDCtx(), ZSTD_freeDCtx);
+#endif
+        for(;;) {
+            ChunkPtr chunk;
+            {
+                std::unique_lock<std::mutex> lock(m_);
+                cv_.wait(lock, [&]() {return !todo_.empty() || finished_ || stop_;});
+                if(todo_.empty()) break;
+                chunk = std::move(todo_.front());
+                todo_.pop_front();
+            }
+            std::string error;
+            try {
+                if(format_ == BGZF) inflate_bgzf(*chunk, strm);
+#if ZWRAP_USE_ZSTD
+                else                inflate_zstd(*chunk, dctx.get());
+#endif
+            } catch(const std::exception &ex) {error = ex.what();}
+            chunk->in_ = Buffer();
+            std::lock_guard<std::mutex> lock(m_);
+            if(error.size() && error_.empty()) error_ = error;
+            chunk->done_ = true;
+            cv_.notify_all();
+        }
+        inflateEnd(&strm);
+    }
+    void inflate_bgzf(Chunk &chunk, z_stream &strm) const {
+        const unsigned char *p(reinterpret_cast<const unsigned char *>(chunk.in_.data_.get()));
+        size_t total(0);
+        for(const auto size: chunk.blocks_) total += le32(p + size - 4), p += size; // ISIZE ends each block.
+        chunk.out_.reserve(total + 1);
+        p = reinterpret_cast<const unsigned char *>(chunk.in_.data_.get());
+        for(const auto size: chunk.blocks_) {
+            const size_t header(12 + le16(p + 10)), isize(le32(p + size - 4));
+            char *const out(chunk.out_.data_.get() + chunk.out_.size_);
+            inflateReset(&strm);
+            strm.next_in = const_cast<Bytef *>(p + header), strm.avail_in = size - header - 8;
+            strm.next_out = reinterpret_cast<Bytef *>(out), strm.avail_out = isize + 1;
+            if(inflate(&strm, Z_FINISH) != Z_STREAM_END || strm.avail_out != 1)
+                throw std::runtime_error(path_ + ": corrupt BGZF block");
+            if(crc32(crc32(0, nullptr, 0), reinterpret_cast<const Bytef *>(out), isize) != le32(p + size - 8))
+                throw std::runtime_error(path_ + ": BGZF checksum mismatch");
+            chunk.out_.size_ += isize, p += size;
+        }
+    }
+#if ZWRAP_USE_ZSTD
+    void inflate_zstd(Chunk &chunk, ZSTD_DCtx *dctx) const {
+        const char *p(chunk.in_.data_.get());
+        for(const auto size: chunk.blocks_) {
+            const unsigned long long content(ZSTD_getFrameContentSize(p, size));
+            if(content != ZSTD_CONTENTSIZE_UNKNOWN && content != ZSTD_CONTENTSIZE_ERROR) {
+                chunk.out_.reserve(chunk.out_.size_ + content);
+                const size_t rc(ZSTD_decompressDCtx(dctx, chunk.out_.data_.get() + chunk.out_.size_, content, p, size));
+                if(ZSTD_isError(rc)) throw std::runtime_error(path_ + ": " + ZSTD_getErrorName(rc));
+                chunk.out_.size_ += rc;
+            } else {
+                ZSTD_DCtx_reset(dctx, ZSTD_reset_session_only);
+                ZSTD_inBuffer in{p, size, 0};
+                while(in.pos < in.size) {
+                    chunk.out_.reserve(std::max(chunk.out_.size_ + ZSTD_DStreamOutSize(), chunk.out_.capacity_));
+                    ZSTD_outBuffer out{chunk.out_.data_.get(), chunk.out_.capacity_, chunk.out_.size_};
+                    const size_t rc(ZSTD_decompressStream(dctx, &out, &in));
+                    if(ZSTD_isError(rc)) throw std::runtime_error(path_ + ": " + ZSTD_getErrorName(rc));
+                    chunk.out_.size_ = out.pos;
+                    if(rc == 0) break;
+                }
+            }
+            p += size;
+        }
+    }
+#endif
+
+public:
+    // Opens path, or standard input for "-". nthreads workers inflate BGZF and multi-frame zstd input.
+    // Throws file_open_error if path cannot be opened.
+    InputStream(const char *path, int nthreads=1):
+        fd_(std::strcmp(path, "-") ? ::open(path, O_RDONLY): ::dup(STDIN_FILENO)), path_(path), start_(0), input_eof_(false),
+        finished_(false), stop_(false), cur_pos_(0)
+    {
+        if(fd_ < 0) throw file_open_error(path);
+        format_ = detect();
+#if !ZWRAP_USE_ZSTD
+        if(format_ == ZSTD) ::close(fd_), throw std::runtime_error(path_ + " is zstd-compressed, which needs a build with ZWRAP_USE_ZSTD.");
+#endif
+        nthreads = std::max(nthreads, 1);
+        max_chunks_ = format_ == BGZF || format_ == ZSTD ? 4 * nthreads: 4;
+        producer_ = std::thread(&InputStream::produce, this);
+        if(format_ == BGZF || format_ == ZSTD)
+            while(int(workers_.size()) < nthreads) workers_.emplace_back(&InputStream::work, this);
+    }
+    ~InputStream() {
+        {
+            std::lock_guard<std::mutex> lock(m_);
+            stop_ = true;
+            cv_.notify_all();
+        }
+        producer_.join();
+        for(auto &t: workers_) t.join();
+        ::close(fd_);
+    }
+    InputStream(const InputStream &) = delete;
+    Format format() const {return format_;}
+    // Reads up to n bytes, as gzread. Returns 0 at the end of the input.
+    size_t read(void *buf, size_t n) {
+        size_t ret(0);
+        while(ret < n) {
+            if(!cur_ || cur_pos_ == cur_->out_.size_) {
+                std::unique_lock<std::mutex> lock(m_);
+                cv_.wait(lock, [&]() {return (!order_.empty() && order_.front()->done_) || (order_.empty() && finished_) || error_.size();});
+                if(error_.size()) LOG_EXIT("Could not read input: %s\n", error_.data());
+                if(order_.empty()) break;
+                cur_ = std::move(order_.front());
+                order_.pop_front();
+                cur_pos_ = 0;
+                cv_.notify_all();
+                continue;
+            }
+            const size_t len(std::min(n - ret, cur_->out_.size_ - cur_pos_));
+            std::memcpy(static_cast<char *>(buf) + ret, cur_->out_.data_.get() + cur_pos_, len);
+            cur_pos_ += len, ret += len;
+        }
+        return ret;
+    }
+};
+
+} // namespace bns
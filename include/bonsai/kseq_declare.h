@@ -109,6 +109,11 @@ static inline void trim_readno(kstring_t *s)
         s->l -= 2, s->s[s->l] = 0;
 }
 
+/*
+ * Reads records until at least chunk_size bases have been read.
+ * If ks2_ is set, pairs are read from ks1_ and ks2_ in lockstep. If ks2_ == ks1_,
+ * the input is interleaved: each read is immediately followed by its mate.
+ */
 static bseq1_t *bseq_read(int chunk_size, int *n_, void *ks1_, void *ks2_)
 {
     kseq_t *ks = (kseq_t*)ks1_, *ks2 = (kseq_t*)ks2_;
@@ -116,7 +121,7 @@ static bseq1_t *bseq_read(int chunk_size, int *n_, void *ks1_, void *ks2_)
     m = n = size = 0;
     bseq1_t *seqs = 0;
     while (kseq_read(ks) >= 0) {
-        if (ks2 && kseq_read(ks2) < 0) { // the 2nd file has fewer reads
+        if (ks2 && ks2 != ks && kseq_read(ks2) < 0) { // the 2nd file has fewer reads
             fprintf(stderr, "[W::%s] the 2nd file has fewer sequences.\n", __func__);
             break;
         }
@@ -129,6 +134,12 @@ static bseq1_t *bseq_read(int chunk_size, int *n_, void *ks1_, void *ks2_)
         seqs[n].id = n;
         size += seqs[n++].l_seq;
         if (ks2) {
+            if (ks2 == ks && kseq_read(ks) < 0) { // interleaved input with an odd number of records
+                fprintf(stderr, "[W::%s] the last read of the interleaved input has no mate; skipping it.\n", __func__);
+                size -= seqs[--n].l_seq;
+                bseq_destroy(seqs + n);
+                break;
+            }
             trim_readno(&ks2->name);
             kseq2bseq1(ks2, seqs + n);
             seqs[n].id = n;
@@ -137,7 +148,7 @@ static bseq1_t *bseq_read(int chunk_size, int *n_, void *ks1_, void *ks2_)
         if (size >= chunk_size && (n&1) == 0) break;
     }
     if (size == 0) { // test if the 2nd file is finished
-        if (ks2 && kseq_read(ks2) >= 0)
+        if (ks2 && ks2 != ks && kseq_read(ks2) >= 0)
             fprintf(stderr, "[W::%s] the 1st file has fewer sequences.\n", __func__);
     }
     *n_ = n;
@@ -150,7 +161,7 @@ static bseq1_t *bseq_realloc_read(int chunk_size, int *n_, void *ks1_, void *ks2
     int n = 0, size = 0;
     kseq_t *ks = (kseq_t *)ks1_, *ks2 = (kseq_t *)ks2_;
     while (kseq_read(ks) >= 0) {
-        if (ks2 && kseq_read(ks2) < 0) { // the 2nd file has fewer reads
+        if (ks2 && ks2 != ks && kseq_read(ks2) < 0) { // the 2nd file has fewer reads
             fprintf(stderr, "[W::%s] the 2nd file has fewer sequences.\n", __func__);
             break;
         }
@@ -159,6 +170,11 @@ static bseq1_t *bseq_realloc_read(int chunk_size, int *n_, void *ks1_, void *ks2
         seqs[n].id = n;
         size += seqs[n++].l_seq;
         if (ks2) {
+            if (ks2 == ks && kseq_read(ks) < 0) { // interleaved input with an odd number of records
+                fprintf(stderr, "[W::%s] the last read of the interleaved input has no mate; skipping it.\n", __func__);
+                size -= seqs[--n].l_seq;
+                break;
+            }
             trim_readno(&ks2->name);
             rekseq2bseq1(ks2, seqs + n);
             seqs[n].id = n;
@@ -167,7 +183,7 @@ static bseq1_t *bseq_realloc_read(int chunk_size, int *n_, void *ks1_, void *ks2
         if (size >= chunk_size && (n&1) == 0) break;
     }
     if (size == 0) { // test if the 2nd file is finished
-        if (ks2 && kseq_read(ks2) >= 0)
+        if (ks2 && ks2 != ks && kseq_read(ks2) >= 0)
             fprintf(stderr, "[W::%s] the 1st file has fewer sequences.\n", __func__);
     }
     *n_ = n;
@@ -0,0 +1,90 @@
+#pragma once
+#include <cerrno>
+#include <fstream>
+#include <sched.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#include "util.h"
+
+namespace bns {
+
+/*
+ * NUMA placement without libnuma.
+ * Topology comes from sysfs, memory placement from the mbind system call and
+ * thread placement from sched_setaffinity. Tables are placed by copying them into fresh
+ * anonymous mappings (see alloc_pages in pages.h) whose policy is set before any page is touched.
+ * On machines with a single node (or without NUMA support) everything degrades to plain allocation.
+ */
+enum NumaMode: int {
+    NUMA_NONE       = 0,
+    NUMA_INTERLEAVE = 1, // Spread the database's pages round-robin across all nodes.
+    NUMA_REPLICATE  = 2  // Give each node its own copy of the database.
+};
+
+namespace numa {
+
+// From <numaif.h>, which belongs to libnuma.
+static constexpr int      MPOL_BIND_       = 2;
+static constexpr int      MPOL_INTERLEAVE_ = 3;
+static constexpr unsigned MPOL_MF_MOVE_    = 1u << 1;
+
+// Parses sysfs lists such as "0-3,8-11".
+inline std::vector<int> parse_list(const std::string &str) {
+    std::vector<int> ret;
+    const char *p(str.data());
+    while(*p) {
+        char *end;
+        const long start(std::strtol(p, &end, 10));
+        if(end == p) break;
+        long stop(start);
+        if(*end == '-') stop = std::strtol(end + 1, &end, 10);
+        for(long i(start); i <= stop; ret.push_back(i++));
+        p = *end == ',' ? end + 1: end;
+    }
+    return ret;
+}
+
+inline std::vector<int> read_list(const std::string &path) {
+    std::ifstream is(path);
+    std::string line;
+    return std::getline(is, line) ? parse_list(line): std::vector<int>();
+}
+
+// Online NUMA nodes; {0} if the kernel exposes none.
+inline std::vector<int> nodes() {
+    auto ret(read_list("/sys/devices/system/node/online"));
+    if(ret.empty()) ret.push_back(0);
+    return ret;
+}
+
+inline std::vector<int> node_cpus(int node) {
+    return read_list("/sys/devices/system/node/node" + std::to_string(node) + "/cpulist");
+}
+
+inline long mbind(void *addr, size_t len, int mode, const std::vector<int> &nodes, unsigned flags=0) {
+    int maxnode(0);
+    for(const auto n: nodes) maxnode = std::max(maxnode, n);
+    std::vector<unsigned long> mask(maxnode / (CHAR_BIT * sizeof(unsigned long)) + 1);
+    for(const auto n: nodes) mask[n / (CHAR_BIT * sizeof(unsigned long))] |= 1ul << (n % (CHAR_BIT * sizeof(unsigned long)));
+    return ::syscall(SYS_mbind, addr, len, mode, mask.data(), mask.size() * CHAR_BIT * sizeof(unsigned long) + 1, flags);
+}
+
+// Pins the calling thread to the CPUs of a node. Returns false if that is not possible.
+inline bool pin_thread(int node) {
+    const auto cpus(node_cpus(node));
+    if(cpus.empty()) return false;
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    for(const auto cpu: cpus) if(cpu < CPU_SETSIZE) CPU_SET(cpu, &set);
+    return ::sched_setaffinity(0, sizeof(set), &set) == 0;
+}
+
+// Node classification thread tid of nthreads should run on: threads are split into contiguous groups.
+inline int thread_node(int tid, int nthreads, const std::vector<int> &nodes) {
+    return nodes[size_t(tid) * nodes.size() / std::max(nthreads, 1)];
+}
+
+} // namespace numa
+
+} // namespace bns
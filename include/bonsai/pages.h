@@ -0,0 +1,157 @@
+#pragma once
+#include <atomic>
+#include "klib/kthread.h"
+#include "numa.h"
+
+namespace bns {
+
+/*
+ * Anonymous memory for large read-only tables.
+ * Classification probes the database at random, so with 4 KiB pages nearly every lookup misses the TLB,
+ * and a freshly loaded table takes one page fault per 4 KiB on first touch.
+ * Tables copied into memory from alloc_pages can instead use transparent huge pages (madvise(MADV_HUGEPAGE))
+ * or explicit 2 MiB / 1 GiB pages from the hugetlb pool (MAP_HUGETLB), and are filled by several threads at once.
+ */
+enum HugePages: int {
+    HUGE_PAGES_OFF = 0,
+    HUGE_PAGES_THP = 1, // Transparent huge pages; silently falls back to small pages.
+    HUGE_PAGES_2M  = 2, // Explicit pages from the hugetlb pool; falls back to HUGE_PAGES_THP.
+    HUGE_PAGES_1G  = 3
+};
+
+static constexpr int    NODE_ANY        = -2; // Leave NUMA placement to the kernel.
+static constexpr int    NODE_INTERLEAVE = -1; // Interleave pages across all online nodes.
+static constexpr size_t SMALL_PAGE_SIZE = 1ull << 12;
+static constexpr size_t HUGE_PAGE_SIZE  = 1ull << 21;
+
+// How alloc_pages places memory and how many threads fill it.
+struct PagePolicy {
+    int node_     = NODE_ANY; // NODE_ANY, NODE_INTERLEAVE or a NUMA node
+    int huge_     = HUGE_PAGES_OFF;
+    int nthreads_ = 1;
+};
+
+#ifndef MAP_HUGE_SHIFT
+#  define MAP_HUGE_SHIFT 26
+#endif
+
+// Maps at least bytes of anonymous memory according to policy, rounding bytes up to the size actually mapped.
+// Release with ::munmap(ptr, bytes).
+inline void *alloc_pages(size_t &bytes, const PagePolicy &policy) {
+    void *ret(MAP_FAILED);
+    int huge(policy.huge_);
+    if(huge == HUGE_PAGES_2M || huge == HUGE_PAGES_1G) {
+        const int shift(huge == HUGE_PAGES_1G ? 30: 21);
+        const size_t len((bytes + (size_t(1) << shift) - 1) & ~((size_t(1) << shift) - 1));
+        ret = ::mmap(nullptr, len, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB | (shift << MAP_HUGE_SHIFT), -1, 0);
+        if(ret == MAP_FAILED)
+            LOG_WARNING("Could not map %zu bytes of %s huge pages (%s); is vm.nr_hugepages large enough? Using transparent huge pages.\n",
+                        len, huge == HUGE_PAGES_1G ? "1 GiB": "2 MiB", std::strerror(errno)), huge = HUGE_PAGES_THP;
+        else bytes = len;
+    }
+    if(ret == MAP_FAILED) {
+        if(huge == HUGE_PAGES_THP) {
+            // Transparent huge pages need 2 MiB-aligned addresses, so map a little extra and trim it.
+            const size_t len((bytes + HUGE_PAGE_SIZE - 1) & ~(HUGE_PAGE_SIZE - 1));
+            char *raw(static_cast<char *>(::mmap(nullptr, len + HUGE_PAGE_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0)));
+            if(raw == MAP_FAILED) throw std::bad_alloc();
+            char *aligned(reinterpret_cast<char *>((reinterpret_cast<uintptr_t>(raw) + HUGE_PAGE_SIZE - 1) & ~uintptr_t(HUGE_PAGE_SIZE - 1)));
+            if(aligned != raw) ::munmap(raw, aligned - raw);
+            ::munmap(aligned + len, raw + HUGE_PAGE_SIZE - aligned);
+            if(::madvise(aligned, len, MADV_HUGEPAGE))
+                LOG_WARNING("madvise(MADV_HUGEPAGE) failed: %s\n", std::strerror(errno));
+            ret = aligned, bytes = len;
+        } else {
+            bytes = (bytes + SMALL_PAGE_SIZE - 1) & ~(SMALL_PAGE_SIZE - 1);
+            if((ret = ::mmap(nullptr, bytes, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0)) == MAP_FAILED)
+                throw std::bad_alloc();
+        }
+    }
+    if(policy.node_ != NODE_ANY) {
+        // Placement failures are not fatal: the memory is still usable.
+        const long rc(policy.node_ == NODE_INTERLEAVE ? numa::mbind(ret, bytes, numa::MPOL_INTERLEAVE_, numa::nodes(), numa::MPOL_MF_MOVE_)
+                                                      : numa::mbind(ret, bytes, numa::MPOL_BIND_, std::vector<int>{policy.node_}, numa::MPOL_MF_MOVE_));
+        if(rc) LOG_WARNING("mbind failed (%s); memory placement is left to the kernel.\n", std::strerror(errno));
+    }
+    return ret;
+}
+
+namespace detail {
+struct PageTask {
+    char       *dst_;
+    const char *src_;
+    size_t      bytes_;
+    static constexpr size_t CHUNK = 1ull << 25;
+    std::atomic<u64> sum_;
+};
+inline void page_task(void *data_, long i, int) {
+    PageTask &t(*static_cast<PageTask *>(data_));
+    const size_t start(i * PageTask::CHUNK), end(std::min(start + PageTask::CHUNK, t.bytes_));
+    if(t.dst_) {
+        std::memcpy(t.dst_ + start, t.src_ + start, end - start);
+        return;
+    }
+    u64 sum(0);
+    for(size_t pos(start); pos < end; pos += SMALL_PAGE_SIZE) sum += static_cast<const volatile char *>(t.src_)[pos];
+    t.sum_ += sum;
+}
+} // namespace detail
+
+// memcpy split across nthreads, so that the page faults of a fresh destination are taken in parallel.
+inline void parallel_copy(void *dst, const void *src, size_t bytes, int nthreads) {
+    detail::PageTask t{static_cast<char *>(dst), static_cast<const char *>(src), bytes, {0}};
+    kt_for(std::max(nthreads, 1), &detail::page_task, &t, (bytes + detail::PageTask::CHUNK - 1) / detail::PageTask::CHUNK);
+}
+
+// Reads one byte of every page in [p, p + bytes) on nthreads threads, faulting in file-backed mappings.
+inline void prefault(const void *p, size_t bytes, int nthreads) {
+    detail::PageTask t{nullptr, static_cast<const char *>(p), bytes, {0}};
+    kt_for(std::max(nthreads, 1), &detail::page_task, &t, (bytes + detail::PageTask::CHUNK - 1) / detail::PageTask::CHUNK);
+}
+
+// Page sizes backing a range of memory, from /proc/self/smaps.
+struct PageStats {
+    size_t bytes_      = 0; // Resident bytes in the range
+    size_t huge_bytes_ = 0; // Of which on huge pages
+    size_t huge_size_  = HUGE_PAGE_SIZE;
+    // TLB entries needed to cover the range, and the number it would take with small pages only.
+    size_t tlb_entries() const {return huge_bytes_ / huge_size_ + (bytes_ - huge_bytes_ + SMALL_PAGE_SIZE - 1) / SMALL_PAGE_SIZE;}
+    size_t small_tlb_entries() const {return (bytes_ + SMALL_PAGE_SIZE - 1) / SMALL_PAGE_SIZE;}
+    void add(const PageStats &o) {bytes_ += o.bytes_, huge_bytes_ += o.huge_bytes_, huge_size_ = std::max(huge_size_, o.huge_size_);}
+};
+
+// Mappings only partially inside the range are counted pro rata.
+inline PageStats page_stats(const void *p, size_t bytes) {
+    PageStats ret;
+    std::ifstream is("/proc/self/smaps");
+    const uintptr_t lo(reinterpret_cast<uintptr_t>(p)), hi(lo + bytes);
+    uintptr_t start(0), end(0);
+    std::string line;
+    while(std::getline(is, line)) {
+        unsigned long a, b;
+        size_t kb;
+        if(std::sscanf(line.data(), "%lx-%lx ", &a, &b) == 2) {
+            start = a, end = b;
+            continue;
+        }
+        if(end <= lo || start >= hi) continue;
+        const double frac(double(std::min(end, hi) - std::max(start, lo)) / (end - start));
+        if(std::sscanf(line.data(), "Rss: %zu kB", &kb) == 1)
+            ret.bytes_ += (kb << 10) * frac;
+        else if(std::sscanf(line.data(), "AnonHugePages: %zu kB", &kb) == 1)
+            ret.huge_bytes_ += (kb << 10) * frac;
+        else if(std::sscanf(line.data(), "Private_Hugetlb: %zu kB", &kb) == 1 || std::sscanf(line.data(), "Shared_Hugetlb: %zu kB", &kb) == 1)
+            ret.bytes_ += (kb << 10) * frac, ret.huge_bytes_ += (kb << 10) * frac; // Not included in Rss
+        else if(std::sscanf(line.data(), "KernelPageSize: %zu kB", &kb) == 1 && (kb << 10) > HUGE_PAGE_SIZE)
+            ret.huge_size_ = kb << 10;
+    }
+    return ret;
+}
+
+inline void log_page_stats(const char *what, const PageStats &stats, double seconds) {
+    LOG_INFO("%s ready in %lfs: %zu MiB resident, %0.1f%% on huge pages; %zu TLB entries cover it instead of %zu.\n",
+             what, seconds, stats.bytes_ >> 20, stats.bytes_ ? 100. * stats.huge_bytes_ / stats.bytes_: 0.,
+             stats.tlb_entries(), stats.small_tlb_entries());
+}
+
+} // namespace bns
@@ -0,0 +1,166 @@
+#pragma once
+#include "database.h"
+
+namespace bns {
+
+/*
+ * Blocked Bloom filter over a database's keys, checked before the table itself.
+ * In host-rich samples most minimizers miss the database, and each miss costs a probe into a table
+ * far larger than any cache. The filter is a small fraction of the table's size: a key selects one
+ * 64-byte block (by fastrange on its hash, as the static table picks buckets) and sets nhash_ bits in it,
+ * each the top 9 bits of the hash after another multiplication by an odd constant, so a lookup reads a single
+ * cache line and most misses are answered from it. (Double hashing within the block correlates the bits enough
+ * to double the false-positive rate at 16 bits per key.) Confining a key's bits to a block costs some false positives over a classic Bloom
+ * filter of the same size; expected_fpr accounts for that.
+ *
+ * Filters are built from a database's keys (bonsai build -b, or bonsai prefilter for an existing database)
+ * and written next to it as <database>.bloom, which classify maps and uses unless told not to.
+ * A filter records the number of keys it was built from, and one which does not match its database is ignored.
+ */
+static constexpr u64 BLOOM_MAGIC = 0x31564D4C42534E42ull; // "BNSBLMV1"
+
+struct BloomHeader {
+    u64 magic_;
+    u32 version_, nhash_;
+    u64 nblocks_, nkeys_;
+};
+
+class BlockedBloom {
+    u64     *words_; // nblocks_ blocks of BLOCK_WORDS words
+    u64      nblocks_, nkeys_;
+    unsigned nhash_;
+    void    *mm_;
+    size_t   mmsz_;
+
+    INLINE u64 block(u64 hash) const {return (u128(hash) * nblocks_) >> 64;}
+    // Calls f with each of the nhash_ bits a key with this hash sets in its block.
+    template<typename Functor>
+    INLINE void for_each_bit(u64 hash, const Functor &f) const {
+        static_assert(BLOCK_BITS == 1u << 9, "Bits are indexed by the top 9 bits of a product.");
+        for(unsigned i(0); i < nhash_; ++i) f((hash *= UINT64_C(0x9E3779B97F4A7C15)) >> (64 - 9));
+    }
+    INLINE bool test(const u64 *words, u64 hash) const {
+        bool ret(true);
+        for_each_bit(hash, [&](unsigned bit) {ret &= (words[bit >> 6] >> (bit & 63)) & 1;});
+        return ret;
+    }
+public:
+    static constexpr unsigned BLOCK_BITS  = 512;
+    static constexpr unsigned BLOCK_WORDS = BLOCK_BITS / 64;
+    static constexpr unsigned MAX_HASHES  = 16;
+    static constexpr double   DEFAULT_BITS_PER_KEY = 12.;
+
+    // Expected false-positive rate with bits_per_key bits per key and nhash bits set per key.
+    // Block loads are Poisson-distributed, so this averages the classic rate over the load of the block a query hits.
+    static double expected_fpr(double bits_per_key, unsigned nhash) {
+        const double lambda(BLOCK_BITS / bits_per_key);
+        double ret(0.);
+        for(unsigned load(0); load < lambda + 12. * std::sqrt(lambda) + 32.; ++load) {
+            const double p(std::exp(-lambda + load * std::log(lambda) - std::lgamma(load + 1.)));
+            ret += p * std::pow(1. - std::pow(1. - 1. / BLOCK_BITS, double(nhash) * load), nhash);
+        }
+        return ret;
+    }
+    // Number of bits per key minimizing expected_fpr at bits_per_key.
+    static unsigned best_nhash(double bits_per_key) {
+        unsigned ret(1);
+        for(unsigned nhash(2); nhash <= MAX_HASHES; ++nhash)
+            if(expected_fpr(bits_per_key, nhash) < expected_fpr(bits_per_key, ret)) ret = nhash;
+        return ret;
+    }
+    // Smallest number of bits per key (in steps of 0.5, at most 64) expected to reach fpr.
+    static double bits_for_fpr(double fpr) {
+        double ret(1.);
+        while(ret < 64. && expected_fpr(ret, best_nhash(ret)) > fpr) ret += .5;
+        return ret;
+    }
+
+    // An empty filter for nkeys keys, with bits_per_key bits of memory per key.
+    BlockedBloom(u64 nkeys, double bits_per_key=DEFAULT_BITS_PER_KEY):
+        words_(nullptr), nblocks_(std::max(u64(1), u64(std::ceil(nkeys * bits_per_key / BLOCK_BITS)))), nkeys_(nkeys),
+        nhash_(best_nhash(bits_per_key)), mm_(nullptr), mmsz_(0)
+    {
+        if(posix_memalign(reinterpret_cast<void **>(&words_), DB_PAGE_SIZE, bytes())) throw std::bad_alloc();
+        std::memset(words_, 0, bytes());
+    }
+    // Loads a filter written by write(), mapping it unless load_flags has DB_NO_MMAP.
+    BlockedBloom(const char *path, int load_flags=0);
+    BlockedBloom(const BlockedBloom &) = delete;
+    ~BlockedBloom() {
+        if(mm_) ::munmap(mm_, mmsz_);
+        else    std::free(words_);
+    }
+
+    void add(u64 key) {
+        const u64 hash(__ac_Wang64_hash(key));
+        u64 *const words(words_ + block(hash) * BLOCK_WORDS);
+        for_each_bit(hash, [words](unsigned bit) {words[bit >> 6] |= u64(1) << (bit & 63);});
+    }
+    INLINE bool may_contain(u64 key) const {
+        const u64 hash(__ac_Wang64_hash(key));
+        return test(words_ + block(hash) * BLOCK_WORDS, hash);
+    }
+    // Writes the indices of the keys in keys[0:n] which may be present to idx, and returns their number.
+    // Blocks are prefetched KH_PREFETCH_DIST keys ahead, as in khash_get_batch. scratch must have room for n entries.
+    size_t filter_batch(const u64 *keys, size_t n, u64 *scratch, u32 *idx) const {
+        size_t i, ret(0);
+        for(i = 0; i < n; ++i) scratch[i] = __ac_Wang64_hash(keys[i]);
+        for(i = 0; i < std::min(n, size_t(KH_PREFETCH_DIST)); ++i) __builtin_prefetch(words_ + block(scratch[i]) * BLOCK_WORDS);
+        for(i = 0; i < n; ++i) {
+            if(i + KH_PREFETCH_DIST < n) __builtin_prefetch(words_ + block(scratch[i + KH_PREFETCH_DIST]) * BLOCK_WORDS);
+            if(test(words_ + block(scratch[i]) * BLOCK_WORDS, scratch[i])) idx[ret++] = i;
+        }
+        return ret;
+    }
+
+    u64      nkeys()   const {return nkeys_;}
+    unsigned nhash()   const {return nhash_;}
+    size_t   bytes()   const {return nblocks_ * BLOCK_WORDS * sizeof(u64);}
+    double   bits_per_key() const {return nkeys_ ? double(bytes()) * 8 / nkeys_: 0.;}
+    double   expected_fpr() const {return expected_fpr(bits_per_key(), nhash_);}
+
+    // On disk: a BloomHeader padded to DB_PAGE_SIZE, followed by the blocks.
+    void write(const char *path) const {
+        BloomHeader hdr;
+        std::memset(&hdr, 0, sizeof(hdr));
+        hdr.magic_   = BLOOM_MAGIC;
+        hdr.version_ = DB_VERSION;
+        hdr.nhash_   = nhash_;
+        hdr.nblocks_ = nblocks_;
+        hdr.nkeys_   = nkeys_;
+        std::FILE *ofp(std::fopen(path, "wb"));
+        if(!ofp) LOG_EXIT("Could not open %s for writing.\n", path);
+        std::vector<char> page(DB_PAGE_SIZE);
+        std::memcpy(page.data(), &hdr, sizeof(hdr));
+        if(std::fwrite(page.data(), 1, page.size(), ofp) != page.size()
+           || std::fwrite(words_, 1, bytes(), ofp) != bytes()
+           || std::fclose(ofp))
+            throw std::runtime_error("Error writing Bloom filter");
+    }
+};
+
+inline BlockedBloom::BlockedBloom(const char *path, int load_flags): words_(nullptr), nblocks_(0), nkeys_(0), nhash_(0), mm_(nullptr), mmsz_(0) {
+    const int fd(::open(path, O_RDONLY));
+    if(fd < 0) LOG_EXIT("Could not open %s for reading.\n", path);
+    BloomHeader hdr;
+    if(read_full(fd, &hdr, sizeof(hdr)) != sizeof(hdr) || hdr.magic_ != BLOOM_MAGIC || hdr.version_ != DB_VERSION
+       || hdr.nhash_ == 0 || hdr.nhash_ > MAX_HASHES
+       || hdr.nblocks_ == 0 || hdr.nblocks_ > (std::numeric_limits<u64>::max() - DB_PAGE_SIZE) / (BLOCK_WORDS * sizeof(u64)))
+        LOG_EXIT("%s is not a Bloom prefilter, or has an unsupported version.\n", path);
+    nblocks_ = hdr.nblocks_, nkeys_ = hdr.nkeys_, nhash_ = hdr.nhash_;
+    struct stat st;
+    if(::fstat(fd, &st) || u64(st.st_size) < DB_PAGE_SIZE + bytes()) LOG_EXIT("Bloom prefilter %s is truncated.\n", path);
+    if(load_flags & DB_NO_MMAP) {
+        if(posix_memalign(reinterpret_cast<void **>(&words_), DB_PAGE_SIZE, bytes())) throw std::bad_alloc();
+        if(::lseek(fd, DB_PAGE_SIZE, SEEK_SET) != off_t(DB_PAGE_SIZE) || read_full(fd, words_, bytes()) != ssize_t(bytes()))
+            LOG_EXIT("Could not read Bloom prefilter %s\n", path);
+    } else {
+        mmsz_ = DB_PAGE_SIZE + bytes();
+        if((mm_ = ::mmap(nullptr, mmsz_, PROT_READ, MAP_SHARED | (load_flags & DB_MMAP_POPULATE ? MAP_POPULATE: 0), fd, 0)) == MAP_FAILED)
+            LOG_EXIT("Could not mmap %s: %s\n", path, std::strerror(errno));
+        words_ = reinterpret_cast<u64 *>(static_cast<char *>(mm_) + DB_PAGE_SIZE);
+    }
+    ::close(fd);
+}
+
+} // namespace bns
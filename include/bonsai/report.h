@@ -0,0 +1,191 @@
+#pragma once
+#include <atomic>
+#include <chrono>
+#include <memory>
+#include "dense_tax.h"
+#include "util.h"
+
+namespace bns {
+
+/*
+ * Kraken-style clade reports, aggregated while classifying.
+ * Each classification thread counts its reads by taxon in a TaxonCounts of its own (one per database);
+ * the pipeline sums the threads' counts when it writes a report, so reads need no further processing.
+ * Counts are single-writer atomics: the owning thread increments them without a locked instruction,
+ * and the pipeline can read them while the thread is still classifying.
+ */
+class TaxonCounts {
+    const DenseTaxonomy                *tax_;
+    std::unique_ptr<std::atomic<u64>[]> counts_; // By dense taxon index. 0 is unclassified; the last slot counts taxa absent from the taxonomy.
+    size_t                              n_;
+public:
+    TaxonCounts(const DenseTaxonomy &tax): tax_(&tax), counts_(new std::atomic<u64>[tax.size() + 2]), n_(tax.size() + 2) {
+        for(size_t i(0); i < n_; ++i) counts_[i].store(0, std::memory_order_relaxed);
+    }
+    size_t size() const {return n_;}
+    void add(tax_t taxid) {
+        u32 idx(taxid == 0 ? 0: taxid == tax_t(-1) ? DenseTaxonomy::MISSING: tax_->index(taxid));
+        if(idx == DenseTaxonomy::MISSING) idx = n_ - 1;
+        counts_[idx].store(counts_[idx].load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+    }
+    // Adds these counts to out, which must have size() entries.
+    void add_to(std::vector<u64> &out) const {
+        for(size_t i(0); i < n_; ++i) out[i] += counts_[i].load(std::memory_order_relaxed);
+    }
+};
+
+// Wilson score interval for the proportion x / n, at z standard errors (95% by default), of a sample drawn without
+// replacement as a fraction of its population. The finite-population correction scales the variance by 1 - fraction,
+// so the interval narrows to the point estimate as the sample grows to the whole population.
+inline std::pair<double, double> wilson_interval(u64 x, u64 n, double fraction=0., double z=1.96) {
+    if(n == 0) return {0., 1.};
+    const double p(double(x) / n);
+    if(fraction >= 1.) return {p, p};
+    const double neff(n / (1. - fraction)), z2(z * z / neff),
+                 center((p + z2 / 2.) / (1. + z2)),
+                 half(z / (1. + z2) * std::sqrt(p * (1. - p) / neff + z2 / (4. * neff)));
+    return {std::max(0., center - half), std::min(1., center + half)};
+}
+
+// Writes reports of summed TaxonCounts, with ranks and scientific names from NCBI-style nodes.dmp and names.dmp.
+// Either may lack the column: missing names print as taxids and missing ranks as '-'.
+// When reads were subsampled, each percentage is followed by the bounds of its 95% confidence interval (see wilson_interval).
+class TaxonReport {
+    std::unordered_map<tax_t, std::string> names_, ranks_;
+    std::vector<std::string>               databases_;
+    std::string                            path_; // Rewritten periodically; if empty, fp_ is written once at the end.
+    std::FILE                             *fp_;
+    std::chrono::steady_clock::time_point  last_;
+    double                                 read_fraction_; // Fraction of reads classified, if subsampled, or 1
+
+    // Fields of a .dmp line, which are separated by "\t|\t".
+    static std::vector<std::string> fields(const std::string &line) {
+        std::vector<std::string> ret;
+        for(size_t start(0); start <= line.size();) {
+            size_t end(std::min(line.find('|', start), line.size()));
+            size_t b(start), e(end);
+            while(b < e && std::isspace(static_cast<unsigned char>(line[b]))) ++b;
+            while(e > b && std::isspace(static_cast<unsigned char>(line[e - 1]))) --e;
+            ret.emplace_back(line, b, e - b);
+            start = end + 1;
+        }
+        return ret;
+    }
+    // Kraken's rank codes: a letter for the root and the major ranks, and for others the letter of the closest
+    // major-ranked ancestor followed by the distance to it.
+    static char rank_letter(const std::string &rank) {
+        static const std::pair<const char *, char> letters[] {
+            {"root", 'R'}, {"superkingdom", 'D'}, {"domain", 'D'}, {"kingdom", 'K'}, {"phylum", 'P'},
+            {"class", 'C'}, {"order", 'O'}, {"family", 'F'}, {"genus", 'G'}, {"species", 'S'}
+        };
+        for(const auto &pair: letters) if(rank == pair.first) return pair.second;
+        return 0;
+    }
+    void write_db(ks::string &out, const DenseTaxonomy &tax, const std::vector<u64> &counts) const {
+        const size_t n(tax.size() + 1), unknown(counts.back());
+        std::vector<u64> clade(counts.begin(), counts.begin() + n);
+        u64 total(unknown);
+        for(size_t i(0); i < n; ++i) total += counts[i];
+        std::vector<std::vector<u32>> children(n);
+        for(u32 i(1); i < n; ++i) {
+            if(counts[i] == 0) continue;
+            for(u32 node(tax.parent_index(i)); node && node != DenseTaxonomy::MISSING; node = tax.parent_index(node))
+                clade[node] += counts[i];
+        }
+        for(u32 i(1); i < n; ++i)
+            if(clade[i] && tax.parent_index(i) && tax.parent_index(i) != DenseTaxonomy::MISSING) children[tax.parent_index(i)].push_back(i);
+        auto line = [&](u32 idx, const char *code, unsigned depth) {
+            const tax_t taxid(tax.taxid(idx));
+            out.sprintf("%6.2f\t", total ? 100. * clade[idx] / total: 0.);
+            if(read_fraction_ < 1.) {
+                const auto ci(wilson_interval(clade[idx], total, read_fraction_));
+                out.sprintf("%6.2f\t%6.2f\t", 100. * ci.first, 100. * ci.second);
+            }
+            out.sprintf("%zu\t%zu\t%s\t%u\t", size_t(clade[idx]), size_t(counts[idx]), code, unsigned(taxid));
+            for(unsigned i(0); i < depth; ++i) out.putsn_("  ", 2);
+            const auto it(names_.find(taxid));
+            if(idx == 0)               out.puts("unclassified");
+            else if(it != names_.end()) out.puts(it->second.data());
+            else                       out.putuw_(taxid);
+            out.putc_('\n');
+        };
+        if(clade[0]) line(0, "U", 0);
+        // Depth-first from the roots (nodes attached to the virtual node 0), larger clades first.
+        struct Frame {u32 idx; unsigned depth; char letter; unsigned sub;};
+        std::vector<Frame> stack;
+        for(u32 i(1); i < n; ++i)
+            if(clade[i] && tax.parent_index(i) == 0) stack.push_back(Frame{i, 0, 'R', 0});
+        auto by_clade = [&](u32 a, u32 b) {return clade[a] < clade[b] || (clade[a] == clade[b] && a > b);};
+        std::sort(stack.begin(), stack.end(), [&](const Frame &a, const Frame &b) {return by_clade(a.idx, b.idx);});
+        char code[16];
+        while(stack.size()) {
+            Frame f(stack.back());
+            stack.pop_back();
+            const auto it(ranks_.find(tax.taxid(f.idx)));
+            if(ranks_.empty())                                         std::strcpy(code, "-");
+            else if(char letter = tax.taxid(f.idx) == 1 ? 'R': it == ranks_.end() ? 0: rank_letter(it->second)) f.letter = letter, f.sub = 0, code[0] = letter, code[1] = '\0';
+            else                                                       std::snprintf(code, sizeof(code), "%c%u", f.letter, ++f.sub);
+            line(f.idx, code, f.depth);
+            auto &kids(children[f.idx]);
+            std::sort(kids.begin(), kids.end(), by_clade);
+            for(const auto kid: kids) stack.push_back(Frame{kid, f.depth + 1, f.letter, f.sub});
+        }
+        if(unknown)
+            LOG_WARNING("%zu reads were assigned taxa absent from the taxonomy. They count towards percentages but are not listed.\n", size_t(unknown));
+    }
+
+public:
+    static constexpr int INTERVAL_SECONDS = 60;
+
+    // If path is null, the report is written to fp once, at the end.
+    TaxonReport(const char *nodes_path, const char *names_path, std::vector<std::string> databases, const char *path, std::FILE *fp):
+        databases_(std::move(databases)), path_(path ? path: ""), fp_(fp), last_(std::chrono::steady_clock::now()), read_fraction_(1.)
+    {
+        std::string line;
+        {
+            std::ifstream is(nodes_path);
+            while(std::getline(is, line)) {
+                if(line.empty() || line[0] == '#') continue;
+                const auto f(fields(line));
+                if(f.size() > 2 && f[2].size()) ranks_[std::atoi(f[0].data())] = f[2];
+            }
+        }
+        if(names_path) {
+            std::ifstream is(names_path);
+            if(!is) LOG_EXIT("Could not open names file %s.\n", names_path);
+            while(std::getline(is, line)) {
+                const auto f(fields(line));
+                if(f.size() > 3 && f[3] == "scientific name") names_[std::atoi(f[0].data())] = f[1];
+            }
+        }
+    }
+    // Reports on reads subsampled at fraction (see ClassifierGeneric::set_read_fraction), with confidence intervals.
+    void set_read_fraction(double fraction) {read_fraction_ = fraction;}
+    // True if a periodic report is due.
+    bool due() const {
+        return path_.size() && std::chrono::steady_clock::now() - last_ >= std::chrono::seconds(INTERVAL_SECONDS);
+    }
+    // counts[d] sums database d's TaxonCounts. With several databases, each report is preceded by a line "# <database>".
+    void write(const DenseTaxonomy &tax, const std::vector<std::vector<u64>> &counts) {
+        last_ = std::chrono::steady_clock::now();
+        ks::string out(1u << 16);
+        out.clear();
+        for(size_t d(0); d < counts.size(); ++d) {
+            if(counts.size() > 1) out.sprintf("# %s\n", d < databases_.size() ? databases_[d].data(): std::to_string(d).data());
+            write_db(out, tax, counts[d]);
+        }
+        if(path_.empty()) {
+            if(out.write(fp_) != out.size()) LOG_EXIT("Could not write report.\n");
+            std::fflush(fp_);
+            return;
+        }
+        // Replace the report atomically, so that it can be read while classification goes on.
+        const std::string tmp(path_ + ".tmp");
+        std::FILE *fp(std::fopen(tmp.data(), "w"));
+        if(fp == nullptr) LOG_EXIT("Could not open %s for writing.\n", tmp.data());
+        const bool ok(out.write(fp) == out.size());
+        if(std::fclose(fp) || !ok || std::rename(tmp.data(), path_.data())) LOG_EXIT("Could not write report to %s.\n", path_.data());
+    }
+};
+
+} // namespace bns
@@ -0,0 +1,156 @@
+#pragma once
+#include <thread>
+#include "encoder.h"
+#include "feature_min.h"
+#include "static_table.h"
+
+namespace bns {
+
+/*
+ * Host depletion.
+ * A host set holds the minimizers of a host's genomes in a StaticTaxTable whose values are all 1,
+ * so a probe reads one cache line and compares its keys with SIMD, and batches of probes are prefetched
+ * as in classification. A read (or pair) is host if at least a given fraction of its minimizers are in the set.
+ * Minimizers are probed a block at a time, and probing stops as soon as the outcome is certain either way:
+ * a host read usually settles within its first block, and a read with almost no hits as soon as
+ * the remaining minimizers could no longer reach the threshold.
+ *
+ * A set may keep only the minimizers whose sample_hash falls in the lowest 1 / sample of its range
+ * (StaticTaxTable::sample_), and reads are then screened by the same minimizers only. The fraction
+ * of them found in the set estimates the fraction of all, while the set is sample times smaller
+ * and a read takes sample times fewer probes, which dominate the cost of screening once the set
+ * is larger than the cache.
+ * Host sets record k, window size, spacing, sampling and canonicalization, and reads are screened with the same encoding.
+ */
+
+// Independent of the hash placing keys in a StaticTaxTable, so that sampled keys still fill every bucket.
+INLINE u64 sample_hash(u64 key) {
+    key ^= key >> 31, key *= UINT64_C(0x7fb5d329728ea185);
+    key ^= key >> 27, key *= UINT64_C(0x81dadef4bc2dd44d);
+    return key ^ (key >> 33);
+}
+// Keys with sample_hash below this are kept when sampling one in sample.
+INLINE u64 sample_threshold(u64 sample) {return sample <= 1 ? std::numeric_limits<u64>::max(): std::numeric_limits<u64>::max() / sample;}
+
+// Builds a host set from the minimizers of the genomes in paths, read by nthreads threads,
+// keeping one in sample of them.
+inline std::unique_ptr<StaticTaxTable> build_host_set(const std::vector<std::string> &paths, const Spacer &sp, bool canon, int nthreads, u64 sample=1) {
+    if(nthreads < 1) nthreads = std::thread::hardware_concurrency();
+    nthreads = std::max(1, std::min(nthreads, int(paths.size())));
+    const u64 threshold(sample_threshold(sample));
+    std::vector<khash_t(all) *> sets(nthreads);
+    std::atomic<size_t> next(0);
+    std::vector<std::thread> threads;
+    for(int t(0); t < nthreads; ++t) {
+        sets[t] = kh_init(all);
+        threads.emplace_back([&, t]() {
+            // As fill_set_genome, but sampled keys only are kept, which bounds memory by the final set's size.
+            Encoder<score::Lex> enc(sp, canon);
+            int khr;
+            for(size_t i; (i = next++) < paths.size();) {
+                try {
+                    enc.for_each([&](u64 x) {if(sample <= 1 || sample_hash(x) < threshold) kh_put(all, sets[t], x, &khr);}, paths[i].data());
+                } catch(const file_open_error &) {
+                    LOG_EXIT("Could not open genome %s.\n", paths[i].data());
+                }
+            }
+        });
+    }
+    for(auto &thread: threads) thread.join();
+    for(int t(1); t < nthreads; ++t) kset_union(sets[0], sets[t]), khash_destroy(sets[t]);
+    khash_t(c) *map(kh_init(c));
+    kh_resize(c, map, kh_size(sets[0]));
+    int khr;
+    for(khiter_t ki(0); ki != kh_end(sets[0]); ++ki) {
+        if(!kh_exist(sets[0], ki)) continue;
+        const khiter_t it(kh_put(c, map, kh_key(sets[0], ki), &khr));
+        kh_val(map, it) = 1;
+    }
+    khash_destroy(sets[0]);
+    std::unique_ptr<StaticTaxTable> ret(new StaticTaxTable(map, sp.k_, sp.w_, sp.sub1()));
+    ret->sample_ = std::max(u64(1), sample);
+    ret->canon_  = canon;
+    khash_destroy(map);
+    return ret;
+}
+
+// Per-thread scratch space and statistics for HostScreen.
+struct HostScratch {
+    std::vector<u64>   kmers_, buckets_;
+    std::vector<tax_t> hits_;
+    std::unique_ptr<Encoder<score::Lex>> enc_;
+    u64                screened_, host_, probes_; // Reads (or pairs) screened and found host, and minimizers probed
+    HostScratch(): screened_(0), host_(0), probes_(0) {}
+};
+
+class HostScreen {
+    const StaticTaxTable &set_;
+    const Spacer          sp_;
+    const double          fraction_;
+    const u64             threshold_; // See sample_threshold.
+    const bool            canon_;
+
+    INLINE bool sampled(u64 key) const {return set_.sample_ == 1 || sample_hash(key) < threshold_;}
+    // True if at least fraction_ of keys[0:n], all sampled, are in the set.
+    bool probe(const u64 *keys, size_t n, HostScratch &scratch) const {
+        ++scratch.screened_;
+        if(n == 0) return false;
+        const size_t need(std::max(size_t(1), size_t(std::ceil(fraction_ * n - 1e-9))));
+        scratch.hits_.resize(std::min(n, BLOCK)), scratch.buckets_.resize(std::min(n, BLOCK));
+        size_t nhits(0);
+        for(size_t begin(0); begin < n;) {
+            const size_t end(std::min(begin + BLOCK, n));
+            set_.get_batch(keys + begin, end - begin, scratch.hits_.data(), scratch.buckets_.data());
+            scratch.probes_ += end - begin;
+            for(size_t i(0); i < end - begin; nhits += scratch.hits_[i++] != 0);
+            if(nhits >= need) return ++scratch.host_, true;
+            if(nhits + (n - end) < need) return false;
+            begin = end;
+        }
+        return false;
+    }
+public:
+    static constexpr size_t BLOCK = 64; // Minimizers probed between checks of the outcome
+    static constexpr double DEFAULT_FRACTION = 0.3;
+
+    HostScreen(const StaticTaxTable &set, double fraction=DEFAULT_FRACTION, bool canon=true):
+        set_(set), sp_(set.k_, set.w_, set.s_), fraction_(fraction), threshold_(sample_threshold(set.sample_)), canon_(canon)
+    {
+        if(fraction <= 0. || fraction > 1.) throw std::invalid_argument("host fraction must be in (0, 1]");
+        // Minimizers canonicalized one way would never match those of the other, and no read would be host.
+        if(set.canon_ >= 0 && bool(set.canon_) != canon)
+            LOG_EXIT("The host set was built %s canonicalizing minimizers, but reads are screened %s. Use -C with both or neither.\n",
+                     set.canon_ ? "with": "without", canon ? "with canonical minimizers": "without canonicalizing");
+    }
+    const Spacer &spacer() const {return sp_;}
+    double fraction() const {return fraction_;}
+    // True if reads encoded with sp have the set's minimizers, so they can be screened with them.
+    bool compatible(const Spacer &sp) const {return sp.k_ == sp_.k_ && sp.w_ == sp_.w_ && sp.s_ == sp_.s_;}
+    // Scratch space for a thread, with an encoder for the set's minimizers.
+    std::unique_ptr<HostScratch> make_scratch() const {
+        std::unique_ptr<HostScratch> ret(new HostScratch);
+        ret->enc_.reset(new Encoder<score::Lex>(sp_, canon_));
+        return ret;
+    }
+
+    // True if at least fraction() of the sampled keys in keys[0:n] are in the set. Reads without any are not host.
+    bool is_host(const u64 *keys, size_t n, HostScratch &scratch) const {
+        if(set_.sample_ == 1) return probe(keys, n, scratch);
+        auto &kmers(scratch.kmers_);
+        kmers.clear();
+        for(size_t i(0); i < n; ++i) if(sampled(keys[i])) kmers.push_back(keys[i]);
+        return probe(kmers.data(), kmers.size(), scratch);
+    }
+    // Screens a read (and its mate, if paired) with the set's own encoding.
+    // Consecutive windows sharing a minimizer count once, so with a window longer than k, each of a read's minimizers is probed once.
+    bool is_host(const bseq1_t *bs, int is_paired, HostScratch &scratch) const {
+        auto &kmers(scratch.kmers_);
+        kmers.clear();
+        auto fn = [&](u64 kmer) {if(sampled(kmer) && (kmers.empty() || kmers.back() != kmer)) kmers.push_back(kmer);};
+        scratch.enc_->for_each(fn, bs->seq, bs->l_seq);
+        if(is_paired) scratch.enc_->for_each(fn, (bs + 1)->seq, (bs + 1)->l_seq);
+        return probe(kmers.data(), kmers.size(), scratch);
+    }
+};
+
+} // namespace bns
@@ -0,0 +1,284 @@
+#pragma once
+#include "database.h"
+#if __SSE4_1__ || __AVX2__ || __AVX512F__
+#  include <immintrin.h>
+#endif
+
+namespace bns {
+
+/*
+ * Read-only minimizer -> taxid table for classification.
+ * Each 64-byte bucket holds up to 5 keys, their taxids and a metadata word, so a probe
+ * touches one cache line (khash touches three: flags, keys and vals), and the keys of
+ * a bucket are compared at once with SIMD. This is a bucketized cuckoo table: each key
+ * lives in its primary or its secondary bucket, both chosen by fastrange, so the bucket
+ * count need not be a power of two and the table can be filled to ~90%. Keys are placed
+ * in their primary bucket whenever possible. Each bucket also keeps a 16-bit filter of
+ * the keys which hash to it but had to be placed in their secondary bucket, so most
+ * lookups, including misses, read a single cache line.
+ */
+struct alignas(64) StaticBucket {
+    static constexpr unsigned NSLOTS = 5;
+    u64 keys_[NSLOTS];
+    u32 vals_[NSLOTS];
+    u32 meta_; // Bits 0-2: number of occupied slots. Bits 16-31: filter of keys displaced to their secondary bucket.
+
+    INLINE static u32 overflow_bit(u64 hash) {return 1u << (16 + (hash & 0xfu));}
+    INLINE unsigned count()                 const {return meta_ & 0x7u;}
+    INLINE bool     overflowed(u64 hash)    const {return meta_ & overflow_bit(hash);}
+    // Bitmask of the occupied slots which hold key.
+    INLINE unsigned match(u64 key) const {
+        unsigned ret;
+#if __AVX512F__
+        ret = _mm512_mask_cmpeq_epi64_mask(0x1f, _mm512_load_si512(reinterpret_cast<const void *>(keys_)), _mm512_set1_epi64(key));
+#elif __AVX2__
+        ret = _mm256_movemask_pd(_mm256_castsi256_pd(_mm256_cmpeq_epi64(_mm256_load_si256(reinterpret_cast<const __m256i *>(keys_)), _mm256_set1_epi64x(key))))
+            | (unsigned(keys_[4] == key) << 4);
+#elif __SSE4_1__
+        const __m128i k(_mm_set1_epi64x(key));
+        ret = _mm_movemask_pd(_mm_castsi128_pd(_mm_cmpeq_epi64(_mm_load_si128(reinterpret_cast<const __m128i *>(keys_)), k)))
+            | (_mm_movemask_pd(_mm_castsi128_pd(_mm_cmpeq_epi64(_mm_load_si128(reinterpret_cast<const __m128i *>(keys_ + 2)), k))) << 2)
+            | (unsigned(keys_[4] == key) << 4);
+#else
+        ret = 0;
+        for(unsigned i(0); i < NSLOTS; ++i) ret |= unsigned(keys_[i] == key) << i;
+#endif
+        return ret & ((1u << count()) - 1);
+    }
+};
+static_assert(sizeof(StaticBucket) == 64, "StaticBucket must fill one cache line.");
+
+static constexpr u64 STATIC_DB_MAGIC = 0x3156425453534E42ull; // "BNSSTBV1"
+
+class StaticTaxTable {
+    StaticBucket *buckets_;
+    u64           nbuckets_, size_;
+    void         *mm_;
+    size_t        mmsz_;
+public:
+    unsigned k_, w_;
+    spvec_t  s_;
+    u64      sample_ = 1; // Keys were sampled at one in sample_ (host sets only; see HostScreen)
+    int      canon_ = -1; // Whether keys are canonical (host sets only): 1 or 0, or -1 if unrecorded
+
+    static constexpr double   DEFAULT_LOAD_FACTOR = 0.85;
+    static constexpr unsigned MAX_KICKS           = 1024;
+
+    // Builds from a khash, with the k, w and spacing of the Database holding it.
+    // If cuckoo insertion fails at load_factor, the table is rebuilt with 5% more buckets.
+    StaticTaxTable(const khash_t(c) *map, unsigned k, unsigned w, const spvec_t &s, double load_factor=DEFAULT_LOAD_FACTOR):
+        buckets_(nullptr), nbuckets_(0), size_(0), mm_(nullptr), mmsz_(0), k_(k), w_(w), s_(s)
+    {
+        if(load_factor <= 0. || load_factor > 1.) throw std::invalid_argument("load factor must be in (0, 1]");
+        for(nbuckets_ = std::max(u64(2), u64(std::ceil(kh_size(map) / (load_factor * StaticBucket::NSLOTS))));;
+            nbuckets_ += nbuckets_ / 20 + 1) {
+            std::free(buckets_);
+            if(posix_memalign(reinterpret_cast<void **>(&buckets_), DB_PAGE_SIZE, bytes()))
+                throw std::bad_alloc();
+            std::memset(static_cast<void *>(buckets_), 0, bytes());
+            size_ = 0;
+            RNGType gen(nbuckets_);
+            khiter_t ki;
+            for(ki = 0; ki != kh_end(map); ++ki)
+                if(kh_exist(map, ki) && !insert(kh_key(map, ki), kh_val(map, ki), gen))
+                    break;
+            if(ki == kh_end(map)) break;
+            LOG_INFO("Cuckoo insertion failed with %zu buckets. Growing table.\n", size_t(nbuckets_));
+        }
+    }
+    StaticTaxTable(const char *path, int load_flags=0);
+    StaticTaxTable(const StaticTaxTable &) = delete;
+    // Copy of other in anonymous memory from alloc_pages.
+    StaticTaxTable(const StaticTaxTable &other, const PagePolicy &policy):
+        buckets_(nullptr), nbuckets_(other.nbuckets_), size_(other.size_), mm_(nullptr), mmsz_(other.bytes()),
+        k_(other.k_), w_(other.w_), s_(other.s_), sample_(other.sample_), canon_(other.canon_)
+    {
+        mm_ = alloc_pages(mmsz_, policy);
+        buckets_ = static_cast<StaticBucket *>(mm_);
+        parallel_copy(buckets_, other.buckets_, bytes(), policy.nthreads_);
+    }
+    ~StaticTaxTable() {
+        if(mm_) ::munmap(mm_, mmsz_);
+        else    std::free(buckets_);
+    }
+    // Moves the buckets into memory from alloc_pages, releasing the file mapping or heap copy they used before.
+    void place(const PagePolicy &policy) {
+        StaticTaxTable tmp(*this, policy);
+        std::swap(buckets_, tmp.buckets_);
+        std::swap(mm_, tmp.mm_);
+        std::swap(mmsz_, tmp.mmsz_);
+    }
+
+    // fastrange takes the high bits of the hash, and overflow_bit the low bits.
+    INLINE u64 primary(u64 hash) const {
+        return (u128(hash) * nbuckets_) >> 64;
+    }
+    INLINE u64 secondary(u64 key, u64 prim) const {
+        const u64 ret((u128(__ac_Wang64_hash(key ^ XOR_MASK)) * nbuckets_) >> 64);
+        return ret != prim ? ret: ret + 1 == nbuckets_ ? 0: ret + 1;
+    }
+    // Returns 0 if key is absent.
+    INLINE tax_t get(u64 key) const {
+        const u64 hash(__ac_Wang64_hash(key)), b(primary(hash));
+        unsigned m;
+        if((m = buckets_[b].match(key))) return buckets_[b].vals_[__builtin_ctz(m)];
+        if(!buckets_[b].overflowed(hash)) return 0;
+        const StaticBucket &alt(buckets_[secondary(key, b)]);
+        return (m = alt.match(key)) ? alt.vals_[__builtin_ctz(m)]: 0;
+    }
+    // Batched lookup, prefetching primary buckets KH_PREFETCH_DIST keys ahead, as khash_get_batch.
+    // Keys which need their secondary bucket have it prefetched and are resolved in a second pass.
+    // Missing keys are assigned 0. scratch must have room for n entries.
+    void get_batch(const u64 *keys, size_t n, tax_t *out, u64 *scratch) const {
+        size_t i, npending(0);
+        unsigned m;
+        for(i = 0; i < n; ++i) scratch[i] = primary(__ac_Wang64_hash(keys[i]));
+        for(i = 0; i < std::min(n, size_t(KH_PREFETCH_DIST)); __builtin_prefetch(buckets_ + scratch[i++]));
+        for(i = 0; i < n; ++i) {
+            if(i + KH_PREFETCH_DIST < n) __builtin_prefetch(buckets_ + scratch[i + KH_PREFETCH_DIST]);
+            const StaticBucket &bucket(buckets_[scratch[i]]);
+            if((m = bucket.match(keys[i]))) out[i] = bucket.vals_[__builtin_ctz(m)];
+            else {
+                out[i] = 0;
+                if(bucket.overflowed(__ac_Wang64_hash(keys[i]))) {
+                    __builtin_prefetch(buckets_ + secondary(keys[i], scratch[i]));
+                    scratch[npending++] = i; // npending <= i, so this never clobbers a bucket still needed.
+                }
+            }
+        }
+        for(size_t j(0); j < npending; ++j) {
+            i = scratch[j];
+            const StaticBucket &alt(buckets_[secondary(keys[i], primary(__ac_Wang64_hash(keys[i])))]);
+            if((m = alt.match(keys[i]))) out[i] = alt.vals_[__builtin_ctz(m)];
+        }
+    }
+    // Calls f with every key in the table.
+    template<typename Functor>
+    void for_each_key(const Functor &f) const {
+        for(u64 b(0); b < nbuckets_; ++b)
+            for(unsigned i(0); i < buckets_[b].count(); ++i) f(buckets_[b].keys_[i]);
+    }
+    u64 size()     const {return size_;}
+    u64 nbuckets() const {return nbuckets_;}
+    size_t bytes() const {return nbuckets_ * sizeof(StaticBucket);}
+    bool mapped()  const {return mm_ != nullptr;}
+    void prefault(int nthreads) const {bns::prefault(buckets_, bytes(), nthreads);}
+    PageStats page_stats() const {return bns::page_stats(buckets_, bytes());}
+
+    void write(const char *path) const;
+private:
+    INLINE void place(u64 b, u64 key, tax_t val) {
+        StaticBucket &bucket(buckets_[b]);
+        const unsigned ind(bucket.count());
+        bucket.keys_[ind] = key;
+        bucket.vals_[ind] = val;
+        ++bucket.meta_;
+    }
+    bool insert(u64 key, tax_t val, RNGType &gen) {
+        u64 b(primary(__ac_Wang64_hash(key)));
+        if(buckets_[b].count() < StaticBucket::NSLOTS) {
+            place(b, key, val), ++size_;
+            return true;
+        }
+        // Random-walk cuckoo insertion, starting from the secondary bucket.
+        for(unsigned kick(0); kick < MAX_KICKS; ++kick) {
+            const u64 hash(__ac_Wang64_hash(key)), prim(primary(hash)), alt(b == prim ? secondary(key, prim): prim);
+            if(alt != prim) buckets_[prim].meta_ |= StaticBucket::overflow_bit(hash);
+            if(buckets_[alt].count() < StaticBucket::NSLOTS) {
+                place(alt, key, val), ++size_;
+                return true;
+            }
+            StaticBucket &bucket(buckets_[alt]);
+            const unsigned victim(gen() % StaticBucket::NSLOTS);
+            std::swap(bucket.keys_[victim], key);
+            std::swap(bucket.vals_[victim], val);
+            b = alt;
+        }
+        return false; // key, val were dropped; the caller rebuilds the table.
+    }
+};
+
+/*
+ * On disk: a DBHeader (with STATIC_DB_MAGIC) padded to DB_PAGE_SIZE and the bucket array.
+ * n_buckets_ is the number of buckets, size_ the number of keys and keys_offset_ the offset
+ * of the bucket array. sample_ holds sample_, with 0 read as 1, and canon_ holds canon_ + 1.
+ */
+inline void StaticTaxTable::write(const char *path) const {
+    if(s_.size() > sizeof(DBHeader::spacing_) / sizeof(DBHeader::spacing_[0]))
+        throw std::runtime_error("Spacing too long for database header.");
+    DBHeader hdr;
+    std::memset(&hdr, 0, sizeof(hdr));
+    hdr.magic_       = STATIC_DB_MAGIC;
+    hdr.version_     = DB_VERSION;
+    hdr.k_           = k_;
+    hdr.w_           = w_;
+    hdr.key_size_    = sizeof(u64);
+    hdr.val_size_    = sizeof(tax_t);
+    hdr.spacing_len_ = s_.size();
+    std::copy(s_.begin(), s_.end(), hdr.spacing_);
+    hdr.n_buckets_   = nbuckets_;
+    hdr.size_        = size_;
+    hdr.sample_      = sample_;
+    hdr.canon_       = canon_ + 1;
+    hdr.keys_offset_ = DB_PAGE_SIZE;
+    hdr.file_size_   = DB_PAGE_SIZE + bytes();
+    std::FILE *ofp(std::fopen(path, "wb"));
+    if(!ofp) LOG_EXIT("Could not open %s for writing.\n", path);
+    std::vector<char> page(DB_PAGE_SIZE);
+    std::memcpy(page.data(), &hdr, sizeof(hdr));
+    if(std::fwrite(page.data(), 1, page.size(), ofp) != page.size()
+       || std::fwrite(static_cast<const void *>(buckets_), sizeof(StaticBucket), nbuckets_, ofp) != nbuckets_
+       || std::fclose(ofp))
+        throw std::runtime_error("Error writing static database");
+}
+
+inline StaticTaxTable::StaticTaxTable(const char *path, int load_flags): buckets_(nullptr), nbuckets_(0), size_(0), mm_(nullptr), mmsz_(0) {
+    const auto start(std::chrono::system_clock::now());
+    const int fd(::open(path, O_RDONLY));
+    if(fd < 0) LOG_EXIT("Could not open %s for reading.\n", path);
+    DBHeader hdr;
+    if(read_full(fd, &hdr, sizeof(hdr)) != sizeof(hdr) || hdr.magic_ != STATIC_DB_MAGIC || hdr.version_ != DB_VERSION)
+        LOG_EXIT("%s is not a static classification database, or has an unsupported version.\n", path);
+    struct stat st;
+    if(::fstat(fd, &st) || u64(st.st_size) < hdr.file_size_) LOG_EXIT("Database %s is truncated.\n", path);
+    if(hdr.spacing_len_ > sizeof(hdr.spacing_) / sizeof(hdr.spacing_[0]) || hdr.keys_offset_ > hdr.file_size_
+       || hdr.n_buckets_ == 0 || hdr.n_buckets_ > (hdr.file_size_ - hdr.keys_offset_) / sizeof(StaticBucket)
+       || hdr.keys_offset_ % alignof(StaticBucket)) // Buckets are compared with aligned SIMD loads.
+        LOG_EXIT("Database %s has a corrupt header.\n", path);
+    k_ = hdr.k_;
+    w_ = hdr.w_;
+    s_ = spvec_t(hdr.spacing_, hdr.spacing_ + hdr.spacing_len_);
+    nbuckets_ = hdr.n_buckets_;
+    size_     = hdr.size_;
+    sample_   = std::max(u64(1), hdr.sample_);
+    canon_    = hdr.canon_ > 2 ? -1: int(hdr.canon_) - 1;
+    if(load_flags & DB_NO_MMAP) {
+        if(posix_memalign(reinterpret_cast<void **>(&buckets_), DB_PAGE_SIZE, bytes())) throw std::bad_alloc();
+        if(::lseek(fd, hdr.keys_offset_, SEEK_SET) != off_t(hdr.keys_offset_) || read_full(fd, buckets_, bytes()) != ssize_t(bytes()))
+            LOG_EXIT("Could not read buckets from %s\n", path);
+    } else {
+        mmsz_ = hdr.file_size_;
+        if((mm_ = ::mmap(nullptr, mmsz_, PROT_READ, MAP_SHARED | (load_flags & DB_MMAP_POPULATE ? MAP_POPULATE: 0), fd, 0)) == MAP_FAILED)
+            LOG_EXIT("Could not mmap %s: %s\n", path, std::strerror(errno));
+        if((load_flags & DB_MMAP_RANDOM)   && ::madvise(mm_, mmsz_, MADV_RANDOM))
+            LOG_WARNING("madvise(MADV_RANDOM) failed: %s\n", std::strerror(errno));
+        if((load_flags & DB_MMAP_WILLNEED) && ::madvise(mm_, mmsz_, MADV_WILLNEED))
+            LOG_WARNING("madvise(MADV_WILLNEED) failed: %s\n", std::strerror(errno));
+        buckets_ = reinterpret_cast<StaticBucket *>(static_cast<char *>(mm_) + hdr.keys_offset_);
+    }
+    ::close(fd);
+    LOG_INFO("Loaded static database %s (%s, %zu keys in %zu buckets) in %lfs\n", path, mm_ ? "mapped": "in memory",
+             size_t(size_), size_t(nbuckets_), std::chrono::duration<double>(std::chrono::system_clock::now() - start).count());
+}
+
+// Returns the magic number at the start of a database file, or 0 if it cannot be read.
+inline u64 database_magic(const char *path) {
+    u64 ret(0);
+    if(std::FILE *fp = std::fopen(path, "rb")) {
+        if(std::fread(&ret, sizeof(ret), 1, fp) != 1) ret = 0;
+        std::fclose(fp);
+    }
+    return ret;
+}
+
+} // namespace bns
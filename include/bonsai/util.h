@@ -1,8 +1,10 @@
 #pragma once
 #include <algorithm>
 #include <cassert>
+#include <cerrno>
 #include <chrono>
 #include <cinttypes>
+#include <climits>
 #include <cstdio>
 #include <cstring>
 #include <forward_list>
@@ -17,6 +19,7 @@
 #include <unordered_map>
 #include <unordered_set>
 #include <sys/stat.h>
+#include <sys/uio.h>
 #include <zlib.h>
 
 #include "kspp/ks.h"
@@ -214,6 +217,48 @@ template<typename T, typename KType> khint_t khash_get(T *map, KType key) {
 #endif
 }
 
+/*
+ * Batched lookup for the 64-bit integer-keyed tables (c, 64, all).
+ * All keys are hashed first, and the flag word, key and value of each home bucket
+ * are prefetched KH_PREFETCH_DIST keys ahead of the probe that resolves them, so
+ * that many DRAM/TLB misses are in flight at once rather than one per kh_get.
+ * On return, out[i] holds the bucket for keys[i], or kh_end(map) if it is absent.
+ * out may not alias keys.
+ */
+#ifndef KH_PREFETCH_DIST
+#  define KH_PREFETCH_DIST 16
+#endif
+template<typename T>
+INLINE void khash_prefetch_bucket(const T *map, khint_t i) {
+    __builtin_prefetch(map->flags + (i >> 4));
+    __builtin_prefetch(map->keys + i);
+    if(map->vals) __builtin_prefetch(map->vals + i); // Sets have no values.
+}
+
+template<typename T>
+void khash_get_batch(const T *map, const u64 *keys, size_t n, khint_t *out) {
+    static_assert(sizeof(*map->keys) == sizeof(u64), "khash_get_batch requires 64-bit keys hashed with __ac_Wang64_hash");
+    if(unlikely(map->n_buckets == 0)) {
+        std::fill(out, out + n, khint_t(0));
+        return;
+    }
+    const khint_t mask(map->n_buckets - 1);
+    size_t i;
+    for(i = 0; i < n; ++i) out[i] = __ac_Wang64_hash(keys[i]) & mask;
+    for(i = 0; i < std::min(n, size_t(KH_PREFETCH_DIST)); khash_prefetch_bucket(map, out[i++]));
+    for(i = 0; i < n; ++i) {
+        if(i + KH_PREFETCH_DIST < n) khash_prefetch_bucket(map, out[i + KH_PREFETCH_DIST]);
+        // Same probe sequence as kh_get.
+        khint_t ind(out[i]), last(ind), step(0);
+        const u64 key(keys[i]);
+        while(!__ac_isempty(map->flags, ind) && (__ac_isdel(map->flags, ind) || map->keys[ind] != key)) {
+            ind = (ind + (++step)) & mask;
+            if(ind == last) {ind = map->n_buckets; break;}
+        }
+        out[i] = ind == map->n_buckets || __ac_iseither(map->flags, ind) ? map->n_buckets: ind;
+    }
+}
+
 template<>
 void khash_destroy(khash_t(64) *map) noexcept;
 template<>
@@ -326,34 +371,89 @@ size_t khash_write(const T *map, const char *path, bool write_gz=false) noexcept
 
 
 template <typename T>
-T *khash_load_impl(const int fn) noexcept {
-    T *rex((T *)std::calloc(1, sizeof(T)));
+T *khash_alloc_arrays(T *rex) noexcept {
     using keytype_t = std::remove_pointer_t<decltype(rex->keys)>;
     using valtype_t = std::remove_pointer_t<decltype(rex->vals)>;
-    if(::read(fn, &rex->n_buckets, sizeof(rex->n_buckets)) != sizeof(rex->n_buckets)) exit(1);
-    if(::read(fn, &rex->n_occupied, sizeof(rex->n_occupied)) !=  sizeof(rex->n_occupied)) exit(1);
-    if((::read(fn, &rex->size, sizeof(rex->size))) != sizeof(rex->size)) exit(1);
-    if(::read(fn, &rex->upper_bound, sizeof(rex->upper_bound)) != sizeof(rex->upper_bound)) exit(1);
     rex->flags = (u32 *)std::malloc(sizeof(*rex->flags) * __ac_fsize(rex->n_buckets));
     if(!rex->flags) fprintf(stderr, "Could not allocate %zu bytes of memory (%zu GB)\n", (sizeof(*rex->flags) * __ac_fsize(rex->n_buckets)), (sizeof(*rex->flags) * __ac_fsize(rex->n_buckets)) >> 30), exit(1);
     rex->keys = (keytype_t *)std::malloc(sizeof(*rex->keys) * rex->n_buckets);
     if(!rex->keys) fprintf(stderr, "Could not allocate %zu bytes of memory (%zu GB)\n", sizeof(*rex->keys) * rex->n_buckets, sizeof(*rex->keys) * rex->n_buckets >> 30), exit(1);
     rex->vals = (valtype_t *)std::malloc(sizeof(*rex->vals) * rex->n_buckets);
     if(!rex->vals) fprintf(stderr, "Could not allocate %zu bytes of memory (%zu GB)\n", sizeof(*rex->vals) * rex->n_buckets, sizeof(*rex->vals) * rex->n_buckets >> 30), exit(1);
+    return rex;
+}
+
+// ::read, retried until nb bytes have been read. Returns the number of bytes read.
+inline ssize_t read_full(int fn, void *buf, size_t nb) noexcept {
+    size_t total(0);
+    for(ssize_t rc; total < nb; total += rc)
+        if((rc = ::read(fn, static_cast<char *>(buf) + total, nb - total)) <= 0)
+            break;
+    return total;
+}
+
+// ::write, retried after partial writes (e.g. to a pipe). Returns the number of bytes written.
+inline ssize_t write_full(int fn, const void *buf, size_t nb) noexcept {
+    size_t total(0);
+    for(ssize_t rc; total < nb; total += rc)
+        if((rc = ::write(fn, static_cast<const char *>(buf) + total, nb - total)) <= 0) {
+            if(rc < 0 && errno == EINTR) rc = 0;
+            else break;
+        }
+    return total;
+}
+
+// ::writev, retried after partial writes. iov is advanced past what was written.
+// Returns false on error, with iov[0:n] partly consumed.
+inline bool writev_full(int fn, struct iovec *iov, size_t n) noexcept {
+    while(n) {
+        const ssize_t rc(::writev(fn, iov, std::min(n, size_t(IOV_MAX))));
+        if(rc <= 0) {
+            if(rc < 0 && errno == EINTR) continue;
+            return false;
+        }
+        for(size_t done(rc); done;) {
+            const size_t len(std::min(done, iov->iov_len));
+            iov->iov_base = static_cast<char *>(iov->iov_base) + len, iov->iov_len -= len, done -= len;
+            if(iov->iov_len == 0) ++iov, --n;
+        }
+        while(n && iov->iov_len == 0) ++iov, --n;
+    }
+    return true;
+}
+
+template <typename T>
+T *khash_load_impl(const int fn) noexcept {
+    T *rex((T *)std::calloc(1, sizeof(T)));
+    if(read_full(fn, &rex->n_buckets, sizeof(rex->n_buckets)) != sizeof(rex->n_buckets)) exit(1);
+    if(read_full(fn, &rex->n_occupied, sizeof(rex->n_occupied)) !=  sizeof(rex->n_occupied)) exit(1);
+    if(read_full(fn, &rex->size, sizeof(rex->size)) != sizeof(rex->size)) exit(1);
+    if(read_full(fn, &rex->upper_bound, sizeof(rex->upper_bound)) != sizeof(rex->upper_bound)) exit(1);
+    khash_alloc_arrays(rex);
     ssize_t nb = __ac_fsize(rex->n_buckets) * sizeof(*rex->flags);
-    if(::read(fn, rex->flags, nb) != nb) exit(1);
+    if(read_full(fn, rex->flags, nb) != nb) exit(1);
     nb = rex->n_buckets * sizeof(*rex->keys);
-    if(::read(fn, rex->keys, nb) != nb) exit(1);
+    if(read_full(fn, rex->keys, nb) != nb) exit(1);
     nb = rex->n_buckets * sizeof(*rex->vals);
-    if(::read(fn, rex->keys, nb) != nb) exit(1);
+    if(read_full(fn, rex->vals, nb) != nb) exit(1);
     return rex;
 }
 
+// Reads through the stdio buffer so that it can follow other fread calls on fp,
+// including when fp is a pipe from a decompressor.
 template <typename T>
 T *khash_load_impl(std::FILE *fp) noexcept {
-    std::fflush(fp);
-    auto rex = khash_load_impl<T>(fileno(fp));
-    std::fflush(fp);
+    T *rex((T *)std::calloc(1, sizeof(T)));
+#define __fr(item) if(std::fread(&(item), sizeof(item), 1, fp) != 1) exit(1)
+    __fr(rex->n_buckets);
+    __fr(rex->n_occupied);
+    __fr(rex->size);
+    __fr(rex->upper_bound);
+#undef __fr
+    khash_alloc_arrays(rex);
+    if(std::fread(rex->flags, sizeof(*rex->flags), __ac_fsize(rex->n_buckets), fp) != __ac_fsize(rex->n_buckets)) exit(1);
+    if(std::fread(rex->keys, sizeof(*rex->keys), rex->n_buckets, fp) != rex->n_buckets) exit(1);
+    if(std::fread(rex->vals, sizeof(*rex->vals), rex->n_buckets, fp) != rex->n_buckets) exit(1);
     return rex;
 }
 
@@ -845,8 +945,11 @@ static tax_t resolve_tree(const std::map<tax_t, tax_t> &hit_counts,
   for(auto it(hit_counts.cbegin()), e(hit_counts.cend()); it != e; ++it) {
     tax_t taxon(it->first), node(taxon), score(0);
     // Instead of while node > 0
-    while(node)
-        score += hit_counts.at(node), node = kh_val(parent_map, kh_get(p, parent_map, node));
+    while(node) {
+        auto hit(hit_counts.find(node));
+        if(hit != hit_counts.end()) score += hit->second;
+        node = kh_val(parent_map, kh_get(p, parent_map, node));
+    }
     if(score > max_score) {
       max_taxa.clear();
       max_score = score;
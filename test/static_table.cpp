@@ -0,0 +1,109 @@
+#include "test/catch.hpp"
+#include <random>
+#include "static_table.h"
+#include "prefilter.h"
+#include "screen.h"
+using namespace bns;
+
+TEST_CASE("StaticTaxTable") {
+    khash_t(c) *th(kh_init(c));
+    khint_t ki;
+    int khr;
+    std::vector<u64> keys;
+    wy::WyHash<uint64_t, 2> gen(137);
+    for(size_t i(0); i < 100000; ++i) {
+        const u64 k(gen());
+        keys.push_back(k);
+        if(i % 3 == 0) continue; // Leave a third of the keys out as misses.
+        ki = kh_put(c, th, k, &khr);
+        kh_val(th, ki) = i + 1;
+    }
+    for(const double load_factor: {0.5, StaticTaxTable::DEFAULT_LOAD_FACTOR, 0.95}) {
+        StaticTaxTable table(th, 31, 31, spvec_t(30), load_factor);
+        REQUIRE(table.size() == kh_size(th));
+        table.write("__static__.db");
+        for(const int flags: {0, int(DB_NO_MMAP)}) {
+            StaticTaxTable loaded("__static__.db", flags);
+            REQUIRE(loaded.size() == table.size());
+            REQUIRE(loaded.k_ == 31);
+            std::vector<tax_t> out(keys.size());
+            std::vector<u64> scratch(keys.size());
+            loaded.get_batch(keys.data(), keys.size(), out.data(), scratch.data());
+            for(size_t i(0); i < keys.size(); ++i) {
+                const tax_t expected(i % 3 ? i + 1: 0);
+                REQUIRE(loaded.get(keys[i]) == expected);
+                REQUIRE(out[i] == expected);
+            }
+        }
+    }
+    REQUIRE(system("rm __static__.db") == 0);
+    REQUIRE(database_magic("__nonexistent__.db") == 0);
+    kh_destroy(c, th);
+}
+
+TEST_CASE("BlockedBloom") {
+    wy::WyHash<uint64_t, 2> gen(1337);
+    std::vector<u64> keys(50000);
+    for(auto &key: keys) key = gen();
+    for(const double bits: {6., BlockedBloom::DEFAULT_BITS_PER_KEY}) {
+        BlockedBloom bloom(keys.size(), bits);
+        for(const auto key: keys) bloom.add(key);
+        bloom.write("__prefilter__.bloom");
+        for(const int flags: {0, int(DB_NO_MMAP)}) {
+            BlockedBloom loaded("__prefilter__.bloom", flags);
+            REQUIRE(loaded.nkeys() == keys.size());
+            REQUIRE(loaded.nhash() == bloom.nhash());
+            for(const auto key: keys) REQUIRE(loaded.may_contain(key));
+            // Half members, half (almost surely) not: the batch keeps every member and few others.
+            std::vector<u64> queries(keys.begin(), keys.begin() + 20000), scratch(40000);
+            while(queries.size() < 40000) queries.push_back(gen());
+            std::vector<u32> idx(queries.size());
+            const size_t npass(loaded.filter_batch(queries.data(), queries.size(), scratch.data(), idx.data()));
+            REQUIRE(npass >= 20000);
+            for(size_t i(0); i < 20000; ++i) REQUIRE(idx[i] == i);
+            REQUIRE(double(npass - 20000) / 20000 < 2. * bloom.expected_fpr() + 1e-3);
+        }
+    }
+    REQUIRE(BlockedBloom::bits_for_fpr(0.01) < BlockedBloom::bits_for_fpr(0.001));
+    REQUIRE(BlockedBloom::expected_fpr(BlockedBloom::bits_for_fpr(0.001), BlockedBloom::best_nhash(BlockedBloom::bits_for_fpr(0.001))) <= 0.001);
+    REQUIRE(system("rm __prefilter__.bloom") == 0);
+}
+
+TEST_CASE("HostScreen") {
+    std::mt19937_64 gen(13);
+    std::string genome(20000, 'A'), other(genome);
+    for(auto &c: genome) c = "ACGT"[gen() & 3];
+    for(auto &c: other)  c = "ACGT"[gen() & 3];
+    {
+        std::ofstream ofs("__host__.fa");
+        ofs << ">host\n" << genome << '\n';
+    }
+    auto read = [](std::string &seq) {
+        bseq1_t bs;
+        std::memset(&bs, 0, sizeof(bs));
+        bs.seq = &seq[0], bs.l_seq = seq.size();
+        return bs;
+    };
+    const Spacer sp(31, 31);
+    for(const u64 sample: {1, 4}) {
+        build_host_set({"__host__.fa"}, sp, true, 2, sample)->write("__host__.set");
+        const StaticTaxTable set("__host__.set");
+        REQUIRE(set.sample_ == sample);
+        REQUIRE(set.canon_ == 1);
+        REQUIRE(set.size() > (genome.size() - 30) / sample / 2);
+        const HostScreen screen(set, 0.5);
+        REQUIRE(screen.compatible(sp));
+        auto scratch(screen.make_scratch());
+        for(size_t pos(0); pos + 150 <= genome.size(); pos += 997) {
+            std::string host(genome.substr(pos, 150)), nonhost(other.substr(pos, 150));
+            // A read with its first 50 bases from the host has only 20 of its 120 k-mers in the set.
+            std::string chimera(host.substr(0, 50) + nonhost.substr(0, 100));
+            bseq1_t bs(read(host)), ns(read(nonhost)), cs(read(chimera));
+            REQUIRE(screen.is_host(&bs, 0, *scratch));
+            REQUIRE(!screen.is_host(&ns, 0, *scratch));
+            if(sample == 1) REQUIRE(!screen.is_host(&cs, 0, *scratch));
+        }
+        REQUIRE(scratch->host_ < scratch->screened_);
+    }
+    REQUIRE(system("rm __host__.fa __host__.set") == 0);
+}
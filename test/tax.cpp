@@ -2,6 +2,9 @@
 
 #include "tx.h"
 #include "bitmap.h"
+#include "dense_tax.h"
+#include "report.h"
+#include <random>
 using namespace bns;
 
 TEST_CASE("tax") {
@@ -50,3 +53,158 @@ TEST_CASE("bitstrings") {
     counter.add(v2);
     counter.print_vec();
 }
+
+// Random taxonomy with sparse taxids, each attached to a random earlier node.
+static khash_t(p) *random_taxonomy(std::mt19937_64 &mt, std::vector<tax_t> &ids, size_t n) {
+    khash_t(p) *map(kh_init(p));
+    int khr;
+    khint_t ki(kh_put(p, map, 1, &khr));
+    kh_val(map, ki) = 0;
+    ids.assign(1, 1);
+    while(ids.size() <= n) {
+        const tax_t id(ids.back() + 1 + mt() % 97);
+        ki = kh_put(p, map, id, &khr);
+        kh_val(map, ki) = ids[mt() % ids.size()];
+        ids.push_back(id);
+    }
+    return map;
+}
+
+TEST_CASE("dense_lca") {
+    int khr;
+    khint_t ki;
+    std::mt19937_64 mt(13);
+    std::vector<tax_t> ids;
+    khash_t(p) *map(random_taxonomy(mt, ids, 5000));
+    // A node whose parent is missing from the taxonomy, and a child of it.
+    ki = kh_put(p, map, ids.back() + 1000, &khr);
+    kh_val(map, ki) = ids.back() + 999;
+    ki = kh_put(p, map, ids.back() + 1001, &khr);
+    kh_val(map, ki) = ids.back() + 1000;
+    DenseTaxonomy tax(map);
+    REQUIRE(tax.size() == kh_size(map));
+    for(const auto id: ids) REQUIRE(tax.depth(id) == node_depth(map, id));
+    std::vector<tax_t> a, b, batch(2000);
+    for(size_t i(0); i < batch.size(); ++i) {
+        a.push_back(ids[mt() % ids.size()]), b.push_back(ids[mt() % ids.size()]);
+        REQUIRE(tax.lca(a.back(), b.back()) == lca(map, a.back(), b.back()));
+    }
+    tax.lca_batch(a.data(), b.data(), a.size(), batch.data());
+    for(size_t i(0); i < batch.size(); ++i) REQUIRE(batch[i] == lca(map, a[i], b[i]));
+    REQUIRE(tax.lca(ids[5], 0) == ids[5]);
+    REQUIRE(tax.lca(0, ids[5]) == ids[5]);
+    REQUIRE(tax.lca(ids[5], ids.back() + 1001) == tax_t(-1));
+    REQUIRE(tax.lca(ids[5], ids.back() + 5000) == tax_t(-1));
+    REQUIRE(tax.lca(a.begin(), a.begin() + 3) == lca(map, lca(map, a[0], a[1]), a[2]));
+    kh_destroy(p, map);
+}
+
+TEST_CASE("tree_resolver") {
+    std::mt19937_64 mt(137);
+    std::vector<tax_t> ids;
+    khash_t(p) *map(random_taxonomy(mt, ids, 2000));
+    DenseTaxonomy tax(map);
+    TreeResolver resolver(tax);
+    for(size_t read(0); read < 1000; ++read) {
+        linear::counter<tax_t, u16> hit_counts;
+        // Draw hits from a small neighbourhood so that paths overlap and ties occur.
+        const size_t start(mt() % (ids.size() - 16));
+        for(size_t i(0), n(1 + mt() % 40); i < n; ++i) {
+            const tax_t id(ids[start + mt() % 16]);
+            hit_counts.add(id);
+            resolver.add(id);
+        }
+        REQUIRE(resolver.resolve() == resolve_tree(hit_counts, map));
+    }
+    kh_destroy(p, map);
+}
+
+TEST_CASE("tree_resolver_settled") {
+    std::mt19937_64 mt(1337);
+    std::vector<tax_t> ids;
+    khash_t(p) *map(random_taxonomy(mt, ids, 2000));
+    DenseTaxonomy tax(map);
+    std::set<tax_t> parents;
+    for(khiter_t ki(0); ki < kh_end(map); ++ki) if(kh_exist(map, ki)) parents.insert(kh_val(map, ki));
+    for(const auto id: ids) REQUIRE(tax.leaf(tax.index(id)) == !parents.count(id));
+    TreeResolver resolver(tax);
+    size_t nsettled(0);
+    for(size_t read(0); read < 500; ++read) {
+        // Mostly hits to one taxon, with noise from its neighbourhood.
+        const size_t start(mt() % (ids.size() - 16));
+        const tax_t main(ids[start + mt() % 16]);
+        std::vector<tax_t> hits(1 + mt() % 60);
+        linear::counter<tax_t, u16> hit_counts;
+        for(auto &hit: hits) hit_counts.add(hit = mt() % 4 ? main: ids[start + mt() % 16]);
+        const tax_t full(resolve_tree(hit_counts, map));
+        // Whenever the remaining hits cannot change the call, the call so far must be the full one.
+        for(size_t n(1); n < hits.size(); ++n) {
+            for(size_t i(0); i < n; ++i) resolver.add(hits[i]);
+            if(resolver.settled(hits.size() - n)) {
+                REQUIRE(resolver.resolve() == full);
+                ++nsettled;
+            } else resolver.clear();
+        }
+    }
+    REQUIRE(nsettled > 0);
+    kh_destroy(p, map);
+}
+
+TEST_CASE("taxon_report") {
+    // 1 -> 2 (genus) -> 3, 4 (species); 1 -> 5 (no rank) -> 6 (species)
+    khash_t(p) *map(kh_init(p));
+    int khr;
+    const tax_t nodes[][2] {{1, 0}, {2, 1}, {3, 2}, {4, 2}, {5, 1}, {6, 5}};
+    for(const auto &node: nodes) {
+        const khint_t ki(kh_put(p, map, node[0], &khr));
+        kh_val(map, ki) = node[1];
+    }
+    DenseTaxonomy tax(map);
+    {
+        std::ofstream ofs("__nodes__.dmp");
+        ofs << "1\t|\t1\t|\tno rank\t|\n2\t|\t1\t|\tgenus\t|\n3\t|\t2\t|\tspecies\t|\n"
+               "4\t|\t2\t|\tspecies\t|\n5\t|\t1\t|\tno rank\t|\n6\t|\t5\t|\tspecies\t|\n";
+        std::ofstream names("__names__.dmp");
+        names << "1\t|\troot\t|\t\t|\tscientific name\t|\n2\t|\tGenus\t|\t\t|\tscientific name\t|\n3\t|\tSpecies a\t|\t\t|\tscientific name\t|\n";
+    }
+    std::vector<TaxonCounts> counts;
+    counts.emplace_back(tax), counts.emplace_back(tax);
+    for(int i(0); i < 4; ++i) counts[0].add(3), counts[1].add(0);
+    counts[0].add(4), counts[1].add(2), counts[1].add(6), counts[1].add(999);
+    std::vector<std::vector<u64>> sums(1, std::vector<u64>(counts[0].size()));
+    for(const auto &c: counts) c.add_to(sums[0]);
+    TaxonReport report("__nodes__.dmp", "__names__.dmp", {"db"}, "__report__.txt", nullptr);
+    REQUIRE(!report.due());
+    report.write(tax, sums);
+    std::ifstream is("__report__.txt");
+    const std::string text((std::istreambuf_iterator<char>(is)), std::istreambuf_iterator<char>());
+    REQUIRE(text == " 33.33\t4\t4\tU\t0\tunclassified\n"
+                    " 58.33\t7\t0\tR\t1\troot\n"
+                    " 50.00\t6\t1\tG\t2\t  Genus\n"
+                    " 33.33\t4\t4\tS\t3\t    Species a\n"
+                    "  8.33\t1\t1\tS\t4\t    4\n"
+                    "  8.33\t1\t0\tR1\t5\t  5\n"
+                    "  8.33\t1\t1\tS\t6\t    6\n");
+    // Subsampled at half the reads: percentages are followed by their confidence intervals.
+    report.set_read_fraction(.5);
+    report.write(tax, sums);
+    std::ifstream sampled("__report__.txt");
+    std::string line;
+    std::getline(sampled, line);
+    REQUIRE(line == " 33.33\t 17.97\t 53.29\t4\t4\tU\t0\tunclassified");
+    REQUIRE(system("rm __nodes__.dmp __names__.dmp __report__.txt") == 0);
+    kh_destroy(p, map);
+}
+
+TEST_CASE("wilson_interval") {
+    auto ci(wilson_interval(50, 100));
+    REQUIRE(std::abs(ci.first - .4038) < 1e-4);
+    REQUIRE(std::abs(ci.second - .5962) < 1e-4);
+    ci = wilson_interval(0, 100);
+    REQUIRE(ci.first == 0.);
+    REQUIRE(ci.second > 0.);
+    // Sampling more of the population narrows the interval, down to the point estimate.
+    const auto half(wilson_interval(50, 100, .5));
+    REQUIRE(half.second - half.first < .75 * (wilson_interval(50, 100).second - wilson_interval(50, 100).first));
+    REQUIRE(wilson_interval(30, 100, 1.) == std::make_pair(.3, .3));
+}
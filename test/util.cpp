@@ -1,5 +1,8 @@
 #include "test/catch.hpp"
 #include "util.h"
+#include "database.h"
+#include "classifier.h"
+#include <random>
 using namespace bns;
 
 #define is_pow2(x) ((x & (x - 1)) == 0)
@@ -36,3 +39,537 @@ TEST_CASE("roundup64") {
         REQUIRE(__builtin_clzll(d) - 1 == __builtin_clzll(roundup64(d)));
     }
 }
+
+TEST_CASE("KhashBatchGet") {
+    khash_t(c) *th(kh_init(c));
+    khint_t ki;
+    int khr;
+    std::vector<u64> keys;
+    wy::WyHash<uint64_t, 2> gen(13);
+    for(size_t i(0); i < 10000; ++i) {
+        const u64 k(gen());
+        keys.push_back(k);
+        if(i & 1) continue; // Only insert every other key so that half are misses.
+        ki = kh_put(c, th, k, &khr);
+        kh_val(th, ki) = i;
+    }
+    std::vector<khint_t> buckets(keys.size());
+    khash_get_batch(th, keys.data(), keys.size(), buckets.data());
+    for(size_t i(0); i < keys.size(); ++i) {
+        REQUIRE(buckets[i] == kh_get(c, th, keys[i]));
+        if(i & 1) REQUIRE(buckets[i] == kh_end(th));
+        else      REQUIRE(kh_val(th, buckets[i]) == i);
+    }
+    kh_destroy(c, th);
+}
+
+TEST_CASE("DatabaseMapped") {
+    khash_t(c) *th(kh_init(c));
+    khint_t ki;
+    int khr;
+    for(size_t i(0); i < 1 << 14; ++i) {
+        ki = kh_put(c, th, (i << 14) | (i + 2), &khr);
+        kh_val(th, ki) = i;
+    }
+    Database<khash_t(c)> db(31, 31, spvec_t(30), 1, th);
+    db.write("__zomg__.db");
+    db.write("__zomg__.db.gz", ZLIB);
+    for(const char *path: {"__zomg__.db", "__zomg__.db.gz"}) {
+        for(const int flags: {0, int(DB_MMAP_POPULATE | DB_MMAP_RANDOM), int(DB_NO_MMAP)}) {
+            Database<khash_t(c)> loaded(path, flags);
+            REQUIRE(loaded.mapped() == (path[std::strlen(path) - 1] == 'b' && !(flags & DB_NO_MMAP)));
+            REQUIRE(loaded.k_ == 31);
+            REQUIRE(loaded.s_ == db.s_);
+            REQUIRE(loaded.db_->n_buckets == th->n_buckets);
+            REQUIRE(loaded.db_->size == th->size);
+            REQUIRE(std::memcmp(loaded.db_->flags, th->flags, __ac_fsize(th->n_buckets) * sizeof(*th->flags)) == 0);
+            REQUIRE(std::memcmp(loaded.db_->keys, th->keys, th->n_buckets * sizeof(*th->keys)) == 0);
+            REQUIRE(std::memcmp(loaded.db_->vals, th->vals, th->n_buckets * sizeof(*th->vals)) == 0);
+            for(size_t i(0); i < 1 << 14; ++i)
+                REQUIRE(loaded.get_lca((i << 14) | (i + 2)) == i);
+        }
+    }
+    REQUIRE(system("rm __zomg__.db __zomg__.db.gz") == 0);
+}
+
+TEST_CASE("DatabasePlacement") {
+    REQUIRE(numa::parse_list("0-3,8,10-11\n") == std::vector<int>{0, 1, 2, 3, 8, 10, 11});
+    REQUIRE(numa::parse_list("0") == std::vector<int>{0});
+    khash_t(c) *th(kh_init(c));
+    int khr;
+    for(size_t i(0); i < 1 << 14; ++i) {
+        const khint_t ki(kh_put(c, th, (i << 14) | (i + 2), &khr));
+        kh_val(th, ki) = i;
+    }
+    Database<khash_t(c)> db(31, 31, spvec_t(30), 1, th);
+    db.write("__placed__.db");
+    Database<khash_t(c)> loaded("__placed__.db");
+    loaded.prefault(2);
+    PagePolicy interleaved, bound, huge;
+    interleaved.node_ = NODE_INTERLEAVE, interleaved.nthreads_ = 2;
+    bound.node_ = numa::nodes()[0];
+    huge.huge_ = HUGE_PAGES_2M; // Falls back to transparent huge pages without a hugetlb pool.
+    loaded.place(interleaved);
+    auto replica(loaded.replicate(bound));
+    StaticTaxTable table(th, 31, 31, spvec_t(30)), table_replica(table, bound);
+    table.place(huge);
+    REQUIRE(table.page_stats().bytes_ >= table.bytes());
+    for(size_t i(0); i < 1 << 14; ++i) {
+        const u64 key((i << 14) | (i + 2));
+        REQUIRE(loaded.get_lca(key) == i);
+        REQUIRE(replica->get_lca(key) == i);
+        REQUIRE(table.get(key) == i);
+        REQUIRE(table_replica.get(key) == i);
+    }
+    REQUIRE(loaded.get_lca(1) == -1u);
+    REQUIRE(system("rm __placed__.db") == 0);
+}
+
+TEST_CASE("MinimizerCache") {
+    MinimizerCache cache(4);
+    tax_t val(0);
+    REQUIRE(cache.active());
+    REQUIRE(!cache.get(7, val));
+    cache.put(7, 5), cache.put(8, 0);
+    REQUIRE(cache.get(7, val));
+    REQUIRE(val == 5);
+    // Misses are cached too.
+    REQUIRE(cache.get(8, val));
+    REQUIRE(val == 0);
+    REQUIRE(cache.probes_ == 3);
+    REQUIRE(cache.hits_ == 2);
+
+    // Minimizers equal to the previous window's are neither probed nor looked up.
+    khash_t(c) *map(kh_init(c));
+    khash_t(p) *taxmap(kh_init(p));
+    int khr;
+    for(const tax_t node: {1, 5}) {
+        const khint_t ki(kh_put(p, taxmap, node, &khr));
+        kh_val(taxmap, ki) = node == 1 ? 0: 1;
+    }
+    for(const u64 key: {1, 3}) {
+        const khint_t ki(kh_put(c, map, key, &khr));
+        kh_val(map, ki) = 5;
+    }
+    Classifier c(map, spvec_t{}, 31, 31, 1, true, false, true);
+    DenseTaxonomy tax(taxmap);
+    ClassifyScratch scratch(tax);
+    scratch.kmers_ = {1, 1, 2, 2, 2, 3, 1};
+    lookup_minimizers(c, scratch);
+    REQUIRE(scratch.hits_ == std::vector<tax_t>{5, 5, 0, 0, 0, 5, 5});
+    const MinimizerCache &used(scratch.caches_[0]);
+    REQUIRE(used.lookups_ == 7);
+    REQUIRE(used.repeats_ == 3);
+    REQUIRE(used.probes_ == 4);
+    REQUIRE(used.hits_ == 0);
+    // Misses of a batch are looked up together and cached for the next.
+    scratch.kmers_ = {3};
+    lookup_minimizers(c, scratch);
+    REQUIRE(scratch.hits_[0] == 5);
+    REQUIRE(used.hits_ == 1);
+
+    // A cache hitting less than one probe in MIN_HIT_RATIO_INV after WARMUP probes turns itself off.
+    MinimizerCache cold(4), hot(4);
+    for(u64 i(0); i < MinimizerCache::WARMUP; ++i) {
+        if(!cold.get(i + 1000, val)) cold.put(i + 1000, 0);
+        if(!hot.get(i % 4, val))     hot.put(i % 4, 0);
+    }
+    cold.check_rate(), hot.check_rate();
+    REQUIRE(!cold.active());
+    REQUIRE(hot.active());
+    kh_destroy(c, map);
+    kh_destroy(p, taxmap);
+}
+
+TEST_CASE("ReadCache") {
+    struct read_t {char *seq; int l_seq;};
+    std::string s1(150, 'A'), s2(s1);
+    s2[149] = 'C';
+    read_t pair[] {{&s1[0], 150}, {&s2[0], 150}}, swapped[] {{&s2[0], 150}, {&s1[0], 150}};
+    const auto k1(ReadCache::make_key(pair, 0)), k2(ReadCache::make_key(pair + 1, 0)), kp(ReadCache::make_key(pair, 1));
+    REQUIRE((k1.lo_ != k2.lo_ || k1.hi_ != k2.hi_));
+    REQUIRE((kp.lo_ != k1.lo_ || kp.hi_ != k1.hi_));
+    const auto ks(ReadCache::make_key(swapped, 1));
+    REQUIRE((ks.lo_ != kp.lo_ || ks.hi_ != kp.hi_));
+
+    ReadCache cache(1 << 20);
+    ReadResult res, out;
+    res.taxon_ = 1002, res.missing_ = 3, res.ambig_ = 1;
+    res.runs_.puts("1002:120\tU:3\n");
+    REQUIRE(!cache.get(k1, out));
+    cache.put(k1, res);
+    REQUIRE(cache.get(k1, out));
+    REQUIRE(out.taxon_ == 1002);
+    REQUIRE(out.missing_ == 3);
+    REQUIRE(out.ambig_ == 1);
+    REQUIRE(std::string(out.runs_.data(), out.runs_.size()) == "1002:120\tU:3\n");
+    REQUIRE(!cache.get(k2, out));
+
+    // Results whose runs would overflow a shard's share of the cap are not cached.
+    const size_t cap(1 << 16);
+    ReadCache small(cap);
+    res.runs_.clear();
+    for(int i(0); i < 40; ++i) res.runs_.puts("1002:3\t");
+    size_t cached(0);
+    for(u64 i(0); i < 10000; ++i) {
+        const ReadCache::Key key{i * 0x9E3779B97F4A7C15ull + 1, i};
+        small.put(key, res);
+        cached += small.get(key, out);
+        REQUIRE(small.bytes() <= cap);
+    }
+    REQUIRE(cached > 0);
+}
+
+TEST_CASE("PartitionByBases") {
+    std::vector<bseq1_t> reads(1000);
+    std::memset(reads.data(), 0, reads.size() * sizeof(bseq1_t));
+    for(size_t i(0); i < reads.size(); ++i) reads[i].l_seq = i % 100 == 0 ? 100000: 150;
+    std::vector<u32> bounds;
+    for(const int is_paired: {0, 1}) {
+        partition_by_bases(reads.data(), reads.size(), is_paired, 4, bounds);
+        REQUIRE(bounds.front() == 0);
+        REQUIRE(bounds.back() == reads.size());
+        REQUIRE(bounds.size() > 4);
+        for(size_t i(1); i < bounds.size(); ++i) {
+            REQUIRE(bounds[i] > bounds[i - 1]);
+            if(is_paired) REQUIRE(bounds[i] % 2 == 0);
+        }
+    }
+}
+
+// A classifier over an in-memory khash, with taxa as leaves under the root, and what classify_seqs needs to run it.
+struct ClassifyFixture {
+    khash_t(c)   *map_;
+    khash_t(p)   *taxmap_;
+    Classifier    c_;
+    DenseTaxonomy tax_;
+    std::vector<std::unique_ptr<ClassifyScratch>> scratch_;
+    ForPool       pool_;
+    std::vector<u32>        bounds_;
+    std::vector<ks::string> out_;
+
+    static khash_t(p) *leaf_taxonomy(std::initializer_list<tax_t> leaves) {
+        khash_t(p) *ret(kh_init(p));
+        int khr;
+        khint_t ki(kh_put(p, ret, 1, &khr));
+        kh_val(ret, ki) = 0;
+        for(const tax_t leaf: leaves) ki = kh_put(p, ret, leaf, &khr), kh_val(ret, ki) = 1;
+        return ret;
+    }
+    ClassifyFixture(std::initializer_list<tax_t> leaves, int nthreads=1):
+        map_(kh_init(c)), taxmap_(leaf_taxonomy(leaves)), c_(map_, spvec_t{}, 31, 31, nthreads, true, false, true),
+        tax_(taxmap_), scratch_(c_.nt_), pool_(c_.nt_) {}
+    ~ClassifyFixture() {
+        kh_destroy(c, map_);
+        kh_destroy(p, taxmap_);
+    }
+    // Assigns the k-mers of seq[0:len] to taxon.
+    void add(tax_t taxon, const char *seq, size_t len) {
+        Encoder<score::Lex> enc(c_.enc_);
+        int khr;
+        enc.for_each([&](u64 kmer) {const khint_t ki(kh_put(c, map_, kmer, &khr)); kh_val(map_, ki) = taxon;}, seq, len);
+    }
+    // Classifies bs[0:nseq] and returns the output of all tasks.
+    std::string classify(bseq1_t *bs, u32 nseq, int is_paired=0, ReadWindows *windows=nullptr) {
+        const size_t ntasks(classify_seqs(c_, tax_, scratch_.data(), nullptr, bs, nseq, is_paired, pool_, bounds_, out_, 0, nullptr, windows));
+        std::string ret;
+        for(size_t i(0); i < ntasks; ++i) ret.append(out_[i].data(), out_[i].size());
+        return ret;
+    }
+};
+
+TEST_CASE("WindowedClassification") {
+    // Taxa 5 and 6 under the root; a read of 6 kb from taxon 5 followed by 2 kb from taxon 6.
+    std::mt19937_64 mt(7);
+    std::string seq(8000, 'A');
+    for(auto &b: seq) b = "ACGT"[mt() % 4];
+    ClassifyFixture fx({5, 6}, 2);
+    fx.add(5, seq.data(), 6000);
+    fx.add(6, seq.data() + 6000, 2000);
+    char name[] = "r";
+    bseq1_t bs;
+    std::memset(&bs, 0, sizeof(bs));
+    bs.name = name, bs.seq = &seq[0], bs.l_seq = seq.size();
+    ReadWindows windows;
+    const std::string whole(fx.classify(&bs, 1));
+    REQUIRE(fx.bounds_.size() == 2);
+    REQUIRE(whole.find("C\tr\t5\t8000\t") == 0);
+    fx.c_.window_ = 2000;
+    REQUIRE(nwindows(bs.l_seq, fx.c_.window_) == 4);
+    REQUIRE(nwindows(1999, fx.c_.window_) == 1);
+    const std::string windowed(fx.classify(&bs, 1, 0, &windows));
+    REQUIRE(windows.first_ == std::vector<u32>{0, 4});
+    // Windows overlap by a k-mer's span, so the third window's last k-mers come from taxon 6.
+    REQUIRE(windowed.substr(0, 12) == whole.substr(0, 12));
+    REQUIRE(windowed.substr(windowed.size() - 9) == "\t5:3\t6:1\n");
+}
+
+TEST_CASE("MateDeduplication") {
+    // Mates of a 250-base insert overlap by 50 bases, so 20 of the second mate's 120 k-mers are the first mate's.
+    std::mt19937_64 mt(11);
+    std::string seq(250, 'A');
+    for(auto &b: seq) b = "ACGT"[mt() % 4];
+    std::string mate1(seq.substr(0, 150)), mate2(seq.substr(100));
+    std::reverse(mate2.begin(), mate2.end());
+    for(auto &b: mate2) b = b == 'A' ? 'T': b == 'C' ? 'G': b == 'G' ? 'C': 'A';
+    ClassifyFixture fx({5});
+    fx.add(5, seq.data(), seq.size());
+    char name[] = "r";
+    bseq1_t bs[2];
+    std::memset(bs, 0, sizeof(bs));
+    bs[0].name = bs[1].name = name;
+    bs[0].seq = &mate1[0], bs[1].seq = &mate2[0], bs[0].l_seq = bs[1].l_seq = 150;
+    REQUIRE(fx.classify(bs, 2, 1) == "C\tr\t5\t150\t5:220\n");
+    REQUIRE(fx.scratch_[0]->mate_dropped_ == 20);
+    fx.c_.dedup_mates_ = false;
+    REQUIRE(fx.classify(bs, 2, 1) == "C\tr\t5\t150\t5:240\n");
+}
+
+TEST_CASE("Subsampling") {
+    REQUIRE(read_name_hash("SRR1.7/1") == read_name_hash("SRR1.7/2"));
+    REQUIRE(read_name_hash("SRR1.7/1") == read_name_hash("SRR1.7"));
+    REQUIRE(read_name_hash("SRR1.7") != read_name_hash("SRR1.8"));
+    std::mt19937_64 mt(13);
+    std::string seq(150, 'A');
+    for(auto &b: seq) b = "ACGT"[mt() % 4];
+    ClassifyFixture fx({5});
+    fx.add(5, seq.data(), seq.size());
+    // 1000 copies of the read under different names, a tenth of which are classified.
+    std::vector<std::string> names(1000);
+    std::vector<bseq1_t> bs(names.size());
+    std::memset(bs.data(), 0, bs.size() * sizeof(bseq1_t));
+    for(size_t i(0); i < names.size(); ++i)
+        names[i] = "r" + std::to_string(i), bs[i].name = &names[i][0], bs[i].seq = &seq[0], bs[i].l_seq = seq.size();
+    fx.c_.set_read_fraction(.1);
+    const std::string first(fx.classify(bs.data(), bs.size()));
+    const size_t nlines(std::count(first.begin(), first.end(), '\n'));
+    REQUIRE(nlines > 70);
+    REQUIRE(nlines < 130);
+    REQUIRE(fx.classify(bs.data(), bs.size()) == first);
+    REQUIRE(fx.scratch_[0]->reads_skipped_ == 2 * (names.size() - nlines));
+    // One in four minimizers: the others count as neither hits nor ambiguous windows.
+    fx.c_.set_read_fraction(1.);
+    fx.c_.set_minimizer_sample(4);
+    const std::string line(fx.classify(bs.data(), 1));
+    REQUIRE(line.find("C\tr0\t5\t150\t5:") == 0);
+    const int nhits(std::atoi(line.data() + line.rfind(':') + 1));
+    REQUIRE(u64(nhits) == fx.scratch_[0]->kmers_sampled_);
+    REQUIRE(nhits + fx.scratch_[0]->kmers_unsampled_ == 120);
+    REQUIRE(nhits > 10);
+    REQUIRE(nhits < 50);
+}
+
+TEST_CASE("MultiDatabaseOutput") {
+    char name[] = "r", seq[] = "ACGTACGTAC", qual[] = "IIIIIIIIII";
+    bseq1_t bs[2];
+    std::memset(bs, 0, sizeof(bs));
+    for(auto &b: bs) b.name = name, b.seq = seq, b.qual = qual, b.l_seq = 10;
+    std::vector<ReadResult> results(2);
+    results[0].taxon_ = 562, results[0].missing_ = 3;
+    append_taxa_runs(562, std::vector<tax_t>{562, 562}, results[0].runs_);
+    append_taxa_runs(0, std::vector<tax_t>(), results[1].runs_);
+    ks::string out(256u);
+    out.clear();
+    append_kraken_classification(results, bs, out);
+    REQUIRE(std::string(out.data(), out.size()) == "C\tr\t562,0\t10\tM:3\tA:0\t562:2\t|\tM:0\tA:0\t0:0\n");
+    out.clear();
+    append_fastq_classification(results, bs, out, false, true);
+    REQUIRE(std::string(out.data(), out.size()) == "r C\t562,0\t10\tM:3\tA:0\t|\tM:0\tA:0\nACGTACGTAC\n+\nIIIIIIIIII\n"
+                                                   "r C\t562,0\t10\tM:3\tA:0\t|\tM:0\tA:0\nACGTACGTAC\n+\nIIIIIIIIII\n");
+}
+
+TEST_CASE("InterleavedReads") {
+    {
+        std::ofstream ofs("__interleaved__.fq");
+        for(int i(0); i < 5; ++i)
+            ofs << "@r" << i << "/1\nACGT\n+\nIIII\n@r" << i << "/2\nTTGCA\n+\nIIIII\n";
+        ofs << "@orphan\nA\n+\nI\n";
+    }
+    gzFile fp(gzopen("__interleaved__.fq", "rb"));
+    kseq_t *ks(kseq_init(fp));
+    int n;
+    bseq1_t *seqs(bseq_read(1 << 20, &n, ks, ks));
+    REQUIRE(n == 10);
+    for(int i(0); i < n; ++i) {
+        REQUIRE(std::string(seqs[i].name) == "r" + std::to_string(i / 2));
+        REQUIRE(seqs[i].l_seq == (i & 1 ? 5: 4));
+        bseq_destroy(seqs + i);
+    }
+    std::free(seqs);
+    kseq_destroy(ks);
+    gzclose(fp);
+    REQUIRE(system("rm __interleaved__.fq") == 0);
+}
+
+TEST_CASE("BinaryOutput") {
+    char name[] = "r", seq[] = "ACGTACGTAC";
+    bseq1_t bs;
+    std::memset(&bs, 0, sizeof(bs));
+    bs.name = name, bs.seq = seq, bs.l_seq = 10;
+    for(const size_t ndb: {1, 2}) {
+        std::vector<ReadResult> results(ndb), text(ndb);
+        results[0].taxon_ = text[0].taxon_ = 562, results[0].missing_ = text[0].missing_ = 3;
+        const std::vector<tax_t> taxa{562, 562, 1, 562};
+        append_taxa_runs_binary(562, taxa, results[0].runs_);
+        append_taxa_runs(562, taxa, text[0].runs_);
+        if(ndb > 1) append_taxa_runs_binary(0, std::vector<tax_t>(), results[1].runs_), append_taxa_runs(0, std::vector<tax_t>(), text[1].runs_);
+        ks::string bin(256u), expected(256u);
+        bin.clear(), expected.clear();
+        BinaryHeader header;
+        header.ndb_ = ndb;
+        bin.putsn_(reinterpret_cast<const char *>(&header), sizeof(header));
+        append_binary_classification(results, &bs, 41, bin);
+        {
+            std::FILE *fp(std::fopen("__binary__.bin", "wb"));
+            bin.write(fp);
+            std::fclose(fp);
+        }
+        if(ndb == 1) append_kraken_classification(text[0].runs_, 562, 0, 3, &bs, expected);
+        else         append_kraken_classification(text, &bs, expected);
+        BinaryReader reader("__binary__.bin");
+        BinaryRecord rec;
+        REQUIRE(reader.next(rec));
+        REQUIRE(rec.index_ == 41);
+        REQUIRE(rec.results_[0].runs_.size() == 3);
+        ks::string out(256u);
+        out.clear();
+        std::vector<ReadResult> scratch;
+        append_decoded_classification(rec, "r", scratch, out);
+        REQUIRE(std::string(out.data(), out.size()) == std::string(expected.data(), expected.size()));
+        REQUIRE(!reader.next(rec));
+    }
+    REQUIRE(system("rm __binary__.bin") == 0);
+}
+
+TEST_CASE("FastxReader") {
+    // Multi-line FASTA, CRLF line ends, comments and a last line without a newline, spread over several blocks.
+    std::mt19937_64 mt(13);
+    std::string text;
+    for(int i(0); text.size() < 3 * FastxReader::BLOCK_SIZE; ++i) {
+        std::string seq(mt() % 700, 'A');
+        for(auto &c: seq) c = "ACGTN"[mt() % 5];
+        const bool fasta(i % 3 == 0), crlf(i % 7 == 0);
+        const char *nl(crlf ? "\r\n": "\n");
+        text += (fasta ? ">s": "@s") + std::to_string(i) + (i % 2 ? "/1 some comment": "") + nl;
+        for(size_t j(0); j < seq.size(); j += fasta ? 60: seq.size()) text += seq.substr(j, 60 + !fasta * seq.size()) + nl;
+        if(!fasta) text += std::string("+") + nl + std::string(seq.size(), 'I') + nl;
+    }
+    text += ">last\nACGT";
+    {
+        std::ofstream ofs("__fastx__.fa");
+        ofs << text;
+    }
+    gzFile fp(gzopen("__fastx__.fa", "rb"));
+    kseq_t *ks(kseq_init(fp));
+    InputStream in("__fastx__.fa");
+    FastxReader reader(&in, true);
+    std::vector<bseq1_t> seqs;
+    std::vector<FastxBlockPtr> blocks;
+    fastx_read_batch(reader, nullptr, std::numeric_limits<u64>::max(), seqs, blocks);
+    REQUIRE(blocks.size() > 1);
+    size_t n(0);
+    for(; kseq_read(ks) >= 0; ++n) {
+        REQUIRE(n < seqs.size());
+        trim_readno(&ks->name);
+        REQUIRE(std::string(seqs[n].name) == ks->name.s);
+        REQUIRE(std::string(seqs[n].comment ? seqs[n].comment: "") == std::string(ks->comment.s, ks->comment.l));
+        REQUIRE(std::string(seqs[n].seq, seqs[n].l_seq) == std::string(ks->seq.s, ks->seq.l));
+        REQUIRE(std::string(seqs[n].qual ? seqs[n].qual: "") == std::string(ks->qual.s, ks->qual.l));
+    }
+    REQUIRE(n == seqs.size());
+    // Batches that drop their blocks hand them back: reading the file again in small batches reuses a few blocks.
+    InputStream in2("__fastx__.fa");
+    reader.reset(&in2);
+    std::set<const char *> distinct;
+    size_t n2(0);
+    do {
+        blocks.clear();
+        fastx_read_batch(reader, nullptr, 1 << 20, seqs, blocks);
+        for(const auto &block: blocks) distinct.insert(block->data_.get());
+        n2 += seqs.size();
+    } while(seqs.size());
+    REQUIRE(n2 == n);
+    REQUIRE(distinct.size() <= 3);
+    kseq_destroy(ks);
+    gzclose(fp);
+    REQUIRE(system("rm __fastx__.fa") == 0);
+}
+
+TEST_CASE("InputStream") {
+    std::mt19937_64 mt(7);
+    std::string text;
+    while(text.size() < (5u << 20)) text += "@r" + std::to_string(mt() % 1000) + "\nACGT" + std::string(mt() % 200, "ACGT"[mt() % 4]) + "\n+\n";
+    {
+        // BGZF: gzip members of at most 64 KiB with a 'BC' extra subfield holding the member's size, then an empty one.
+        std::ofstream ofs("__input__.bgz", std::ios::binary);
+        for(size_t i(0); i <= text.size(); i += 60000) {
+            const size_t len(std::min(size_t(60000), text.size() - i));
+            unsigned char block[1 << 16];
+            z_stream strm;
+            std::memset(&strm, 0, sizeof(strm));
+            REQUIRE(deflateInit2(&strm, 1, Z_DEFLATED, -15, 8, Z_DEFAULT_STRATEGY) == Z_OK);
+            strm.next_in = reinterpret_cast<Bytef *>(&text[i]), strm.avail_in = len;
+            strm.next_out = block + 18, strm.avail_out = sizeof(block) - 26;
+            REQUIRE(deflate(&strm, Z_FINISH) == Z_STREAM_END);
+            const size_t size(18 + strm.total_out + 8);
+            deflateEnd(&strm);
+            const unsigned char header[18] {0x1f, 0x8b, 8, 4, 0, 0, 0, 0, 0, 0xff, 6, 0, 'B', 'C', 2, 0,
+                                            static_cast<unsigned char>((size - 1) & 0xff), static_cast<unsigned char>((size - 1) >> 8)};
+            std::memcpy(block, header, sizeof(header));
+            const u32 trailer[2] {u32(crc32(0, reinterpret_cast<const Bytef *>(&text[i]), len)), u32(len)};
+            std::memcpy(block + size - 8, trailer, sizeof(trailer));
+            ofs.write(reinterpret_cast<const char *>(block), size);
+            if(len == 0) break;
+        }
+    }
+    {
+        gzFile fp(gzopen("__input__.gz", "wb"));
+        gzwrite(fp, text.data(), text.size() / 2);
+        gzclose(fp);
+        fp = gzopen("__input__.gz", "ab"); // A second member
+        gzwrite(fp, text.data() + text.size() / 2, text.size() - text.size() / 2);
+        gzclose(fp);
+        std::ofstream("__input__.txt") << text;
+    }
+    for(const char *path: {"__input__.bgz", "__input__.gz", "__input__.txt"}) {
+        for(const int nthreads: {1, 3}) {
+            InputStream in(path, nthreads);
+            REQUIRE(in.format() == (path[10] == 'b' ? InputStream::BGZF: path[10] == 'g' ? InputStream::GZIP: InputStream::RAW));
+            std::string out;
+            char buf[12345];
+            for(size_t n; (n = in.read(buf, sizeof(buf))) > 0; out.append(buf, n));
+            REQUIRE(out == text);
+        }
+    }
+    REQUIRE_THROWS_AS(InputStream("__input__.none"), file_open_error);
+    REQUIRE(system("rm __input__.bgz __input__.gz __input__.txt") == 0);
+}
+
+TEST_CASE("OutputSink") {
+    // More buffers than one writev call takes, some of them empty.
+    std::vector<ks::string> bufs(3000);
+    std::string expected;
+    for(size_t i(0); i < bufs.size(); ++i) {
+        if(i % 7 == 0) continue;
+        const std::string s(std::to_string(i) + "\n");
+        bufs[i].putsn_(s.data(), s.size());
+        expected += s;
+    }
+    for(const bool compress: {false, true}) {
+        {
+            const int fd(::open("__sink__.txt", O_WRONLY | O_CREAT | O_TRUNC, 0644));
+            REQUIRE(fd >= 0);
+            {
+                OutputSink sink(fd, compress);
+                REQUIRE(sink.write(bufs.data(), bufs.size()));
+            }
+            ::close(fd);
+        }
+        gzFile fp(gzopen("__sink__.txt", "rb"));
+        std::string out(expected.size() + 1, '\0');
+        out.resize(gzread(fp, &out[0], out.size()));
+        gzclose(fp);
+        REQUIRE(out == expected);
+    }
+    REQUIRE(system("rm __sink__.txt") == 0);
+}